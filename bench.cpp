@@ -0,0 +1,216 @@
+// Throughput / latency benchmark. Runs the network on a packed dataset for a fixed time
+// and prints images/s, latency percentiles per batch and per layer, and host vs device time as JSON.
+// Every thread owns a cnn instance and runs batches back to back, cycling over the dataset.
+//
+// Usage: cnn_bench [--model FILE] [--kernel FILE] [--dataset FILE] [--backend cpu|opencl]
+//                  [--batch N] [--threads N] [--warmup BATCHES] [--duration SECONDS] [--layers on|off]
+//                  [--trace FILE] [--counters on|off]
+//
+// --trace writes a Chrome trace of the timed batches, see trace.cpp.
+// --counters on adds hardware counters per cpu layer, see perf.cpp.
+// --layers off disables the per-layer instrumentation, which synchronises the OpenCL queue after every kernel,
+// to measure end-to-end latency only.
+
+#include "cnn.cpp"
+#include "dataset.cpp"
+
+using namespace std;
+
+struct bench_options {
+    string model = "../model.txt";
+    string kernel = "../kernel.cl";
+    string dataset = "../mnist.bin";
+    string backend = "cpu";
+    size_t batch = 1;
+    unsigned threads = 1;
+    size_t warmup = 10;
+    double duration = 5;
+    bool layers = true; // Per-layer instrumentation.
+    string trace; // Chrome trace output, empty for none.
+    bool counters = false; // Hardware counters of the cpu layers.
+};
+
+// Samples of one bench thread, in seconds.
+struct bench_samples {
+    vector<double> batch_latency; // Wall time of every timed batch.
+    vector<vector<double>> layer_latency; // [layer][batch]
+    vector<string> layer_type;
+    vector<layer_cost> layer_costs;
+    vector<perf_sample> layer_counters; // [layer], summed over layer_counter_samples[layer] forwards.
+    vector<uint64_t> layer_counter_samples;
+    double device_time = 0; // Kernel time summed over all timed batches.
+    size_t images = 0;
+};
+
+// Nearest-rank percentile of sorted samples.
+double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = size_t(ceil(p / 100 * sorted.size()));
+    return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+void print_latency(ostream &os, vector<double> samples) {
+    sort(samples.begin(), samples.end());
+    os << "{\"p50_ms\": " << percentile(samples, 50) * 1e3
+       << ", \"p90_ms\": " << percentile(samples, 90) * 1e3
+       << ", \"p99_ms\": " << percentile(samples, 99) * 1e3
+       << ", \"max_ms\": " << (samples.empty() ? 0 : samples.back() * 1e3) << "}";
+}
+
+void run_thread(const bench_options &options, const packed_dataset &dataset, bench_samples &samples) {
+    cnn cnn_instance(dataset.C, dataset.H, dataset.W, 0, options.kernel, options.model);
+    cnn_instance.optimize();
+    cnn_instance.set_cpu_layout(BLOCKED);
+    bool opencl = options.backend == "opencl";
+    auto &layers = cnn_instance.get_layers();
+    for (auto layer:layers) {
+        samples.layer_type.push_back(layer->type());
+        samples.layer_costs.push_back(layer->cost());
+    }
+    samples.layer_latency.resize(layers.size());
+
+    size_t next = 0;
+    auto run_batch = [&]() {
+        for (size_t i = 0; i < options.batch; i++) {
+            const uint8_t *image = dataset.image(next);
+            next = (next + 1) % dataset.N;
+            if (opencl) cnn_instance.opencl_forward(image);
+            else cnn_instance.cpu_forward(image);
+        }
+    };
+    for (size_t i = 0; i < options.warmup; i++) run_batch();
+    for (auto layer:layers) layer->cpu_perf.reset();
+    if (!options.trace.empty()) tracer.enable(true);
+
+    // Per layer times are the growth of the accumulated layer times over one batch.
+    vector<double> before(layers.size());
+    auto layer_time = [&](size_t l) { return (opencl ? layers[l]->opencl_time : layers[l]->cpu_time).seconds(); };
+    auto start = steady_clock::now();
+    while (duration<double>(steady_clock::now() - start).count() < options.duration) {
+        for (size_t l = 0; l < layers.size(); l++) before[l] = layer_time(l);
+        auto op = steady_clock::now();
+        run_batch();
+        samples.batch_latency.push_back(duration<double>(steady_clock::now() - op).count());
+        for (size_t l = 0; l < layers.size(); l++) {
+            double t = layer_time(l) - before[l];
+            samples.layer_latency[l].push_back(t);
+            if (opencl) samples.device_time += t;
+        }
+        samples.images += options.batch;
+    }
+    for (auto layer:layers) {
+        perf_sample total{};
+        for (int i = 0; i < PERF_COUNTERS; i++) total[i] = layer->cpu_perf.values[i];
+        samples.layer_counters.push_back(total);
+        samples.layer_counter_samples.push_back(layer->cpu_perf.samples);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string key = argv[i], value = argv[i + 1];
+        if (key == "--model") options.model = value;
+        else if (key == "--kernel") options.kernel = value;
+        else if (key == "--dataset") options.dataset = value;
+        else if (key == "--backend") options.backend = value;
+        else if (key == "--batch") options.batch = max(1, atoi(value.c_str()));
+        else if (key == "--threads") options.threads = max(1, atoi(value.c_str()));
+        else if (key == "--warmup") options.warmup = atoi(value.c_str());
+        else if (key == "--duration") options.duration = atof(value.c_str());
+        else if (key == "--layers") options.layers = value != "off";
+        else if (key == "--trace") options.trace = value;
+        else if (key == "--counters") options.counters = value == "on";
+        else {
+            cout << "Unknown option: " << key << endl;
+            return 1;
+        }
+    }
+    if (argc % 2 == 0 || (options.backend != "cpu" && options.backend != "opencl")) {
+        cout << "Usage: " << argv[0] << " [--model FILE] [--kernel FILE] [--dataset FILE] [--backend cpu|opencl]\n"
+             << "       [--batch N] [--threads N] [--warmup BATCHES] [--duration SECONDS] [--layers on|off]\n"
+             << "       [--trace FILE] [--counters on|off]" << endl;
+        return 1;
+    }
+    set_instrumentation(options.layers);
+    if (options.counters && !set_perf_counters(true)) options.counters = false;
+    packed_dataset dataset;
+    if (!dataset.open(options.dataset) || dataset.N == 0) {
+        cout << "Cannot open " << options.dataset << ", create it with pack_dataset" << endl;
+        return 1;
+    }
+
+    vector<bench_samples> samples(options.threads);
+    vector<thread> threads;
+    auto start = steady_clock::now();
+    for (unsigned t = 0; t < options.threads; t++)
+        threads.emplace_back(run_thread, cref(options), cref(dataset), ref(samples[t]));
+    for (auto &t:threads) t.join();
+    double wall_time = duration<double>(steady_clock::now() - start).count();
+    tracer.enable(false);
+    if (!options.trace.empty() && !tracer.write(options.trace)) {
+        cout << "Cannot write " << options.trace << endl;
+        return 1;
+    }
+
+    // Merge the threads. They all run the same network.
+    bench_samples all = samples[0];
+    for (unsigned t = 1; t < options.threads; t++) {
+        auto &s = samples[t];
+        all.batch_latency.insert(all.batch_latency.end(), s.batch_latency.begin(), s.batch_latency.end());
+        for (size_t l = 0; l < s.layer_latency.size(); l++)
+            all.layer_latency[l].insert(all.layer_latency[l].end(), s.layer_latency[l].begin(), s.layer_latency[l].end());
+        all.device_time += s.device_time;
+        all.images += s.images;
+        for (size_t l = 0; l < s.layer_counters.size(); l++) {
+            for (int i = 0; i < PERF_COUNTERS; i++) all.layer_counters[l][i] += s.layer_counters[l][i];
+            all.layer_counter_samples[l] += s.layer_counter_samples[l];
+        }
+    }
+    double busy_time = accumulate(all.batch_latency.begin(), all.batch_latency.end(), 0.0);
+    double timed_wall = 0;
+    for (auto &s:samples) timed_wall = max(timed_wall, accumulate(s.batch_latency.begin(), s.batch_latency.end(), 0.0));
+
+    ostream &os = cout;
+    os << "{\n"
+       << "  \"model\": " << json_string(options.model) << ",\n"
+       << "  \"dataset\": " << json_string(options.dataset) << ",\n"
+       << "  \"backend\": \"" << options.backend << "\",\n"
+       << "  \"batch\": " << options.batch << ",\n"
+       << "  \"threads\": " << options.threads << ",\n"
+       << "  \"warmup\": " << options.warmup << ",\n"
+       << "  \"duration_s\": " << options.duration << ",\n"
+       << "  \"layers_instrumented\": " << (options.layers ? "true" : "false") << ",\n"
+       << "  \"wall_s\": " << wall_time << ",\n"
+       << "  \"images\": " << all.images << ",\n"
+       << "  \"images_per_s\": " << (timed_wall > 0 ? all.images / timed_wall : 0) << ",\n"
+       << "  \"host_s\": " << busy_time - all.device_time << ",\n"
+       << "  \"device_s\": " << all.device_time << ",\n"
+       << "  \"batch_latency\": ";
+    print_latency(os, all.batch_latency);
+    os << ",\n  \"layers\": [";
+    // Without instrumentation there are no per-layer times.
+    for (size_t l = 0; options.layers && l < all.layer_type.size(); l++) {
+        os << (l ? ",\n" : "\n") << "    {\"index\": " << l << ", \"type\": \"" << all.layer_type[l]
+           << "\", \"macs\": " << uint64_t(all.layer_costs[l].macs)
+           << ", \"bytes\": " << uint64_t(all.layer_costs[l].bytes())
+           << ", \"total_s\": " << accumulate(all.layer_latency[l].begin(), all.layer_latency[l].end(), 0.0)
+           << ", \"latency\": ";
+        print_latency(os, all.layer_latency[l]);
+        if (options.counters && all.layer_counter_samples[l]) {
+            // Mean per forward, available counters only.
+            os << ", \"counters\": {";
+            const char *separator = "";
+            for (int i = 0; i < PERF_COUNTERS; i++) {
+                if (!perf_available[i]) continue;
+                os << separator << json_string(PERF_COUNTER_NAMES[i]) << ": "
+                   << double(all.layer_counters[l][i]) / all.layer_counter_samples[l];
+                separator = ", ";
+            }
+            os << "}";
+        }
+        os << "}";
+    }
+    os << "\n  ]\n}" << endl;
+    return 0;
+}
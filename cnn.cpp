@@ -5,22 +5,70 @@
 #ifndef OPENCL_CNN_CONV_CNN_CPP
 #define OPENCL_CNN_CONV_CNN_CPP
 
-#define TEST_PART_TIME// test every single part time
-
 #include <CL/opencl.h>
 #include <FreeImage/FreeImage.h>
 #include "func.cpp"
+#include "model.cpp"
 #include "timer.cpp"
+#include "trace.cpp"
+#include "perf.cpp"
 
 using namespace std;
 
-int ret;
+thread_local int ret;
 #define check assert(ret==0);
 
+// Memory layout of cpu features. The blocked layout is described in func.cpp.
+enum cpu_layout {
+    PLANAR, // [C, H, W]
+    BLOCKED // [C / CB, H, W, CB]
+};
+
+// Feature shape [C, H, W]. Fc features are [C, 1, 1].
+struct feature_shape {
+    size_t C, H, W;
+};
+
+// Work of one forward through a layer, for roofline metrics. Bytes count every value once,
+// as if caches were perfect; activations use the planar sizes.
+struct layer_cost {
+    double macs = 0; // Multiply-adds of conv and fc.
+    double ops = 0; // Arithmetic operations, a multiply-add counts as 2.
+    double weight_bytes = 0; // Parameters: weights, bias, shift.
+    double input_bytes = 0, output_bytes = 0;
+
+    double bytes() const { return weight_bytes + input_bytes + output_bytes; }
+};
+
+// Raw pixel rows of an input image, as stored in an uncompressed BMP. See preprocess_layer.
+struct raw_image_format {
+    size_t H, W;
+    size_t pixel_bytes; // 1, 3 or 4
+    size_t row_stride; // Bytes from one stored row to the next, including padding.
+    size_t channel; // Byte of the pixel that becomes the network input.
+    bool bottom_up; // Rows are stored bottom row first.
+
+    size_t size() const { return H * row_stride; }
+};
+
+// Type of the values of a feature.
+enum value_type {
+    UINT8,
+    INT8,
+    INT32
+};
+
+inline size_t value_size(value_type type) { return type == INT32 ? sizeof(int32_t) : sizeof(uint8_t); }
+
+// layer::model_index of features that only exist after a graph rewrite.
+const size_t NO_MODEL_INDEX = SIZE_MAX;
+
 class layer {
 public:
-    // Time for forwarding propagation.
-    double cpu_time = 0, opencl_time = 0;
+    // Time for forwarding propagation, recorded while instrumentation is enabled.
+    latency_histogram cpu_time, opencl_time;
+    // Hardware counters of cpu_forward, recorded while they are enabled. See perf.cpp.
+    perf_totals cpu_perf;
     cl_event exec_event = nullptr;
 
     // Opencl related variables ( pointers )
@@ -44,11 +92,31 @@ public:
     // Initialize the layer
     // pass program and let subsidiary classes create kernels by themselves.
     explicit layer(cl_command_queue command_queue_) :
-            command_queue(command_queue_), cpu_time(0), opencl_time(0) {}
+            command_queue(command_queue_) {}
+
+    // Layout of the cpu_forward input and output.
+    cpu_layout layout = PLANAR;
+
+    // Index of the model layer whose output this layer reproduces, or NO_MODEL_INDEX.
+    // Set by cnn::parse_model_file and carried over by the graph rewrites.
+    size_t model_index = NO_MODEL_INDEX;
 
     // Pure virtual function that do cpu forward propagation.
     virtual void *cpu_forward(void *input) = 0;
 
+    // Pure virtual function that returns the output feature shape.
+    virtual feature_shape output_shape() = 0;
+
+    // Pure virtual function that returns the work of one forward.
+    virtual layer_cost cost() = 0;
+
+    // Pure virtual function that returns the type of the output values.
+    virtual value_type output_type() = 0;
+
+    // Switch cpu_forward to another layout. "input" is the shape of the feature this layer consumes.
+    // Layers with parameters rearrange them here.
+    virtual void set_cpu_layout(cpu_layout layout_, feature_shape input) { layout = layout_; }
+
     // Pure virtual function that set opencl kernel args
     virtual void opencl_set_args(cl_mem opencl_in) = 0;
 
@@ -56,7 +124,9 @@ public:
     // Calculate result and put result in "opencl_out" buffer, and return it.
     cl_mem opencl_forward(cl_mem opencl_in) {
         opencl_set_args(opencl_in);
-        // Execute kernel
+        // Execute kernel. The event is only needed for profiling and tracing.
+        bool timed = instrumentation_enabled(), traced = tracer.enabled();
+        uint64_t enqueue_ns = traced ? now_ns() : 0;
         ret = clEnqueueNDRangeKernel(command_queue,
                                      kernel,
                                      3, // Dimension
@@ -65,16 +135,25 @@ public:
                                      local_work_size, // Local work size
                                      0, // Number of events in wait list
                                      nullptr, // Wait list
-                                     &exec_event // Bounding event
+                                     timed || traced ? &exec_event : nullptr // Bounding event
         );
-#ifdef TEST_PART_TIME
-        accumulate_opencl_time();
-#endif
         check
+        if (traced) tracer.opencl_command(exec_event, type(), enqueue_ns);
+        if (timed) accumulate_opencl_time();
+        else if (traced) {
+            clReleaseEvent(exec_event);
+            exec_event = nullptr;
+        }
         // Get executing time;
         return opencl_out;
     };
 
+    // Release one of the "allocated" buffers before the layer is destroyed.
+    void release_buffer(cl_mem buffer) {
+        allocated.erase(find(allocated.begin(), allocated.end(), buffer));
+        clReleaseMemObject(buffer);
+    }
+
     virtual ~layer() {
         for (auto ptr:allocated) {
             clReleaseMemObject(ptr);
@@ -84,9 +163,43 @@ public:
 
     virtual string type() = 0;
 
-    virtual void report_cpu_time() { cout << type() << ": " << cpu_time << endl; }
+    virtual void report_cpu_time() { cout << type() << ": " << cpu_time.seconds() << ", " << cpu_time.summary() << endl; }
+
+    virtual void report_opencl_time() {
+        cout << type() << ": " << opencl_time.seconds() << ", " << opencl_time.summary() << endl;
+    }
+
+    // Output of the last cpu_forward as planar [C, H, W] values, for verification.
+    vector<int32_t> cpu_output() { return widen(cpu_out, layout); }
+
+    // Output of the last opencl_forward as planar [C, H, W] values. Waits for the queue.
+    vector<int32_t> opencl_output() {
+        auto shape = output_shape();
+        vector<uint8_t> buffer(shape.C * shape.H * shape.W * value_size(output_type()));
+        ret = clEnqueueReadBuffer(command_queue, opencl_out, CL_TRUE, 0, buffer.size(), buffer.data(),
+                                  0, nullptr, nullptr);
+        check
+        return widen(buffer.data(), PLANAR);
+    }
+
+    vector<int32_t> widen(const void *feature, cpu_layout feature_layout) {
+        switch (output_type()) {
+            case UINT8:
+                return widen_values((const uint8_t *) feature, feature_layout);
+            case INT8:
+                return widen_values((const int8_t *) feature, feature_layout);
+            default:
+                return widen_values((const int32_t *) feature, feature_layout);
+        }
+    }
 
-    virtual void report_opencl_time() { cout << type() << ": " << opencl_time << endl; }
+    template<class T>
+    vector<int32_t> widen_values(const T *feature, cpu_layout feature_layout) {
+        auto shape = output_shape();
+        vector<T> planar(feature, feature + shape.C * shape.H * shape.W);
+        if (feature_layout == BLOCKED) from_blocked(shape.C, shape.H, shape.W, feature, planar.data());
+        return vector<int32_t>(planar.begin(), planar.end());
+    }
 
     void accumulate_opencl_time() {
         clFinish(command_queue);
@@ -95,63 +208,269 @@ public:
         check
         ret = clGetEventProfilingInfo(exec_event, CL_PROFILING_COMMAND_END, sizeof(ed), &ed, nullptr);
         check
-        double kernel_time = double(ed - op) / 1e9;
-        opencl_time += kernel_time;
+        clReleaseEvent(exec_event);
+        exec_event = nullptr;
+        opencl_time.record(ed - op);
+    }
+};
+
+// Number of (output, kernel tap) pairs along one axis whose input position is inside the feature.
+inline size_t conv_taps(size_t in, size_t out, size_t K, size_t S, size_t P, size_t D) {
+    size_t taps = 0;
+    for (size_t k = 0; k < K; k++) {
+        auto range = conv_tap_range(int(k * D) - int(P), in, out, S);
+        taps += range.second - range.first;
+    }
+    return taps;
+}
+
+// Device copy of a sparse_rows, for the conv_sparse and fc_sparse kernels.
+struct opencl_sparse_rows {
+    cl_mem offset = nullptr, index = nullptr, value = nullptr;
+
+    // The buffers go to "allocated", so the layer releases them.
+    void create(cl_context context, const sparse_rows &sparse, vector<cl_mem> &allocated) {
+        offset = read_only_buffer(context, sparse.offset.data(), sparse.offset.size() * sizeof(uint32_t));
+        index = read_only_buffer(context, sparse.index.data(), sparse.index.size() * sizeof(uint16_t));
+        value = read_only_buffer(context, sparse.value.data(), sparse.value.size());
+        allocated.insert(allocated.end(), {offset, index, value});
+    }
+
+    // Set kernel arguments arg, arg + 1 and arg + 2. Returns the next argument.
+    cl_uint set_args(cl_kernel kernel, cl_uint arg) {
+        for (cl_mem *buffer:{&offset, &index, &value}) {
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), buffer);
+            check
+        }
+        return arg;
+    }
+
+    // Zero-sized buffers are invalid, and every weight of a layer may be zero.
+    static cl_mem read_only_buffer(cl_context context, const void *data, size_t bytes) {
+        cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | (bytes ? CL_MEM_COPY_HOST_PTR : 0),
+                                       max<size_t>(bytes, 1), bytes ? (void *) data : nullptr, &ret);
+        check
+        return buffer;
     }
 };
 
 class conv_layer : public layer {
 public:
     size_t CI, CO, H, W;
+    // Square kernel size, stride, zero padding and dilation.
+    size_t K, stride, pad, dilation;
+    size_t HO, WO;
+    // Use cpu_conv_generic / cpu_conv_blocked_generic instead of the fast paths. See cnn::set_generic_conv.
+    bool generic = false;
     cl_mem opencl_weight = nullptr;
     int8_t *cpu_weight = nullptr;
+    // Weight rearranged for the blocked layout. Created by set_cpu_layout.
+    int8_t *cpu_weight_blocked = nullptr;
+    // Fraction of nonzero weights. With "sparse" both backends only run the nonzero taps of every output channel,
+    // see cnn::set_sparse_threshold. The encodings are created by set_sparse.
+    double density;
+    bool sparse = false;
+    sparse_rows cpu_weight_sparse;
+    opencl_sparse_rows opencl_weight_sparse;
+    // Weights in [-8, 7] can be stored as int4 instead, see cnn::set_int4_weights. Then cpu_weight and
+    // cpu_weight_blocked are freed, the pack_int4 rows of every output channel (block) replace them, and
+    // opencl_weight holds the packed rows as well.
+    bool int4_range, int4 = false;
+    uint8_t *cpu_weight_int4 = nullptr, *cpu_weight_int4_blocked = nullptr;
+
+    string type() override { return sparse ? "conv_sparse" : int4 ? "conv_int4" : "conv"; }
+
+    value_type output_type() override { return INT32; }
+
+    feature_shape output_shape() override { return {CO, HO, WO}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        // Taps that fall into the zero padding are skipped, e.g. (3H - 2)(3W - 2) remain per plane pair for 3x3.
+        c.macs = double(CO) * CI * conv_taps(H, HO, K, stride, pad, dilation) *
+                 conv_taps(W, WO, K, stride, pad, dilation);
+        c.weight_bytes = int4 ? CO * int4_row_bytes(CI * K * K) : CO * CI * K * K;
+        if (sparse) {
+            // Assumes the nonzero taps are spread evenly over the kernel.
+            c.macs *= density;
+            c.weight_bytes = cpu_weight_sparse.bytes();
+        }
+        c.ops = 2 * c.macs;
+        c.input_bytes = CI * H * W;
+        c.output_bytes = CO * HO * WO * sizeof(int32_t);
+        return c;
+    }
+
+    bool is_3x3() const { return K == 3 && stride == 1 && pad == 1 && dilation == 1; }
+
+    bool is_1x1() const { return K == 1 && stride == 1 && pad == 0; }
 
-    string type() override { return "conv"; }
+    bool is_3x3s2() const { return K == 3 && stride == 2 && pad == 1 && dilation == 1; }
+
+    const char *kernel_name() const {
+        // 3x3, 3x3 stride 2 and 1x1 have their own kernels, everything else goes to conv_generic.
+        // conv_int4 takes any geometry.
+        if (sparse) return "conv_sparse";
+        if (int4) return "conv_int4";
+        return is_3x3() ? "conv" : is_3x3s2() ? "conv_3x3s2" : is_1x1() ? "conv_1x1" : "conv_generic";
+    }
+
+    // The [CO, CI, K, K] int8 weight. Unpacked into "buffer" while the layer stores int4 weights.
+    const int8_t *int8_weight(vector<int8_t> &buffer) const {
+        if (!int4) return cpu_weight;
+        buffer.resize(CO * CI * K * K);
+        unpack_int4(CO, CI * K * K, cpu_weight_int4, buffer.data());
+        return buffer.data();
+    }
+
+    // Device copy of cpu_weight, or of cpu_weight_int4. Released by the destructor.
+    cl_mem create_weight_buffer(cl_context context) {
+        size_t bytes = int4 ? CO * int4_row_bytes(CI * K * K) : CO * CI * K * K * sizeof(int8_t);
+        cl_mem buffer = clCreateBuffer(context,
+                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, // Token
+                                       bytes, // Size
+                                       int4 ? (void *) cpu_weight_int4 : (void *) cpu_weight, // Host ptr
+                                       &ret);
+        check
+        allocated.push_back(buffer);
+        return buffer;
+    }
+
+    // Store the weights as int4 on both backends, or back as int8. Stays int8 unless every weight is in [-8, 7].
+    // Call set_cpu_layout afterwards, which rebuilds the blocked weight.
+    void set_int4(cl_context context, cl_program program, bool on) {
+        on = on && int4_range;
+        if (on == int4) return;
+        size_t taps = CI * K * K;
+        if (on) {
+            cpu_weight_int4 = pack_int4(CO, taps, cpu_weight);
+            delete[] cpu_weight;
+            cpu_weight = nullptr;
+        } else {
+            cpu_weight = new int8_t[CO * taps];
+            unpack_int4(CO, taps, cpu_weight_int4, cpu_weight);
+            delete[] cpu_weight_int4;
+            cpu_weight_int4 = nullptr;
+        }
+        delete[] cpu_weight_blocked;
+        delete[] cpu_weight_int4_blocked;
+        cpu_weight_blocked = nullptr;
+        cpu_weight_int4_blocked = nullptr;
+        int4 = on;
+        release_buffer(opencl_weight);
+        opencl_weight = create_weight_buffer(context);
+        clReleaseKernel(kernel);
+        kernel = clCreateKernel(program, kernel_name(), &ret);
+        check
+    }
+
+    // Switch both backends to the sparse kernels, or back to the dense ones.
+    void set_sparse(cl_context context, cl_program program, bool on) {
+        on = on && CI * K * K <= SPARSE_MAX_COLUMNS;
+        if (on == sparse) return;
+        if (on && cpu_weight_sparse.offset.empty()) {
+            vector<int8_t> buffer;
+            cpu_weight_sparse = compress_rows(CO, CI * K * K, CI * K * K, 1, int8_weight(buffer));
+            opencl_weight_sparse.create(context, cpu_weight_sparse, allocated);
+        }
+        sparse = on;
+        clReleaseKernel(kernel);
+        kernel = clCreateKernel(program, kernel_name(), &ret);
+        check
+    }
 
     conv_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
-               size_t CI_, size_t CO_, size_t H_, size_t W_, int8_t *weight_ptr) :
+               size_t CI_, size_t CO_, size_t H_, size_t W_, int8_t *weight_ptr,
+               size_t K_ = 3, size_t stride_ = 1, size_t pad_ = 1, size_t dilation_ = 1) :
             layer(command_queue_),
-            CI(CI_), CO(CO_), H(H_), W(W_) {
-        // Create kernel
-        kernel = clCreateKernel(program_, "conv", &ret);
+            CI(CI_), CO(CO_), H(H_), W(W_), K(K_), stride(stride_), pad(pad_), dilation(dilation_) {
+        HO = conv_output_size(H, K, stride, pad, dilation);
+        WO = conv_output_size(W, K, stride, pad, dilation);
+        // Create kernel.
+        kernel = clCreateKernel(program_, kernel_name(), &ret);
         check
         // Save cpu opencl_weight and allocate space for cpu output
         cpu_weight = weight_ptr;
-        cpu_out = new int32_t[CO * H * W];
+        density = weight_density(CO * CI * K * K, cpu_weight);
+        int4_range = fits_int4(CO * CI * K * K, cpu_weight);
+        cpu_out = new int32_t[blocked_channels(CO) * HO * WO]();
         // Create opencl_weight and result buffer;
-        opencl_weight = clCreateBuffer(context_,
-                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, // Token
-                                       CO * CI * 3 * 3 * sizeof(int8_t), // Size
-                                       (void *) weight_ptr, // Host ptr
-                                       &ret);
-        check
+        opencl_weight = create_weight_buffer(context_);
         // Create output buffer.
         opencl_out = clCreateBuffer(context_,
                                     CL_MEM_READ_WRITE, // Token
-                                    CO * H * W * sizeof(int32_t), // Size
+                                    CO * HO * WO * sizeof(int32_t), // Size
                                     nullptr, // Host ptr
                                     &ret);
         check
         // Record allocated cl mem
-        allocated.push_back(opencl_weight);
         allocated.push_back(opencl_out);
         // Specify work dimension
-        global_work_size = new size_t[3]{H, W, CO};
+        global_work_size = new size_t[3]{HO, WO, CO};
         local_work_size = nullptr;
 
     }
 
     void *cpu_forward(void *input) override {
-        start_timer();
+        scoped_timer timer(cpu_time);
         // Call cpu version conv function here
-        cpu_conv(CI, CO, H, W,
-                 (const int8_t *) cpu_weight,
-                 (const uint8_t *) input,
-                 (int32_t *) cpu_out);
-        cpu_time += end_timer();
+        if (layout == BLOCKED) {
+            if (sparse)
+                cpu_conv_blocked_sparse(CI, CO, H, W, K, stride, pad, dilation, HO, WO,
+                                        cpu_weight_sparse,
+                                        (const uint8_t *) input,
+                                        (int32_t *) cpu_out);
+            else if (int4)
+                cpu_conv_blocked_int4(CI, CO, H, W, K, stride, pad, dilation, HO, WO, generic,
+                                      cpu_weight_int4_blocked,
+                                      (const uint8_t *) input,
+                                      (int32_t *) cpu_out);
+            else if (generic)
+                cpu_conv_blocked_generic(CI, CO, H, W, K, stride, pad, dilation, HO, WO,
+                                         (const int8_t *) cpu_weight_blocked,
+                                         (const uint8_t *) input,
+                                         (int32_t *) cpu_out);
+            else
+                cpu_conv_blocked_any(CI, CO, H, W, K, stride, pad, dilation, HO, WO,
+                                     (const int8_t *) cpu_weight_blocked,
+                                     (const uint8_t *) input,
+                                     (int32_t *) cpu_out);
+        } else {
+            if (sparse)
+                cpu_conv_sparse(CI, CO, H, W, K, stride, pad, dilation, HO, WO,
+                                cpu_weight_sparse,
+                                (const uint8_t *) input,
+                                (int32_t *) cpu_out);
+            else if (int4)
+                cpu_conv_int4(CI, CO, H, W, K, stride, pad, dilation, HO, WO, generic,
+                              cpu_weight_int4,
+                              (const uint8_t *) input,
+                              (int32_t *) cpu_out);
+            else if (generic)
+                cpu_conv_generic(CI, CO, H, W, K, stride, pad, dilation, HO, WO,
+                                 (const int8_t *) cpu_weight,
+                                 (const uint8_t *) input,
+                                 (int32_t *) cpu_out);
+            else
+                cpu_conv_any(CI, CO, H, W, K, stride, pad, dilation, HO, WO,
+                             (const int8_t *) cpu_weight,
+                             (const uint8_t *) input,
+                             (int32_t *) cpu_out);
+        }
         return cpu_out;
     }
 
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        layout = layout_;
+        if (layout != BLOCKED) return;
+        if (int4 && !cpu_weight_int4_blocked) {
+            vector<int8_t> buffer;
+            unique_ptr<int8_t[]> blocked(block_conv_weight(CI, CO, K, int8_weight(buffer)));
+            cpu_weight_int4_blocked = pack_int4(blocked_channels(CO) / CB, CI * K * K * CB, blocked.get());
+        }
+        if (!int4 && !cpu_weight_blocked) cpu_weight_blocked = block_conv_weight(CI, CO, K, cpu_weight);
+    }
+
     //  Set argument and execute kernel.
     void opencl_set_args(cl_mem opencl_in) override {
         // input is uint8_t
@@ -166,47 +485,385 @@ public:
         check
         ret = clSetKernelArg(kernel, 3, sizeof(cl_ulong), &W);
         check
-        ret = clSetKernelArg(kernel, 4, sizeof(cl_mem), &opencl_weight);
-        check
-        ret = clSetKernelArg(kernel, 5, sizeof(cl_mem), &opencl_in);
+        cl_uint arg = 4;
+        if (sparse || int4 || (!is_3x3() && !is_3x3s2() && !is_1x1())) {
+            // conv_generic, conv_sparse and conv_int4 also take the geometry and the output size.
+            for (size_t *value:{&K, &stride, &pad, &dilation, &HO, &WO}) {
+                ret = clSetKernelArg(kernel, arg++, sizeof(cl_ulong), value);
+                check
+            }
+        } else if (is_3x3s2()) {
+            // conv_3x3s2 takes the output size.
+            for (size_t *value:{&HO, &WO}) {
+                ret = clSetKernelArg(kernel, arg++, sizeof(cl_ulong), value);
+                check
+            }
+        }
+        if (sparse) arg = opencl_weight_sparse.set_args(kernel, arg);
+        else {
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_weight);
+            check
+        }
+        ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_in);
         check
-        ret = clSetKernelArg(kernel, 6, sizeof(cl_mem), &opencl_out);
+        ret = clSetKernelArg(kernel, arg, sizeof(cl_mem), &opencl_out);
         check
     }
 
     ~conv_layer() override {
         delete[] cpu_weight;
+        delete[] cpu_weight_blocked;
+        delete[] cpu_weight_int4;
+        delete[] cpu_weight_int4_blocked;
         delete[] (int32_t *) cpu_out;
     }
 };
 
+// Base of the depthwise and pointwise conv layers. Either writes the int32 accumulators, or takes over the
+// bias and shift of the following quan (and the following relu) and requantizes in the same pass.
+// The fused layers are created by cnn::fuse_conv_quan.
+class requant_conv_layer : public layer {
+public:
+    size_t CO, HO, WO; // Output shape.
+    // Bias and shift of the fused quan, nullptr if not fused.
+    int32_t *cpu_bias = nullptr;
+    uint8_t *cpu_shift = nullptr;
+    bool relu = false;
+    // Bias and shift padded to blocked_channels(CO). Created by set_cpu_layout.
+    int32_t *cpu_bias_blocked = nullptr;
+    uint8_t *cpu_shift_blocked = nullptr;
+    cl_mem opencl_bias = nullptr, opencl_shift = nullptr;
+    // Use the cpu_conv_generic based planar reference instead of the dedicated kernel. See cnn::set_generic_conv.
+    bool generic = false;
+    // One planar output plane of accumulators, for the planar epilogue and the generic path.
+    int32_t *cpu_acc = nullptr;
+
+    bool fused() const { return cpu_bias != nullptr; }
+
+    value_type output_type() override { return !fused() ? INT32 : relu ? UINT8 : INT8; }
+
+    feature_shape output_shape() override { return {CO, HO, WO}; }
+
+    // Appended to the type of fused layers.
+    string fused_suffix() const { return !fused() ? "" : relu ? "_quan_relu" : "_quan"; }
+
+    requant_conv_layer(cl_context context_, cl_command_queue command_queue_, size_t CO_, size_t HO_, size_t WO_,
+                       int32_t *bias_ptr, uint8_t *shift_ptr, bool relu_) :
+            layer(command_queue_), CO(CO_), HO(HO_), WO(WO_), cpu_bias(bias_ptr), cpu_shift(shift_ptr), relu(relu_) {
+        cpu_acc = new int32_t[HO * WO]();
+        if (fused()) cpu_out = new uint8_t[blocked_channels(CO) * HO * WO]();
+        else cpu_out = new int32_t[blocked_channels(CO) * HO * WO]();
+        if (fused()) {
+            opencl_bias = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, CO * sizeof(int32_t),
+                                         (void *) bias_ptr, &ret);
+            check
+            opencl_shift = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, CO * sizeof(uint8_t),
+                                          (void *) shift_ptr, &ret);
+            check
+            allocated.push_back(opencl_bias);
+            allocated.push_back(opencl_shift);
+        }
+        opencl_out = clCreateBuffer(context_, CL_MEM_READ_WRITE, CO * HO * WO * value_size(output_type()), nullptr,
+                                    &ret);
+        check
+        allocated.push_back(opencl_out);
+    }
+
+    // The same layer with the quan (and relu) fused. Takes over the weight of this layer, bias and shift.
+    virtual requant_conv_layer *with_epilogue(cl_context context_, cl_program program_,
+                                              int32_t *bias_ptr, uint8_t *shift_ptr, bool relu_) = 0;
+
+    conv_epilogue epilogue() {
+        conv_epilogue e;
+        if (fused()) {
+            e.bias = layout == BLOCKED ? cpu_bias_blocked : cpu_bias;
+            e.shift = layout == BLOCKED ? cpu_shift_blocked : cpu_shift;
+            e.relu = relu;
+        }
+        return e;
+    }
+
+    // Work of the epilogue, on top of the conv itself.
+    void add_epilogue_cost(layer_cost &c) {
+        c.output_bytes = CO * HO * WO * value_size(output_type());
+        if (!fused()) return;
+        c.ops += (relu ? 3.0 : 2.0) * CO * HO * WO;
+        c.weight_bytes += CO * (sizeof(int32_t) + sizeof(uint8_t));
+    }
+
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        layout = layout_;
+        if (layout == BLOCKED && fused() && !cpu_bias_blocked) {
+            cpu_bias_blocked = new int32_t[blocked_channels(CO)]();
+            cpu_shift_blocked = new uint8_t[blocked_channels(CO)]();
+            copy(cpu_bias, cpu_bias + CO, cpu_bias_blocked);
+            copy(cpu_shift, cpu_shift + CO, cpu_shift_blocked);
+        }
+    }
+
+    // Kernel arguments from "arg" on: bias, shift and relu of the _quan kernels, then the output.
+    void set_epilogue_args(cl_uint arg) {
+        if (fused()) {
+            cl_int relu_arg = relu;
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_bias);
+            check
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_shift);
+            check
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_int), &relu_arg);
+            check
+        }
+        ret = clSetKernelArg(kernel, arg, sizeof(cl_mem), &opencl_out);
+        check
+    }
+
+    ~requant_conv_layer() override {
+        delete[] cpu_bias;
+        delete[] cpu_shift;
+        delete[] cpu_bias_blocked;
+        delete[] cpu_shift_blocked;
+        delete[] cpu_acc;
+        if (fused()) delete[] (uint8_t *) cpu_out;
+        else delete[] (int32_t *) cpu_out;
+    }
+};
+
+// Depthwise conv: every channel is convolved with its own K x K filter. See cpu_dwconv.
+class dwconv_layer : public requant_conv_layer {
+public:
+    size_t C, H, W;
+    // Square kernel size, stride, zero padding and dilation.
+    size_t K, stride, pad, dilation;
+    cl_mem opencl_weight = nullptr;
+    int8_t *cpu_weight = nullptr;
+    // Weight rearranged for the blocked layout. Created by set_cpu_layout.
+    int8_t *cpu_weight_blocked = nullptr;
+
+    string type() override { return "dwconv" + fused_suffix(); }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.macs = double(C) * conv_taps(H, HO, K, stride, pad, dilation) * conv_taps(W, WO, K, stride, pad, dilation);
+        c.ops = 2 * c.macs;
+        c.weight_bytes = C * K * K;
+        c.input_bytes = C * H * W;
+        add_epilogue_cost(c);
+        return c;
+    }
+
+    dwconv_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
+                 size_t C_, size_t H_, size_t W_, int8_t *weight_ptr,
+                 size_t K_ = 3, size_t stride_ = 1, size_t pad_ = 1, size_t dilation_ = 1,
+                 int32_t *bias_ptr = nullptr, uint8_t *shift_ptr = nullptr, bool relu_ = false) :
+            requant_conv_layer(context_, command_queue_, C_, conv_output_size(H_, K_, stride_, pad_, dilation_),
+                               conv_output_size(W_, K_, stride_, pad_, dilation_), bias_ptr, shift_ptr, relu_),
+            C(C_), H(H_), W(W_), K(K_), stride(stride_), pad(pad_), dilation(dilation_) {
+        // Create kernel
+        kernel = clCreateKernel(program_, fused() ? "dwconv_quan" : "dwconv", &ret);
+        check
+        cpu_weight = weight_ptr;
+        opencl_weight = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, C * K * K * sizeof(int8_t),
+                                       (void *) weight_ptr, &ret);
+        check
+        allocated.push_back(opencl_weight);
+        // Specify work dimension
+        global_work_size = new size_t[3]{HO, WO, C};
+        local_work_size = nullptr;
+    }
+
+    requant_conv_layer *with_epilogue(cl_context context_, cl_program program_,
+                                      int32_t *bias_ptr, uint8_t *shift_ptr, bool relu_) override {
+        auto fused_layer = new dwconv_layer(context_, command_queue, program_, C, H, W, cpu_weight,
+                                            K, stride, pad, dilation, bias_ptr, shift_ptr, relu_);
+        cpu_weight = nullptr;
+        fused_layer->generic = generic;
+        return fused_layer;
+    }
+
+    void *cpu_forward(void *input) override {
+        scoped_timer timer(cpu_time);
+        if (layout == BLOCKED)
+            cpu_dwconv_blocked(C, H, W, K, stride, pad, dilation, HO, WO, cpu_weight_blocked,
+                               (const uint8_t *) input, epilogue(), cpu_out);
+        else if (generic)
+            cpu_dwconv_generic(C, H, W, K, stride, pad, dilation, HO, WO, cpu_weight,
+                               (const uint8_t *) input, epilogue(), cpu_acc, cpu_out);
+        else
+            cpu_dwconv(C, H, W, K, stride, pad, dilation, HO, WO, cpu_weight,
+                       (const uint8_t *) input, epilogue(), cpu_acc, cpu_out);
+        return cpu_out;
+    }
+
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        requant_conv_layer::set_cpu_layout(layout_, input);
+        if (layout == BLOCKED && !cpu_weight_blocked) cpu_weight_blocked = block_dwconv_weight(C, K, cpu_weight);
+    }
+
+    void opencl_set_args(cl_mem opencl_in) override {
+        cl_uint arg = 0;
+        for (size_t *value:{&C, &H, &W, &K, &stride, &pad, &dilation, &HO, &WO}) {
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_ulong), value);
+            check
+        }
+        ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_weight);
+        check
+        ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_in);
+        check
+        set_epilogue_args(arg);
+    }
+
+    ~dwconv_layer() override {
+        delete[] cpu_weight;
+        delete[] cpu_weight_blocked;
+    }
+};
+
+// Pointwise (1x1) conv, run as an int8 GEMM. See cpu_pwconv.
+class pwconv_layer : public requant_conv_layer {
+public:
+    size_t CI, H, W, HW;
+    cl_mem opencl_weight = nullptr;
+    int8_t *cpu_weight = nullptr;
+    // Weight pairs for cpu_pwconv, see pack_pwconv_weight.
+    int32_t *cpu_weight_packed = nullptr;
+    // Weight rearranged for the blocked layout. Created by set_cpu_layout.
+    int8_t *cpu_weight_blocked = nullptr;
+
+    string type() override { return "pwconv" + fused_suffix(); }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.macs = double(CI) * CO * HW;
+        c.ops = 2 * c.macs;
+        c.weight_bytes = CI * CO;
+        c.input_bytes = CI * HW;
+        add_epilogue_cost(c);
+        return c;
+    }
+
+    pwconv_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
+                 size_t CI_, size_t CO_, size_t H_, size_t W_, int8_t *weight_ptr,
+                 int32_t *bias_ptr = nullptr, uint8_t *shift_ptr = nullptr, bool relu_ = false) :
+            requant_conv_layer(context_, command_queue_, CO_, H_, W_, bias_ptr, shift_ptr, relu_),
+            CI(CI_), H(H_), W(W_), HW(H_ * W_) {
+        // Create kernel
+        kernel = clCreateKernel(program_, fused() ? "pwconv_quan" : "pwconv", &ret);
+        check
+        cpu_weight = weight_ptr;
+        cpu_weight_packed = pack_pwconv_weight(CI, CO, weight_ptr);
+        opencl_weight = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, CO * CI * sizeof(int8_t),
+                                       (void *) weight_ptr, &ret);
+        check
+        allocated.push_back(opencl_weight);
+        // Specify work dimension. Every work item computes 4 output channels of one pixel.
+        global_work_size = new size_t[3]{HW, (CO + 3) / 4, 1};
+        local_work_size = nullptr;
+    }
+
+    requant_conv_layer *with_epilogue(cl_context context_, cl_program program_,
+                                      int32_t *bias_ptr, uint8_t *shift_ptr, bool relu_) override {
+        auto fused_layer = new pwconv_layer(context_, command_queue, program_, CI, CO, H, W, cpu_weight,
+                                            bias_ptr, shift_ptr, relu_);
+        cpu_weight = nullptr;
+        fused_layer->generic = generic;
+        return fused_layer;
+    }
+
+    void *cpu_forward(void *input) override {
+        scoped_timer timer(cpu_time);
+        if (layout == BLOCKED)
+            cpu_pwconv_blocked(CI, CO, HW, cpu_weight_blocked, (const uint8_t *) input, epilogue(), cpu_out);
+        else if (generic)
+            cpu_pwconv_generic(CI, CO, H, W, cpu_weight, (const uint8_t *) input, epilogue(), cpu_acc, cpu_out);
+        else
+            cpu_pwconv(CI, CO, HW, cpu_weight_packed, (const uint8_t *) input, epilogue(), cpu_out);
+        return cpu_out;
+    }
+
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        requant_conv_layer::set_cpu_layout(layout_, input);
+        if (layout == BLOCKED && !cpu_weight_blocked) cpu_weight_blocked = block_conv_weight(CI, CO, 1, cpu_weight);
+    }
+
+    void opencl_set_args(cl_mem opencl_in) override {
+        ret = clSetKernelArg(kernel, 0, sizeof(cl_ulong), &CI);
+        check
+        ret = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &CO);
+        check
+        ret = clSetKernelArg(kernel, 2, sizeof(cl_ulong), &HW);
+        check
+        ret = clSetKernelArg(kernel, 3, sizeof(cl_mem), &opencl_weight);
+        check
+        ret = clSetKernelArg(kernel, 4, sizeof(cl_mem), &opencl_in);
+        check
+        set_epilogue_args(5);
+    }
+
+    ~pwconv_layer() override {
+        delete[] cpu_weight;
+        delete[] cpu_weight_packed;
+        delete[] cpu_weight_blocked;
+    }
+};
+
 class fc_layer : public layer {
 public:
     size_t CI, CO;
 
     cl_mem opencl_weight;
     int8_t *cpu_weight;
-
-    string type() override { return "fc"; }
+    // Weight rearranged for the blocked layout, [CIB, COB]. Created by set_cpu_layout.
+    int8_t *cpu_weight_blocked = nullptr;
+    size_t CIB = 0, COB = 0;
+    // Fraction of nonzero weights. With "sparse" both backends only run the nonzero weights, see
+    // cnn::set_sparse_threshold. The cpu encodings have a row per input, so zero inputs skip their row, and the
+    // device one a row per output, for one work item per output. Created by set_sparse and set_cpu_layout.
+    double density;
+    bool sparse = false;
+    sparse_rows cpu_weight_sparse, cpu_weight_sparse_blocked;
+    opencl_sparse_rows opencl_weight_sparse;
+    // Weights in [-8, 7] can be stored as int4 instead, see cnn::set_int4_weights. Then cpu_weight and
+    // cpu_weight_blocked are freed, the pack_int4 rows of every input replace them, and opencl_weight holds the
+    // packed rows as well.
+    bool int4_range, int4 = false;
+    uint8_t *cpu_weight_int4 = nullptr, *cpu_weight_int4_blocked = nullptr;
+
+    string type() override { return sparse ? "fc_sparse" : int4 ? "fc_int4" : "fc"; }
+
+    const char *kernel_name() const { return sparse ? "fc_sparse" : int4 ? "fc_int4" : "fc"; }
+
+    value_type output_type() override { return INT32; }
+
+    feature_shape output_shape() override { return {CO, 1, 1}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.macs = double(CI) * CO;
+        c.weight_bytes = int4 ? CI * int4_row_bytes(CO) : CI * CO;
+        if (sparse) {
+            c.macs *= density;
+            c.weight_bytes = cpu_weight_sparse.bytes();
+        }
+        c.ops = 2 * c.macs;
+        c.input_bytes = CI;
+        c.output_bytes = CO * sizeof(int32_t);
+        return c;
+    }
 
     fc_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
              size_t CI_, size_t CO_, int8_t *weight_ptr) :
             layer(command_queue_), CI(CI_), CO(CO_) {
         // Create kernel
-        kernel = clCreateKernel(program_, "fc", &ret);
+        kernel = clCreateKernel(program_, kernel_name(), &ret);
         check
 
         // Save cpu weight and allocate space for cpu output
         cpu_weight = weight_ptr;
-        cpu_out = new int32_t[CO];
+        density = weight_density(CI * CO, cpu_weight);
+        int4_range = fits_int4(CI * CO, cpu_weight);
+        cpu_out = new int32_t[blocked_channels(CO)]();
 
         // Create opencl_weight and result buffer;
-        opencl_weight = clCreateBuffer(context_,
-                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, // token
-                                       CI * CO * sizeof(int8_t), // size
-                                       (void *) weight_ptr, // host ptr
-                                       &ret);
-        check
+        opencl_weight = create_weight_buffer(context_);
         opencl_out = clCreateBuffer(context_,
                                     CL_MEM_READ_WRITE,
                                     CO * sizeof(int32_t),
@@ -214,7 +871,6 @@ public:
                                     &ret);
         check
 
-        allocated.push_back(opencl_weight);
         allocated.push_back(opencl_out);
 
         // Specify work dimension
@@ -228,24 +884,122 @@ public:
         check
         ret = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &CO);
         check
-        ret = clSetKernelArg(kernel, 2, sizeof(cl_mem), &opencl_weight);
+        cl_uint arg = 2;
+        if (sparse) arg = opencl_weight_sparse.set_args(kernel, arg);
+        else {
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_weight);
+            check
+        }
+        ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_in);
         check
-        ret = clSetKernelArg(kernel, 3, sizeof(cl_mem), &opencl_in);
+        ret = clSetKernelArg(kernel, arg, sizeof(cl_mem), &opencl_out);
         check
-        ret = clSetKernelArg(kernel, 4, sizeof(cl_mem), &opencl_out);
+    }
+
+    // The [CI, CO] int8 weight. Unpacked into "buffer" while the layer stores int4 weights.
+    const int8_t *int8_weight(vector<int8_t> &buffer) const {
+        if (!int4) return cpu_weight;
+        buffer.resize(CI * CO);
+        unpack_int4(CI, CO, cpu_weight_int4, buffer.data());
+        return buffer.data();
+    }
+
+    // Device copy of cpu_weight, or of cpu_weight_int4. Released by the destructor.
+    cl_mem create_weight_buffer(cl_context context) {
+        size_t bytes = int4 ? CI * int4_row_bytes(CO) : CI * CO * sizeof(int8_t);
+        cl_mem buffer = clCreateBuffer(context,
+                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, // token
+                                       bytes, // size
+                                       int4 ? (void *) cpu_weight_int4 : (void *) cpu_weight, // host ptr
+                                       &ret);
+        check
+        allocated.push_back(buffer);
+        return buffer;
+    }
+
+    // Store the weights as int4 on both backends, or back as int8. Stays int8 unless every weight is in [-8, 7].
+    // Call set_cpu_layout afterwards, which rebuilds the blocked weight.
+    void set_int4(cl_context context, cl_program program, bool on) {
+        on = on && int4_range;
+        if (on == int4) return;
+        if (on) {
+            cpu_weight_int4 = pack_int4(CI, CO, cpu_weight);
+            delete[] cpu_weight;
+            cpu_weight = nullptr;
+        } else {
+            cpu_weight = new int8_t[CI * CO];
+            unpack_int4(CI, CO, cpu_weight_int4, cpu_weight);
+            delete[] cpu_weight_int4;
+            cpu_weight_int4 = nullptr;
+        }
+        delete[] cpu_weight_blocked;
+        delete[] cpu_weight_int4_blocked;
+        cpu_weight_blocked = nullptr;
+        cpu_weight_int4_blocked = nullptr;
+        int4 = on;
+        release_buffer(opencl_weight);
+        opencl_weight = create_weight_buffer(context);
+        clReleaseKernel(kernel);
+        kernel = clCreateKernel(program, kernel_name(), &ret);
+        check
+    }
+
+    // Switch both backends to the sparse kernels, or back to the dense ones. Call set_cpu_layout afterwards.
+    void set_sparse(cl_context context, cl_program program, bool on) {
+        on = on && CI <= SPARSE_MAX_COLUMNS && blocked_channels(CO) <= SPARSE_MAX_COLUMNS;
+        if (on == sparse) return;
+        if (on && cpu_weight_sparse.offset.empty()) {
+            vector<int8_t> buffer;
+            const int8_t *weight = int8_weight(buffer);
+            cpu_weight_sparse = compress_rows(CI, CO, CO, 1, weight);
+            // The transpose: row co holds weight[ci * CO + co] of every ci.
+            opencl_weight_sparse.create(context, compress_rows(CO, CI, 1, CO, weight), allocated);
+        }
+        sparse = on;
+        clReleaseKernel(kernel);
+        kernel = clCreateKernel(program, kernel_name(), &ret);
         check
     }
 
     void *cpu_forward(void *input) override {
-        start_timer();
-        cpu_fc(CI, CO, (const int8_t *) cpu_weight, (const uint8_t *) input, (int32_t *) cpu_out);
-        cpu_time += end_timer();
+        scoped_timer timer(cpu_time);
+        // A [CO] feature is the same in both layouts, so the blocked fc is a plain fc on padded weight.
+        if (sparse && layout == BLOCKED)
+            cpu_fc_sparse(CIB, COB, cpu_weight_sparse_blocked, (const uint8_t *) input, (int32_t *) cpu_out);
+        else if (sparse)
+            cpu_fc_sparse(CI, CO, cpu_weight_sparse, (const uint8_t *) input, (int32_t *) cpu_out);
+        else if (int4 && layout == BLOCKED)
+            cpu_fc_int4(CIB, COB, cpu_weight_int4_blocked, (const uint8_t *) input, (int32_t *) cpu_out);
+        else if (int4)
+            cpu_fc_int4(CI, CO, cpu_weight_int4, (const uint8_t *) input, (int32_t *) cpu_out);
+        else if (layout == BLOCKED)
+            cpu_fc(CIB, COB, (const int8_t *) cpu_weight_blocked, (const uint8_t *) input, (int32_t *) cpu_out);
+        else
+            cpu_fc(CI, CO, (const int8_t *) cpu_weight, (const uint8_t *) input, (int32_t *) cpu_out);
         return cpu_out;
     }
 
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        layout = layout_;
+        if (layout != BLOCKED) return;
+        assert(input.C * input.H * input.W == CI);
+        CIB = blocked_channels(input.C) * input.H * input.W;
+        COB = blocked_channels(CO);
+        bool missing_dense = int4 ? !cpu_weight_int4_blocked : !cpu_weight_blocked;
+        bool missing_sparse = sparse && cpu_weight_sparse_blocked.offset.empty();
+        if (!missing_dense && !missing_sparse) return;
+        vector<int8_t> buffer;
+        unique_ptr<int8_t[]> blocked(block_fc_weight(input.C, input.H, input.W, CO, int8_weight(buffer)));
+        if (missing_sparse) cpu_weight_sparse_blocked = compress_rows(CIB, COB, COB, 1, blocked.get());
+        if (missing_dense && int4) cpu_weight_int4_blocked = pack_int4(CIB, COB, blocked.get());
+        if (missing_dense && !int4) cpu_weight_blocked = blocked.release();
+    }
 
     ~fc_layer() override {
         delete[] cpu_weight;
+        delete[] cpu_weight_blocked;
+        delete[] cpu_weight_int4;
+        delete[] cpu_weight_int4_blocked;
         delete[] (int32_t *) cpu_out;
     }
 };
@@ -258,9 +1012,25 @@ public:
 
     int32_t *cpu_bias = nullptr;
     uint8_t *cpu_shift = nullptr;
+    // Bias and shift padded to blocked_channels(C). Created by set_cpu_layout.
+    int32_t *cpu_bias_blocked = nullptr;
+    uint8_t *cpu_shift_blocked = nullptr;
 
     string type() override { return "quan"; }
 
+    value_type output_type() override { return INT8; }
+
+    feature_shape output_shape() override { return {C, H, W}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.ops = 2.0 * C * H * W; // Subtract and shift.
+        c.weight_bytes = C * (sizeof(int32_t) + sizeof(uint8_t));
+        c.input_bytes = C * H * W * sizeof(int32_t);
+        c.output_bytes = C * H * W;
+        return c;
+    }
+
     quan_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
                size_t C_, size_t H_, size_t W_, int32_t *bias_ptr, uint8_t *shift_ptr) :
             layer(command_queue_), C(C_), H(H_), W(W_) {
@@ -271,7 +1041,7 @@ public:
         // Save cpu bias and shift
         cpu_bias = bias_ptr;
         cpu_shift = shift_ptr;
-        cpu_out = new int8_t[C * H * W];
+        cpu_out = new int8_t[blocked_channels(C) * H * W]();
 
         // Create opencl_weight and result buffer;
         opencl_bias = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, C * sizeof(int32_t),
@@ -312,50 +1082,203 @@ public:
     }
 
     void *cpu_forward(void *input) override {
-        start_timer();
-        cpu_quan(C, H, W,
-                 (const int32_t *) cpu_bias,
-                 (const uint8_t *) cpu_shift,
-                 (const int32_t *) input,
-                 (int8_t *) cpu_out);
-        cpu_time += end_timer();
+        scoped_timer timer(cpu_time);
+        if (layout == BLOCKED)
+            cpu_quan_blocked(C, H, W,
+                             (const int32_t *) cpu_bias_blocked,
+                             (const uint8_t *) cpu_shift_blocked,
+                             (const int32_t *) input,
+                             (int8_t *) cpu_out);
+        else
+            cpu_quan(C, H, W,
+                     (const int32_t *) cpu_bias,
+                     (const uint8_t *) cpu_shift,
+                     (const int32_t *) input,
+                     (int8_t *) cpu_out);
         return cpu_out;
     }
 
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        layout = layout_;
+        if (layout == BLOCKED && !cpu_bias_blocked) {
+            cpu_bias_blocked = new int32_t[blocked_channels(C)]();
+            cpu_shift_blocked = new uint8_t[blocked_channels(C)]();
+            copy(cpu_bias, cpu_bias + C, cpu_bias_blocked);
+            copy(cpu_shift, cpu_shift + C, cpu_shift_blocked);
+        }
+    }
+
     ~quan_layer() override {
         delete[] cpu_bias;
         delete[] cpu_shift;
+        delete[] cpu_bias_blocked;
+        delete[] cpu_shift_blocked;
         delete[] (int8_t *) cpu_out;
     }
 
 
 };
 
+// Quan followed by relu, fused into one pass. Created by cnn::fuse_quan_relu.
+class quan_relu_layer : public layer {
+public:
+    size_t C, H, W; // If is fc, H == W == 1
+
+    cl_mem opencl_bias, opencl_shift;
+
+    int32_t *cpu_bias = nullptr;
+    uint8_t *cpu_shift = nullptr;
+    // Bias and shift padded to blocked_channels(C). Created by set_cpu_layout.
+    int32_t *cpu_bias_blocked = nullptr;
+    uint8_t *cpu_shift_blocked = nullptr;
+
+    string type() override { return "quan_relu"; }
+
+    value_type output_type() override { return UINT8; }
+
+    feature_shape output_shape() override { return {C, H, W}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.ops = 3.0 * C * H * W; // Subtract, shift and max.
+        c.weight_bytes = C * (sizeof(int32_t) + sizeof(uint8_t));
+        c.input_bytes = C * H * W * sizeof(int32_t);
+        c.output_bytes = C * H * W;
+        return c;
+    }
+
+    quan_relu_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
+                    size_t C_, size_t H_, size_t W_, int32_t *bias_ptr, uint8_t *shift_ptr) :
+            layer(command_queue_), C(C_), H(H_), W(W_) {
+        // Create kernel
+        kernel = clCreateKernel(program_, "quan_relu", &ret);
+        check
+
+        // Save cpu bias and shift
+        cpu_bias = bias_ptr;
+        cpu_shift = shift_ptr;
+        cpu_out = new uint8_t[blocked_channels(C) * H * W]();
+
+        // Create opencl_weight and result buffer;
+        opencl_bias = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, C * sizeof(int32_t),
+                                     (void *) bias_ptr, &ret);
+        check
+        opencl_shift = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, C * sizeof(uint8_t),
+                                      (void *) shift_ptr, &ret);
+        check
+        opencl_out = clCreateBuffer(context_, CL_MEM_READ_WRITE, C * H * W * sizeof(uint8_t),
+                                    nullptr, &ret);
+        check
+
+        allocated.push_back(opencl_bias);
+        allocated.push_back(opencl_shift);
+        allocated.push_back(opencl_out);
+
+        // Specify work dimension
+        global_work_size = new size_t[3]{H, W, C};
+        local_work_size = nullptr;
+    }
+
+    void opencl_set_args(cl_mem opencl_in) override {
+        // Set kernel arguments
+        ret = clSetKernelArg(kernel, 0, sizeof(cl_ulong), &C);
+        check
+        ret = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &H);
+        check
+        ret = clSetKernelArg(kernel, 2, sizeof(cl_ulong), &W);
+        check
+        ret = clSetKernelArg(kernel, 3, sizeof(cl_mem), &opencl_bias);
+        check
+        ret = clSetKernelArg(kernel, 4, sizeof(cl_mem), &opencl_shift);
+        check
+        ret = clSetKernelArg(kernel, 5, sizeof(cl_mem), &opencl_in);
+        check
+        ret = clSetKernelArg(kernel, 6, sizeof(cl_mem), &opencl_out);
+        check
+    }
+
+    void *cpu_forward(void *input) override {
+        scoped_timer timer(cpu_time);
+        if (layout == BLOCKED)
+            cpu_quan_relu_blocked(C, H, W,
+                                  (const int32_t *) cpu_bias_blocked,
+                                  (const uint8_t *) cpu_shift_blocked,
+                                  (const int32_t *) input,
+                                  (uint8_t *) cpu_out);
+        else
+            cpu_quan_relu(C, H, W,
+                          (const int32_t *) cpu_bias,
+                          (const uint8_t *) cpu_shift,
+                          (const int32_t *) input,
+                          (uint8_t *) cpu_out);
+        return cpu_out;
+    }
+
+    void set_cpu_layout(cpu_layout layout_, feature_shape input) override {
+        layout = layout_;
+        if (layout == BLOCKED && !cpu_bias_blocked) {
+            cpu_bias_blocked = new int32_t[blocked_channels(C)]();
+            cpu_shift_blocked = new uint8_t[blocked_channels(C)]();
+            copy(cpu_bias, cpu_bias + C, cpu_bias_blocked);
+            copy(cpu_shift, cpu_shift + C, cpu_shift_blocked);
+        }
+    }
+
+    ~quan_relu_layer() override {
+        delete[] cpu_bias;
+        delete[] cpu_shift;
+        delete[] cpu_bias_blocked;
+        delete[] cpu_shift_blocked;
+        delete[] (uint8_t *) cpu_out;
+    }
+};
+
 class pool_layer : public layer {
 public:
     size_t C, H, W;
     size_t HO, WO;
+    size_t K, S; // Square window and stride.
+    bool average; // Average instead of max.
+    // Pool the int32 conv output instead of the uint8 relu output. See cnn::pool_before_quan.
+    bool int32;
+
+    string type() override { return int32 ? "pool_int32" : average ? "avg_pool" : "pool"; }
 
-    string type() override { return "pool"; }
+    value_type output_type() override { return int32 ? INT32 : UINT8; }
+
+    feature_shape output_shape() override { return {C, HO, WO}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        size_t value_bytes = int32 ? sizeof(int32_t) : sizeof(uint8_t);
+        c.ops = double(K * K) * C * HO * WO; // One max or add per window element.
+        c.input_bytes = C * H * W * value_bytes;
+        c.output_bytes = C * HO * WO * value_bytes;
+        return c;
+    }
 
     pool_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
-               size_t C_, size_t H_, size_t W_) :
-            layer(command_queue_), C(C_), H(H_), W(W_) {
+               size_t C_, size_t H_, size_t W_, size_t K_ = 2, size_t S_ = 2, bool average_ = false,
+               bool int32_ = false) :
+            layer(command_queue_), C(C_), H(H_), W(W_), K(K_), S(S_), average(average_), int32(int32_) {
+        // The int32 pool only exists for max, which commutes with quan and relu.
+        assert(!(int32 && average));
         // Calculate opencl_out height and width
-        HO = H >> 1u;
-        WO = W >> 1u;
+        HO = pool_output_size(H, K, S);
+        WO = pool_output_size(W, K, S);
         // Create kernel
-        kernel = clCreateKernel(program_, "pool", &ret);
+        kernel = clCreateKernel(program_, int32 ? "pool_int32" : "pool", &ret);
         check
 
 
         // allocate space for cpu out
-        cpu_out = new int8_t[C * HO * WO];
+        if (int32) cpu_out = new int32_t[blocked_channels(C) * HO * WO]();
+        else cpu_out = new int8_t[blocked_channels(C) * HO * WO]();
 
         // Create opencl_weight and result buffer;
         opencl_out = clCreateBuffer(context_,
                                     CL_MEM_READ_WRITE,
-                                    C * HO * WO * sizeof(int8_t),
+                                    C * HO * WO * (int32 ? sizeof(int32_t) : sizeof(int8_t)),
                                     nullptr,
                                     nullptr);
 
@@ -378,31 +1301,122 @@ public:
         check
         ret = clSetKernelArg(kernel, 4, sizeof(cl_ulong), &WO);
         check
-        ret = clSetKernelArg(kernel, 5, sizeof(cl_mem), &opencl_in);
+        ret = clSetKernelArg(kernel, 5, sizeof(cl_ulong), &K);
         check
-        ret = clSetKernelArg(kernel, 6, sizeof(cl_mem), &opencl_out);
+        ret = clSetKernelArg(kernel, 6, sizeof(cl_ulong), &S);
+        check
+        cl_uint arg = 7;
+        if (!int32) {
+            cl_int average_arg = average;
+            ret = clSetKernelArg(kernel, arg++, sizeof(cl_int), &average_arg);
+            check
+        }
+        ret = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &opencl_in);
+        check
+        ret = clSetKernelArg(kernel, arg, sizeof(cl_mem), &opencl_out);
         check
     }
 
     void *cpu_forward(void *input) override {
-        start_timer();
-        cpu_pool(C, H, W, HO, WO, (uint8_t *) input, (uint8_t *) cpu_out);
-        cpu_time += end_timer();
+        scoped_timer timer(cpu_time);
+        if (int32) {
+            if (layout == BLOCKED)
+                cpu_pool_int32_blocked(C, H, W, HO, WO, K, S, (const int32_t *) input, (int32_t *) cpu_out);
+            else cpu_pool_int32(C, H, W, HO, WO, K, S, (const int32_t *) input, (int32_t *) cpu_out);
+        } else {
+            if (layout == BLOCKED)
+                cpu_pool_blocked(C, H, W, HO, WO, K, S, average, (const uint8_t *) input, (uint8_t *) cpu_out);
+            else cpu_pool(C, H, W, HO, WO, K, S, average, (const uint8_t *) input, (uint8_t *) cpu_out);
+        }
         return cpu_out;
     }
 
     ~pool_layer() override {
-        delete[] (int8_t *) cpu_out;
+        if (int32) delete[] (int32_t *) cpu_out;
+        else delete[] (int8_t *) cpu_out;
     }
 
 };
 
+// Global average pool, [C, H, W] -> [C, 1, 1]. In front of the fc head it replaces the flattened
+// [C * H * W, CO] weight with a [C, CO] one.
+class gap_layer : public layer {
+public:
+    size_t C, H, W;
+
+    string type() override { return "gap"; }
+
+    value_type output_type() override { return UINT8; }
+
+    feature_shape output_shape() override { return {C, 1, 1}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.ops = double(C) * H * W; // One add per value.
+        c.input_bytes = C * H * W;
+        c.output_bytes = C;
+        return c;
+    }
+
+    gap_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
+              size_t C_, size_t H_, size_t W_) :
+            layer(command_queue_), C(C_), H(H_), W(W_) {
+        kernel = clCreateKernel(program_, "gap", &ret);
+        check
+
+        cpu_out = new uint8_t[blocked_channels(C)]();
+
+        opencl_out = clCreateBuffer(context_, CL_MEM_READ_WRITE, C * sizeof(uint8_t), nullptr, &ret);
+        check
+        allocated.push_back(opencl_out);
+
+        global_work_size = new size_t[3]{C, 1, 1};
+        local_work_size = nullptr;
+    }
+
+    void opencl_set_args(cl_mem opencl_in) override {
+        ret = clSetKernelArg(kernel, 0, sizeof(cl_ulong), &C);
+        check
+        ret = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &H);
+        check
+        ret = clSetKernelArg(kernel, 2, sizeof(cl_ulong), &W);
+        check
+        ret = clSetKernelArg(kernel, 3, sizeof(cl_mem), &opencl_in);
+        check
+        ret = clSetKernelArg(kernel, 4, sizeof(cl_mem), &opencl_out);
+        check
+    }
+
+    void *cpu_forward(void *input) override {
+        scoped_timer timer(cpu_time);
+        if (layout == BLOCKED) cpu_gap_blocked(C, H, W, (const uint8_t *) input, (uint8_t *) cpu_out);
+        else cpu_gap(C, H, W, (const uint8_t *) input, (uint8_t *) cpu_out);
+        return cpu_out;
+    }
+
+    ~gap_layer() override {
+        delete[] (uint8_t *) cpu_out;
+    }
+};
+
 class relu_layer : public layer {
 public:
     size_t C, H, W;
 
     string type() override { return "relu"; }
 
+    value_type output_type() override { return UINT8; }
+
+    feature_shape output_shape() override { return {C, H, W}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        c.ops = double(C) * H * W;
+        c.input_bytes = C * H * W;
+        c.output_bytes = C * H * W;
+        return c;
+    }
+
     relu_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
                size_t C_, size_t H_, size_t W_) :
             layer(command_queue_), C(C_), H(H_), W(W_) {
@@ -411,7 +1425,7 @@ public:
         check
 
         // Allocate space for cpu output
-        cpu_out = new uint8_t[C * H * W];
+        cpu_out = new uint8_t[blocked_channels(C) * H * W]();
 
         // Create opencl_weight and result buffer;
         opencl_out = clCreateBuffer(context_,
@@ -442,9 +1456,10 @@ public:
     }
 
     void *cpu_forward(void *input) override {
-        start_timer();
-        cpu_relu(C, H, W, (int8_t *) input, (uint8_t *) cpu_out);
-        cpu_time += end_timer();
+        scoped_timer timer(cpu_time);
+        // Relu is element-wise, so the blocked version only has to cover the padding channels too.
+        if (layout == BLOCKED) cpu_relu(blocked_channels(C), H, W, (int8_t *) input, (uint8_t *) cpu_out);
+        else cpu_relu(C, H, W, (int8_t *) input, (uint8_t *) cpu_out);
         return cpu_out;
     }
 
@@ -455,6 +1470,93 @@ public:
 
 };
 
+// Turns a raw image into the [1, H, W] network input: channel selection and vertical flip.
+// Inserted before the first layer by cnn::set_raw_input, so the host only copies the pixel rows.
+class preprocess_layer : public layer {
+public:
+    raw_image_format format;
+
+    string type() override { return "preprocess"; }
+
+    value_type output_type() override { return UINT8; }
+
+    feature_shape output_shape() override { return {1, format.H, format.W}; }
+
+    layer_cost cost() override {
+        layer_cost c;
+        // No arithmetic. Whole rows are read, since the picked bytes are spread over them.
+        c.input_bytes = format.size();
+        c.output_bytes = format.H * format.W;
+        return c;
+    }
+
+    preprocess_layer(cl_context context_, cl_command_queue command_queue_, cl_program program_,
+                     const raw_image_format &format_) :
+            layer(command_queue_), format(format_) {
+        // Create kernel
+        kernel = clCreateKernel(program_, "preprocess", &ret);
+        check
+
+        // Allocate space for cpu output
+        cpu_out = new uint8_t[blocked_channels(1) * format.H * format.W]();
+
+        // Create result buffer;
+        opencl_out = clCreateBuffer(context_,
+                                    CL_MEM_READ_WRITE,
+                                    format.H * format.W * sizeof(uint8_t),
+                                    nullptr,
+                                    nullptr);
+
+        allocated.push_back(opencl_out);
+
+        // Specify work dimension
+        global_work_size = new size_t[3]{format.H, format.W, 1};
+        local_work_size = nullptr;
+    }
+
+    void opencl_set_args(cl_mem opencl_in) override {
+        // Set kernel arguments
+        cl_int bottom_up = format.bottom_up;
+        ret = clSetKernelArg(kernel, 0, sizeof(cl_ulong), &format.H);
+        check
+        ret = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &format.W);
+        check
+        ret = clSetKernelArg(kernel, 2, sizeof(cl_ulong), &format.pixel_bytes);
+        check
+        ret = clSetKernelArg(kernel, 3, sizeof(cl_ulong), &format.row_stride);
+        check
+        ret = clSetKernelArg(kernel, 4, sizeof(cl_ulong), &format.channel);
+        check
+        ret = clSetKernelArg(kernel, 5, sizeof(cl_int), &bottom_up);
+        check
+        ret = clSetKernelArg(kernel, 6, sizeof(cl_mem), &opencl_in);
+        check
+        ret = clSetKernelArg(kernel, 7, sizeof(cl_mem), &opencl_out);
+        check
+    }
+
+    void *cpu_forward(void *input) override {
+        scoped_timer timer(cpu_time);
+        // The output has one channel, so the blocked layout only spreads the pixels CB bytes apart.
+        cpu_preprocess(format.H, format.W, format.pixel_bytes, format.row_stride, format.channel, format.bottom_up,
+                       (const uint8_t *) input, (uint8_t *) cpu_out, layout == BLOCKED ? CB : 1);
+        return cpu_out;
+    }
+
+    ~preprocess_layer() override {
+        delete[] (uint8_t *) cpu_out;
+    }
+};
+
+// Conv and fc layers with a smaller fraction of nonzero weights run the sparse kernels. See cnn::set_sparse_threshold.
+// From the microbench sparse cases: the blocked conv breaks even around 0.15, sparse fc still wins at 0.5.
+const double SPARSE_CONV_DENSITY = 0.15, SPARSE_FC_DENSITY = 0.5;
+
+// Conv and fc layers whose weights fit in int4 store them packed. See cnn::set_int4_weights.
+// Off for conv: conv_int4 unpacks a nibble on every tap and gives up the 3x3 and 1x1 kernels of the dense conv,
+// which is slower on the device than the int8 weights save. The fc layers are bound by weight bandwidth and win.
+const bool INT4_CONV_WEIGHTS = false, INT4_FC_WEIGHTS = true;
+
 class cnn {
     // Input image size, output feature size.
     size_t IMAGE_C, IMAGE_H, IMAGE_W, FEATURE;
@@ -470,138 +1572,364 @@ class cnn {
     cl_mem opencl_in = nullptr;
     int8_t *out_buff = nullptr;
 
+    // Bytes of one input passed to the forward functions. Larger than the image with a raw input.
+    size_t input_size = 0;
+    bool raw_input = false;
+
+    // Cpu feature layout, and the converted input image when it is not planar.
+    cpu_layout layout = PLANAR;
+    uint8_t *cpu_in = nullptr;
+
     // Container of layers.
     vector<layer *> layers;
 
+    // End-to-end latency of cpu_forward and opencl_forward.
+    latency_histogram cpu_forward_time, opencl_forward_time;
+
+    // Called after every layer of the forward functions. See set_layer_observer.
+    function<void(layer *)> observer;
+
 public:
+    // Choose the cpu feature layout. The input image is converted in cpu_forward,
+    // every layer then works on the chosen layout directly.
+    void set_cpu_layout(cpu_layout layout_) {
+        layout = layout_;
+        feature_shape shape{IMAGE_C, IMAGE_H, IMAGE_W};
+        for (auto &layer:layers) {
+            layer->set_cpu_layout(layout, shape);
+            shape = layer->output_shape();
+        }
+        if (layout == BLOCKED && !cpu_in) cpu_in = new uint8_t[blocked_channels(IMAGE_C) * IMAGE_H * IMAGE_W];
+    }
+
+    // Take raw image rows instead of [C, H, W] images. A preprocess layer in front of the network
+    // picks the channel and flips the rows, on the device for opencl_forward.
+    void set_raw_input(const raw_image_format &format) {
+        assert(!raw_input && IMAGE_C == 1 && format.H == IMAGE_H && format.W == IMAGE_W);
+        layers.insert(layers.begin(), new preprocess_layer(context, command_queue, program, format));
+        raw_input = true;
+        input_size = format.size();
+        clReleaseMemObject(opencl_in);
+        opencl_in = clCreateBuffer(context, CL_MEM_READ_ONLY, input_size, nullptr, &ret);
+        check
+        set_cpu_layout(layout);
+    }
+
+    const vector<layer *> &get_layers() const { return layers; }
+
+    size_t feature_size() const { return FEATURE; }
+
+    // Run every cpu conv through cpu_conv_generic (or its blocked version) instead of the fast paths,
+    // to verify the fast paths against it. Depthwise and pointwise convs only have a generic planar version.
+    void set_generic_conv(bool on) {
+        for (auto l:layers) {
+            if (auto conv = dynamic_cast<conv_layer *>(l)) conv->generic = on;
+            if (auto conv = dynamic_cast<requant_conv_layer *>(l)) conv->generic = on;
+        }
+    }
+
+    // Run the conv and fc layers whose fraction of nonzero weights is below "conv_density" and "fc_density" on the
+    // sparse kernels and the others on the dense ones. 0 keeps every layer dense, anything above 1 makes it sparse.
+    // The constructor applies SPARSE_CONV_DENSITY and SPARSE_FC_DENSITY.
+    void set_sparse_threshold(double conv_density, double fc_density) {
+        for (auto l:layers) {
+            if (auto conv = dynamic_cast<conv_layer *>(l))
+                conv->set_sparse(context, program, conv->density < conv_density);
+            if (auto fc = dynamic_cast<fc_layer *>(l)) fc->set_sparse(context, program, fc->density < fc_density);
+        }
+        set_cpu_layout(layout);
+    }
+
+    // Store the weights of the conv ("conv_on") and fc ("fc_on") layers whose weights are all in [-8, 7] as int4,
+    // two per byte, on both backends, and keep int8 weights in the others.
+    // The constructor applies INT4_CONV_WEIGHTS and INT4_FC_WEIGHTS.
+    void set_int4_weights(bool conv_on, bool fc_on) {
+        for (auto l:layers) {
+            if (auto conv = dynamic_cast<conv_layer *>(l)) conv->set_int4(context, program, conv_on);
+            if (auto fc = dynamic_cast<fc_layer *>(l)) fc->set_int4(context, program, fc_on);
+        }
+        set_cpu_layout(layout);
+    }
+
+    // Call "observer_" with every layer right after it ran in cpu_forward or opencl_forward,
+    // e.g. to read its output with layer::cpu_output or layer::opencl_output. nullptr to stop.
+    void set_layer_observer(function<void(layer *)> observer_) { observer = move(observer_); }
+
     void report_cpu_time() {
         cout << "********************" << endl;
         for (auto &layer:layers)layer->report_cpu_time();
-        map<string, double> cpu_time_table;
-        for (auto &layer:layers) cpu_time_table[layer->type()] = 0;
-        for (auto &layer:layers) cpu_time_table[layer->type()] += layer->cpu_time;
-        double total_time;
+        // Layers of the same type are merged into one histogram.
+        map<string, latency_histogram> cpu_time_table;
+        for (auto &layer:layers) cpu_time_table[layer->type()].merge(layer->cpu_time);
+        double total_time = 0;
         for (auto &p:cpu_time_table) {
-            cout << "Total " << p.first << " time: " << p.second << endl;
-            total_time += p.second;
+            cout << "Total " << p.first << " time: " << p.second.seconds() << ", " << p.second.summary() << endl;
+            total_time += p.second.seconds();
         }
         cout << "Total CNN time: " << total_time << endl;
+        cout << "Forward: " << cpu_forward_time.summary() << endl;
+        report_cpu_perf();
         cout << "********************" << endl;
     }
 
+    // Mean hardware counters per cpu_forward of every layer, if any were recorded.
+    void report_cpu_perf() {
+        bool recorded = false;
+        for (auto &layer:layers) recorded = recorded || layer->cpu_perf.samples > 0;
+        if (!recorded) return;
+        cout << left << setw(12) << "layer" << right;
+        for (int i = 0; i < PERF_COUNTERS; i++) cout << setw(15) << PERF_COUNTER_NAMES[i];
+        cout << setw(8) << "IPC" << endl;
+        for (auto &layer:layers) {
+            auto &perf = layer->cpu_perf;
+            cout << left << setw(12) << layer->type() << right;
+            // No samples when the counter group never ran during this layer.
+            bool sampled = perf.samples > 0;
+            for (int i = 0; i < PERF_COUNTERS; i++) {
+                if (sampled && perf_available[i]) cout << setw(15) << uint64_t(perf.mean(i));
+                else cout << setw(15) << "n/a";
+            }
+            double cycles = perf.mean(PERF_CYCLES);
+            if (sampled && cycles) cout << setw(8) << setprecision(3) << perf.mean(PERF_INSTRUCTIONS) / cycles;
+            else cout << setw(8) << "n/a";
+            cout << setprecision(6) << endl;
+        }
+    }
+
     void report_opencl_time() {
         cout << "********************" << endl;
         for (auto &layer:layers)layer->report_opencl_time();
-        map<string, double> opencl_time_table;
-        for (auto &layer:layers) opencl_time_table[layer->type()] += 0;
-        for (auto &layer:layers) opencl_time_table[layer->type()] += layer->opencl_time;
+        map<string, latency_histogram> opencl_time_table;
+        for (auto &layer:layers) opencl_time_table[layer->type()].merge(layer->opencl_time);
         double total_time = 0;
         for (auto &p:opencl_time_table) {
-            cout << "Total " << p.first << " time: " << p.second << endl;
-            total_time += p.second;
+            cout << "Total " << p.first << " time: " << p.second.seconds() << ", " << p.second.summary() << endl;
+            total_time += p.second.seconds();
         }
         cout << "Total CNN time: " << total_time << endl;
+        // Host time of the whole forward, including the transfers.
+        cout << "Forward: " << opencl_forward_time.summary() << endl;
+        cout << "********************" << endl;
+    }
+
+    void report_cpu_roofline() { report_roofline(false); }
+
+    void report_opencl_roofline() { report_roofline(true); }
+
+    // Achieved throughput of every layer from its cost and its mean measured time per forward.
+    // Intensity is ops per byte: layers far below the machine balance (peak GOPS / peak GB/s) are memory-bound.
+    void report_roofline(bool opencl) {
+        cout << "********************" << endl;
+        cout << left << setw(12) << "layer" << right << setw(12) << "MACs" << setw(12) << "bytes"
+             << setw(10) << "ops/byte" << setw(12) << "us" << setw(10) << "GOPS" << setw(10) << "GB/s" << endl;
+        layer_cost total;
+        double total_time = 0;
+        for (auto &layer:layers) {
+            auto c = layer->cost();
+            auto &time = opencl ? layer->opencl_time : layer->cpu_time;
+            double seconds = time.mean_ns() / 1e9;
+            total.macs += c.macs, total.ops += c.ops, total.weight_bytes += c.weight_bytes;
+            total.input_bytes += c.input_bytes, total.output_bytes += c.output_bytes;
+            total_time += seconds;
+            print_roofline_row(layer->type(), c, seconds);
+        }
+        print_roofline_row("total", total, total_time);
+        cout << "********************" << endl;
+    }
+
+    static void print_roofline_row(const string &name, const layer_cost &c, double seconds) {
+        cout << left << setw(12) << name << right << setw(12) << uint64_t(c.macs) << setw(12) << uint64_t(c.bytes())
+             << setw(10) << setprecision(3) << (c.bytes() ? c.ops / c.bytes() : 0)
+             << setw(12) << seconds * 1e6
+             << setw(10) << (seconds ? c.ops / seconds / 1e9 : 0)
+             << setw(10) << (seconds ? c.bytes() / seconds / 1e9 : 0) << setprecision(6) << endl;
+    }
+
+    // Model size and work per image, for capacity planning.
+    void report_model_summary() {
+        layer_cost total;
+        double activation_bytes = 0;
+        for (auto &layer:layers) {
+            auto c = layer->cost();
+            total.macs += c.macs, total.ops += c.ops, total.weight_bytes += c.weight_bytes;
+            total.input_bytes += c.input_bytes, total.output_bytes += c.output_bytes;
+            activation_bytes = max(activation_bytes, c.input_bytes + c.output_bytes);
+        }
+        cout << "********************" << endl;
+        cout << "Layers: " << layers.size() << endl;
+        cout << "Parameters: " << uint64_t(total.weight_bytes) << " bytes" << endl;
+        cout << "MACs per image: " << uint64_t(total.macs) << endl;
+        cout << "Ops per image: " << uint64_t(total.ops) << endl;
+        cout << "Bytes moved per image: " << uint64_t(total.bytes()) << endl;
+        cout << "Largest layer input + output: " << uint64_t(activation_bytes) << " bytes" << endl;
+        cout << "Arithmetic intensity: " << (total.bytes() ? total.ops / total.bytes() : 0) << " ops/byte" << endl;
         cout << "********************" << endl;
     }
 
     void parse_model_file(const string &model_file) {
-        ifstream fs(model_file);
-        string s;
-        int param;
-        while (fs >> s) {
-            if (s == "CONV") {
-                int CO, CI, H, W;
-                fs >> s;
-                assert(s == "CO");
-                fs >> CO >> s;
-                assert(s == "CI");
-                fs >> CI >> s;
-                assert(s == "H");
-                fs >> H >> s;
-                assert(s == "W");
-                fs >> W;
-                auto weight_ptr = new int8_t[CO * CI * 3 * 3];
-                for (int co = 0; co < CO; co++) {
-                    for (int ci = 0; ci < CI; ci++) {
-                        for (int h = 0; h < 3; h++) {
-                            for (int w = 0; w < 3; w++) {
-                                fs >> param;
-                                weight_ptr[co * CI * 3 * 3 + ci * 3 * 3 + h * 3 + w] = param;
-                            }
-                        }
-                    }
-                }
-                layers.emplace_back(new conv_layer(context, command_queue, program, CI, CO, H, W, weight_ptr));
-            } else if (s == "FC") {
-                int CI, CO;
-                fs >> s;
-                assert(s == "CI");
-                fs >> CI >> s;
-                assert(s == "CO");
-                fs >> CO;
-                auto weight_ptr = new int8_t[CI * CO];
-                for (int ci = 0; ci < CI; ci++) {
-                    for (int co = 0; co < CO; co++) {
-                        fs >> param;
-                        weight_ptr[ci * CO + co] = param;
+        auto specs = read_model_file(model_file);
+        for (size_t i = 0; i < specs.size(); i++) {
+            auto &spec = specs[i];
+            size_t count = layers.size();
+            if (spec.type == "CONV") {
+                layers.emplace_back(new conv_layer(context, command_queue, program, spec.CI, spec.CO, spec.H, spec.W,
+                                                   new_array_copy(spec.weight), spec.K, spec.stride, spec.pad,
+                                                   spec.dilation));
+            } else if (spec.type == "DWCONV") {
+                layers.emplace_back(new dwconv_layer(context, command_queue, program, spec.C, spec.H, spec.W,
+                                                     new_array_copy(spec.weight), spec.K, spec.stride, spec.pad,
+                                                     spec.dilation));
+            } else if (spec.type == "PWCONV") {
+                layers.emplace_back(new pwconv_layer(context, command_queue, program, spec.CI, spec.CO, spec.H,
+                                                     spec.W, new_array_copy(spec.weight)));
+            } else if (spec.type == "FC") {
+                layers.emplace_back(new fc_layer(context, command_queue, program, spec.CI, spec.CO,
+                                                 new_array_copy(spec.weight)));
+            } else if (spec.type == "RELU") {
+                layers.emplace_back(new relu_layer(context, command_queue, program, spec.C, spec.H, spec.W));
+            } else if (spec.type == "POOL") {
+                layers.emplace_back(new pool_layer(context, command_queue, program, spec.C, spec.H, spec.W, spec.K,
+                                                   spec.stride, spec.average));
+            } else if (spec.type == "GAP") {
+                layers.emplace_back(new gap_layer(context, command_queue, program, spec.C, spec.H, spec.W));
+            } else if (spec.type == "QUAN") {
+                layers.emplace_back(new quan_layer(context, command_queue, program, spec.C, spec.H, spec.W,
+                                                   new_array_copy(spec.bias), new_array_copy(spec.shift)));
+            }
+            if (layers.size() > count) layers.back()->model_index = i;
+        }
+    }
+
+    // Replace every QUAN directly followed by RELU with one quan_relu_layer.
+    // The fused layer writes the relu output in the same pass, so the int8 feature is never stored.
+    void fuse_quan_relu() {
+        for (size_t i = 0; i + 1 < layers.size(); i++) {
+            auto quan = dynamic_cast<quan_layer *>(layers[i]);
+            auto relu = dynamic_cast<relu_layer *>(layers[i + 1]);
+            if (!quan || !relu) continue;
+            // The fused layer takes over bias and shift.
+            auto fused = new quan_relu_layer(context, command_queue, program, quan->C, quan->H, quan->W,
+                                             quan->cpu_bias, quan->cpu_shift);
+            quan->cpu_bias = nullptr;
+            quan->cpu_shift = nullptr;
+            fused->model_index = relu->model_index;
+            delete quan;
+            delete relu;
+            layers[i] = fused;
+            layers.erase(layers.begin() + i + 1);
+        }
+        set_cpu_layout(layout);
+    }
+
+    // Fold every QUAN (and RELU), or QUAN_RELU, that directly follows a depthwise or pointwise conv into the conv.
+    // The fused layer requantizes the accumulators while they are in registers, so the int32 feature is never stored.
+    void fuse_conv_quan() {
+        for (size_t i = 0; i + 1 < layers.size(); i++) {
+            auto conv = dynamic_cast<requant_conv_layer *>(layers[i]);
+            auto quan = dynamic_cast<quan_layer *>(layers[i + 1]);
+            auto quan_relu = dynamic_cast<quan_relu_layer *>(layers[i + 1]);
+            if (!conv || conv->fused() || (!quan && !quan_relu)) continue;
+            bool relu = quan_relu || (i + 2 < layers.size() && dynamic_cast<relu_layer *>(layers[i + 2]));
+            size_t n = quan && relu ? 3 : 2; // conv, quan, (relu)
+            // The fused layer takes over bias and shift.
+            int32_t *&bias = quan ? quan->cpu_bias : quan_relu->cpu_bias;
+            uint8_t *&shift = quan ? quan->cpu_shift : quan_relu->cpu_shift;
+            auto fused = conv->with_epilogue(context, program, bias, shift, relu);
+            bias = nullptr;
+            shift = nullptr;
+            fused->model_index = layers[i + n - 1]->model_index;
+            for (size_t j = i; j < i + n; j++) delete layers[j];
+            layers.erase(layers.begin() + i + 1, layers.begin() + i + n);
+            layers[i] = fused;
+        }
+        set_cpu_layout(layout);
+    }
+
+    // True if requantizing any output of "conv" cannot leave the int8 range, given inputs in [0, x_max].
+    // Then the int8 truncation in quan is the identity, quan and relu are monotonic and commute with max pooling.
+    static bool quan_keeps_int8_range(conv_layer *conv, const int32_t *bias, const uint8_t *shift, int64_t x_max) {
+        vector<int8_t> buffer;
+        const int8_t *weights = conv->int8_weight(buffer);
+        for (size_t co = 0; co < conv->CO; co++) {
+            int64_t lo = 0, hi = 0;
+            size_t taps = conv->CI * conv->K * conv->K;
+            for (size_t k = 0; k < taps; k++) {
+                int64_t weight = weights[co * taps + k];
+                if (weight > 0) hi += weight * x_max;
+                else lo += weight * x_max;
+            }
+            if (((lo - bias[co]) >> shift[co]) < INT8_MIN || ((hi - bias[co]) >> shift[co]) > INT8_MAX) return false;
+        }
+        return true;
+    }
+
+    // Rewrite CONV -> QUAN -> RELU -> POOL (or CONV -> QUAN_RELU -> POOL) into
+    // CONV -> POOL(int32) -> QUAN -> RELU, so only the pooled values are requantized.
+    // Only applied to max pools, where quan_keeps_int8_range proves the result is unchanged.
+    // Average pools do not commute with the truncating shift of quan.
+    void pool_before_quan() {
+        int64_t x_max = 255; // Largest value of the current uint8 feature.
+        for (size_t i = 0; i + 2 < layers.size(); i++) {
+            auto conv = dynamic_cast<conv_layer *>(layers[i]);
+            auto quan = dynamic_cast<quan_layer *>(layers[i + 1]);
+            auto quan_relu = dynamic_cast<quan_relu_layer *>(layers[i + 1]);
+            size_t n = quan ? 4 : 3; // conv, quan, (relu), pool
+            pool_layer *pool = i + n <= layers.size() ? dynamic_cast<pool_layer *>(layers[i + n - 1]) : nullptr;
+            bool relu = quan && dynamic_cast<relu_layer *>(layers[i + 2]);
+
+            if (conv && pool && !pool->int32 && !pool->average && (quan_relu || relu)) {
+                int32_t *&bias = quan ? quan->cpu_bias : quan_relu->cpu_bias;
+                uint8_t *&shift = quan ? quan->cpu_shift : quan_relu->cpu_shift;
+                if (quan_keeps_int8_range(conv, bias, shift, x_max)) {
+                    vector<layer *> rewritten{
+                            new pool_layer(context, command_queue, program, conv->CO, conv->HO, conv->WO, pool->K,
+                                           pool->S, false, true)};
+                    if (quan) {
+                        rewritten.push_back(new quan_layer(context, command_queue, program,
+                                                           pool->C, pool->HO, pool->WO, bias, shift));
+                        rewritten.push_back(new relu_layer(context, command_queue, program,
+                                                           pool->C, pool->HO, pool->WO));
+                    } else {
+                        rewritten.push_back(new quan_relu_layer(context, command_queue, program,
+                                                                pool->C, pool->HO, pool->WO, bias, shift));
                     }
+                    // The relu output after pooling is the pool output of the model.
+                    rewritten.back()->model_index = pool->model_index;
+                    // The new quan layer took over bias and shift.
+                    bias = nullptr;
+                    shift = nullptr;
+                    for (size_t j = i + 1; j < i + n; j++) delete layers[j];
+                    layers.erase(layers.begin() + i + 1, layers.begin() + i + n);
+                    layers.insert(layers.begin() + i + 1, rewritten.begin(), rewritten.end());
+                    i += rewritten.size();
                 }
-                layers.emplace_back(new fc_layer(context, command_queue, program, CI, CO, weight_ptr));
-            } else if (s == "RELU") {
-                int C, H, W;
-                fs >> s;
-                assert(s == "C");
-                fs >> C >> s;
-                assert(s == "H");
-                fs >> H >> s;
-                assert(s == "W");
-                fs >> W;
-                layers.emplace_back(new relu_layer(context, command_queue, program, C, H, W));
-            } else if (s == "POOL") {
-                int C, H, W;
-                fs >> s;
-                assert(s == "C");
-                fs >> C >> s;
-                assert(s == "H");
-                fs >> H >> s;
-                assert(s == "W");
-                fs >> W;
-                layers.emplace_back(new pool_layer(context, command_queue, program, C, H, W));
-            } else if (s == "QUAN") {
-                int C, H, W;
-                fs >> s;
-                assert(s == "C");
-                fs >> C >> s;
-                assert(s == "H");
-                fs >> H >> s;
-                assert(s == "W");
-                fs >> W;
-                auto bias_ptr = new int32_t[C];
-                auto shift_ptr = new uint8_t[C];
-                fs >> s;
-                assert(s == "BIAS");
-                for (int c = 0; c < C; c++) {
-                    fs >> param;
-                    bias_ptr[c] = param;
-                }
-                fs >> s;
-                assert(s == "SHIFT");
-                for (int c = 0; c < C; c++) {
-                    fs >> param;
-                    shift_ptr[c] = param;
-                }
-                layers.emplace_back(new quan_layer(context, command_queue, program, C, H, W, bias_ptr, shift_ptr));
-            } else {
-                cout << "No such layer: " << s << endl;
-                exit(1);
             }
+            // Track the value range of uint8 features for the next conv. Pools keep the range.
+            auto type = layers[i]->type();
+            if (type == "relu" || type == "quan_relu") x_max = 127;
+            else if (!dynamic_cast<pool_layer *>(layers[i]) && !dynamic_cast<gap_layer *>(layers[i])) x_max = 255;
         }
+        set_cpu_layout(layout);
+    }
+
+    // Run all graph rewrites. The result is bit-identical to the parsed model.
+    void optimize() {
+        pool_before_quan();
+        fuse_conv_quan();
+        fuse_quan_relu();
     }
 
+    // FEATURE_ = 0 takes the output size of the model.
     cnn(size_t C_, size_t H_, size_t W_, size_t FEATURE_, const string &kernel_file, const string &model_file) :
             IMAGE_C(C_), IMAGE_H(H_), IMAGE_W(W_), FEATURE(FEATURE_) {
         opencl_init(kernel_file);
         parse_model_file(model_file);
+        set_int4_weights(INT4_CONV_WEIGHTS, INT4_FC_WEIGHTS);
+        set_sparse_threshold(SPARSE_CONV_DENSITY, SPARSE_FC_DENSITY);
+        if (FEATURE == 0) {
+            auto shape = layers.back()->output_shape();
+            FEATURE = shape.C * shape.H * shape.W;
+        }
         out_buff = new int8_t[FEATURE];
     }
 
@@ -636,9 +1964,10 @@ public:
             cout << build_log;
             exit(1);
         }
+        input_size = IMAGE_C * IMAGE_H * IMAGE_W * sizeof(uint8_t);
         opencl_in = clCreateBuffer(context,
                                    CL_MEM_READ_ONLY, // Token
-                                   IMAGE_C * IMAGE_H * IMAGE_W * sizeof(uint8_t), // buffer size
+                                   input_size, // buffer size
                                    nullptr,  // host ptr
                                    &ret);
         check
@@ -658,6 +1987,13 @@ public:
         for (auto layer:layers) {
             delete layer;
         }
+        delete[] cpu_in;
+    }
+
+    // Hand a write or read to the tracer, which keeps its own reference to the event.
+    static void trace_command(cl_event event, const string &name, uint64_t enqueue_ns) {
+        tracer.opencl_command(event, name, enqueue_ns);
+        clReleaseEvent(event);
     }
 
     template<class T>
@@ -675,19 +2011,30 @@ public:
         return rc;
     }
 
-    size_t opencl_forward(uint8_t *image) {
+    size_t opencl_forward(const uint8_t *image) {
+        scoped_timer timer(opencl_forward_time);
+        bool traced = tracer.enabled();
+        uint64_t forward_ns = traced ? now_ns() : 0, op = forward_ns;
+        cl_event event = nullptr;
         ret = clEnqueueWriteBuffer(command_queue,
                                    opencl_in,
                                    CL_FALSE,  // Block writing. If blocking, this function will finish queue.
                                    0, // Offset
-                                   IMAGE_C * IMAGE_H * IMAGE_W * sizeof(uint8_t), // Size
+                                   input_size, // Size
                                    image,
                                    0,  // wait number
                                    nullptr, // wait list
-                                   nullptr); // bounding event
+                                   traced ? &event : nullptr); // bounding event
         check
+        if (traced) trace_command(event, "write", op);
         cl_mem cur = opencl_in;
-        for (auto layer:layers) cur = layer->opencl_forward(cur);
+        for (auto layer:layers) {
+            if (traced) op = now_ns();
+            cur = layer->opencl_forward(cur);
+            if (traced) tracer.host_span(layer->type(), "enqueue", op, now_ns());
+            if (observer) observer(layer);
+        }
+        if (traced) op = now_ns();
         ret = clEnqueueReadBuffer(command_queue,
                                   cur,
                                   CL_TRUE, // Block reading. Finish queue and read.
@@ -696,14 +2043,42 @@ public:
                                   out_buff,
                                   0,
                                   nullptr,
-                                  nullptr);
+                                  traced ? &event : nullptr);
         check
+        if (traced) {
+            // The blocking read has finished every command of this forward.
+            trace_command(event, "read", op);
+            tracer.flush_opencl();
+            tracer.host_span("opencl_forward", "forward", forward_ns, now_ns());
+        }
         return argmax(out_buff, FEATURE);
     }
 
-    size_t cpu_forward(uint8_t *image) {
-        void *cur = image;
-        for (auto &layer : layers)cur = layer->cpu_forward(cur);
+    size_t cpu_forward(const uint8_t *image) {
+        scoped_timer timer(cpu_forward_time);
+        bool traced = tracer.enabled();
+        uint64_t forward_ns = traced ? now_ns() : 0;
+        void *cur = (void *) image;
+        // The preprocess layer writes the blocked layout itself.
+        if (layout == BLOCKED && !raw_input) {
+            to_blocked(IMAGE_C, IMAGE_H, IMAGE_W, image, cpu_in);
+            cur = cpu_in;
+        }
+        for (auto &layer : layers) {
+            uint64_t op = traced ? now_ns() : 0;
+            {
+                scoped_perf counters(layer->cpu_perf);
+                cur = layer->cpu_forward(cur);
+            }
+            if (traced) tracer.host_span(layer->type(), "cpu", op, now_ns());
+            if (observer) observer(layer);
+        }
+        if (layout == BLOCKED) {
+            auto shape = layers.back()->output_shape();
+            from_blocked(shape.C, shape.H, shape.W, (const int8_t *) cur, out_buff);
+            cur = out_buff;
+        }
+        if (traced) tracer.host_span("cpu_forward", "forward", forward_ns, now_ns());
         return argmax((int8_t *) cur, FEATURE);
     }
 };
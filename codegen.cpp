@@ -0,0 +1,267 @@
+// Ahead-of-time code generator.
+// Reads model.txt and writes <stem>.cpp / <stem>.h containing the whole network hard-coded:
+// weights as constexpr arrays, one fused loop nest per CONV/DWCONV/PWCONV/FC(+QUAN)(+RELU) stage and static
+// activation buffers.
+// The generated forward function gives the same result as cnn::cpu_forward, but is not reentrant.
+//
+// Usage: cnn_codegen <model_file> <output_stem> [function_prefix]
+
+#include "model.cpp"
+
+using namespace std;
+
+// Emit a parameter array as an aligned constexpr definition.
+template<class T>
+void emit_array(ostream &os, const string &c_type, const string &name, const vector<T> &v) {
+    os << "alignas(64) constexpr " << c_type << ' ' << name << '[' << v.size() << "] = {";
+    for (size_t i = 0; i < v.size(); i++) {
+        if (i % 32 == 0) os << "\n        ";
+        os << int(v[i]) << ',';
+    }
+    os << "\n};\n\n";
+}
+
+struct tensor_info {
+    string name, c_type;
+    size_t C, H, W;
+};
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <model_file> <output_stem> [function_prefix]" << endl;
+        return 1;
+    }
+    string model_file = argv[1], stem = argv[2];
+    string prefix = argc > 3 ? argv[3] : "generated_model";
+    auto specs = read_model_file(model_file);
+    if (specs.empty()) {
+        cout << "Empty model: " << model_file << endl;
+        return 1;
+    }
+
+    // Infer input shape from the first layer.
+    tensor_info cur{"image", "uint8_t", 0, 0, 0};
+    if (specs[0].type == "CONV" || specs[0].type == "PWCONV")
+        cur.C = specs[0].CI, cur.H = specs[0].H, cur.W = specs[0].W;
+    else if (specs[0].type == "FC") cur.C = specs[0].CI, cur.H = cur.W = 1;
+    else cur.C = specs[0].C, cur.H = specs[0].H, cur.W = specs[0].W;
+    const size_t input_size = cur.C * cur.H * cur.W;
+
+    stringstream params, buffers, body;
+    size_t scratch_size = 1;
+    for (size_t i = 0; i < specs.size(); i++) {
+        auto &spec = specs[i];
+        string id = to_string(i);
+        tensor_info out{"t" + id, "", 0, 0, 0};
+
+        if (spec.type == "CONV" || spec.type == "DWCONV" || spec.type == "PWCONV" || spec.type == "FC") {
+            // Fuse the following QUAN and RELU into the epilogue of this stage.
+            const layer_spec *quan = nullptr;
+            bool relu = false;
+            if (i + 1 < specs.size() && specs[i + 1].type == "QUAN") quan = &specs[++i];
+            if (quan && i + 1 < specs.size() && specs[i + 1].type == "RELU") relu = true, ++i;
+
+            // PWCONV is parsed as a 1x1 conv. DWCONV is a conv with one input channel per output channel.
+            bool is_conv = spec.type != "FC", depthwise = spec.type == "DWCONV";
+            size_t CI = depthwise ? 1 : spec.CI, CO = depthwise ? spec.C : spec.CO;
+            size_t H = is_conv ? spec.H : 1, W = is_conv ? spec.W : 1;
+            size_t HO = is_conv ? conv_output_size(H, spec.K, spec.stride, spec.pad, spec.dilation) : 1;
+            size_t WO = is_conv ? conv_output_size(W, spec.K, spec.stride, spec.pad, spec.dilation) : 1;
+            bool is_3x3 = !depthwise && spec.K == 3 && spec.stride == 1 && spec.pad == 1 && spec.dilation == 1;
+            out.C = CO, out.H = HO, out.W = WO;
+            out.c_type = relu ? "uint8_t" : (quan ? "int8_t" : "int32_t");
+            scratch_size = max(scratch_size, is_conv ? HO * WO : spec.CO);
+
+            emit_array(params, "int8_t", "weight" + id, spec.weight);
+            if (quan) {
+                emit_array(params, "int32_t", "bias" + id, quan->bias);
+                emit_array(params, "uint8_t", "shift" + id, quan->shift);
+            }
+
+            string epilogue;
+            if (!quan) epilogue = "acc[p]";
+            else if (!relu) epilogue = "int8_t((acc[p] - bias" + id + "[co]) >> shift" + id + "[co])";
+            else epilogue = "relu(int8_t((acc[p] - bias" + id + "[co]) >> shift" + id + "[co]))";
+
+            body << "    // " << spec.type;
+            if (depthwise) body << " C " << spec.C;
+            else body << " CI " << spec.CI << " CO " << spec.CO;
+            if (is_conv) body << " H " << H << " W " << W;
+            if (is_conv && !is_3x3 && spec.type != "PWCONV")
+                body << " K " << spec.K << " STRIDE " << spec.stride << " PAD " << spec.pad << " DILATION "
+                     << spec.dilation;
+            body << (quan ? " + QUAN" : "") << (relu ? " + RELU" : "") << "\n";
+            if (is_conv && !is_3x3) {
+                // Same as the 3x3 case below, for any geometry: tap (kh, kw) reads input offset
+                // (kh * D - P, kw * D - P) and only covers the outputs that keep it inside the image.
+                // Depthwise output channel co only reads input channel co.
+                const int K = int(spec.K), S = int(spec.stride), P = int(spec.pad), D = int(spec.dilation);
+                string channel_loop = depthwise ? "        for (int ci = co; ci <= co; ci++) {\n" :
+                                      "        for (int ci = 0; ci < " + to_string(CI) + "; ci++) {\n";
+                string filter = depthwise ? "co" : "co * " + to_string(CI) + " + ci";
+                body << "    for (int co = 0; co < " << CO << "; co++) {\n"
+                     << "        for (int p = 0; p < " << HO * WO << "; p++) acc[p] = 0;\n"
+                     << channel_loop
+                     << "            for (int kh = 0; kh < " << K << "; kh++) {\n"
+                     << "                for (int kw = 0; kw < " << K << "; kw++) {\n"
+                     << "                    const int32_t wt = weight" << id << "[((" << filter << ") * " << K
+                     << " + kh) * " << K << " + kw];\n"
+                     << "                    const int dh = kh * " << D << " - " << P << ", dw = kw * " << D << " - "
+                     << P << ";\n"
+                     << "                    const int h_lo = dh < 0 ? (" << S << " - 1 - dh) / " << S
+                     << " : 0, h_hi = dh >= " << H << " ? 0 : std::min(" << HO << ", (" << H - 1 << " - dh) / "
+                     << S << " + 1);\n"
+                     << "                    const int w_lo = dw < 0 ? (" << S << " - 1 - dw) / " << S
+                     << " : 0, w_hi = dw >= " << W << " ? 0 : std::min(" << WO << ", (" << W - 1 << " - dw) / "
+                     << S << " + 1);\n"
+                     << "                    const " << cur.c_type << " *src = " << cur.name << " + ci * " << H * W
+                     << ";\n"
+                     << "                    for (int h = h_lo; h < h_hi; h++)\n"
+                     << "                        for (int w = w_lo; w < w_hi; w++)\n"
+                     << "                            acc[h * " << WO << " + w] += wt * src[(h * " << S << " + dh) * "
+                     << W << " + w * " << S << " + dw];\n"
+                     << "                }\n"
+                     << "            }\n"
+                     << "        }\n"
+                     << "        for (int p = 0; p < " << HO * WO << "; p++) " << out.name << "[co * " << HO * WO
+                     << " + p] = " << epilogue << ";\n"
+                     << "    }\n";
+            } else if (is_conv) {
+                // Accumulate one output plane at a time. Each 3x3 tap is a shifted, branch-free
+                // multiply-add over the part of the plane it does not push into padding.
+                body << "    for (int co = 0; co < " << spec.CO << "; co++) {\n"
+                     << "        for (int p = 0; p < " << H * W << "; p++) acc[p] = 0;\n"
+                     << "        for (int ci = 0; ci < " << spec.CI << "; ci++) {\n"
+                     << "            for (int dh = -1; dh <= 1; dh++) {\n"
+                     << "                for (int dw = -1; dw <= 1; dw++) {\n"
+                     << "                    const int32_t wt = weight" << id << "[((co * " << spec.CI
+                     << " + ci) * 3 + dh + 1) * 3 + dw + 1];\n"
+                     << "                    const int h_lo = dh < 0 ? 1 : 0, h_hi = dh > 0 ? " << H - 1 << " : " << H
+                     << ";\n"
+                     << "                    const int w_lo = dw < 0 ? 1 : 0, w_hi = dw > 0 ? " << W - 1 << " : " << W
+                     << ";\n"
+                     << "                    const " << cur.c_type << " *src = " << cur.name << " + ci * " << H * W
+                     << ";\n"
+                     << "                    for (int h = h_lo; h < h_hi; h++)\n"
+                     << "                        for (int w = w_lo; w < w_hi; w++)\n"
+                     << "                            acc[h * " << W << " + w] += wt * src[(h + dh) * " << W << " + w + dw];\n"
+                     << "                }\n"
+                     << "            }\n"
+                     << "        }\n"
+                     << "        for (int p = 0; p < " << H * W << "; p++) " << out.name << "[co * " << H * W
+                     << " + p] = " << epilogue << ";\n"
+                     << "    }\n";
+            } else {
+                // Weights are [CI, CO], so walk ci outside and accumulate a contiguous row of outputs.
+                body << "    for (int p = 0; p < " << spec.CO << "; p++) acc[p] = 0;\n"
+                     << "    for (int ci = 0; ci < " << spec.CI << "; ci++) {\n"
+                     << "        const int32_t x = " << cur.name << "[ci];\n"
+                     << "        for (int co = 0; co < " << spec.CO << "; co++) acc[co] += x * weight" << id
+                     << "[ci * " << spec.CO << " + co];\n"
+                     << "    }\n"
+                     << "    for (int co = 0; co < " << spec.CO << "; co++) {\n"
+                     << "        const int p = co;\n"
+                     << "        " << out.name << "[co] = " << epilogue << ";\n"
+                     << "    }\n";
+            }
+        } else if (spec.type == "POOL") {
+            out.C = spec.C;
+            out.H = pool_output_size(spec.H, spec.K, spec.stride);
+            out.W = pool_output_size(spec.W, spec.K, spec.stride);
+            out.c_type = cur.c_type;
+            size_t n = spec.K * spec.K;
+            // Same window and rounding as cpu_pool.
+            body << "    // POOL C " << spec.C << " H " << spec.H << " W " << spec.W << " K " << spec.K << " STRIDE "
+                 << spec.stride << (spec.average ? " MODE AVG" : "") << "\n"
+                 << "    for (int c = 0; c < " << out.C << "; c++) {\n"
+                 << "        for (int ho = 0; ho < " << out.H << "; ho++) {\n"
+                 << "            for (int wo = 0; wo < " << out.W << "; wo++) {\n"
+                 << "                const " << cur.c_type << " *in = " << cur.name << " + (c * " << spec.H
+                 << " + ho * " << spec.stride << ") * " << spec.W << " + wo * " << spec.stride << ";\n"
+                 << "                " << (spec.average ? "uint32_t" : out.c_type) << " result = 0;\n"
+                 << "                for (int dh = 0; dh < " << spec.K << "; dh++)\n"
+                 << "                    for (int dw = 0; dw < " << spec.K << "; dw++)\n"
+                 << (spec.average ? "                        result += in[dh * " :
+                                    "                        result = std::max(result, in[dh * ")
+                 << spec.W << " + dw]" << (spec.average ? ";\n" : ");\n")
+                 << "                " << out.name << "[(c * " << out.H << " + ho) * " << out.W << " + wo] = ";
+            if (spec.average) body << "(result + " << n / 2 << ") / " << n << ";\n";
+            else body << "result;\n";
+            body << "            }\n"
+                 << "        }\n"
+                 << "    }\n";
+        } else if (spec.type == "GAP") {
+            out.C = spec.C, out.H = out.W = 1;
+            out.c_type = cur.c_type;
+            size_t n = spec.H * spec.W;
+            body << "    // GAP C " << spec.C << " H " << spec.H << " W " << spec.W << "\n"
+                 << "    for (int c = 0; c < " << spec.C << "; c++) {\n"
+                 << "        uint32_t sum = 0;\n"
+                 << "        for (int p = 0; p < " << n << "; p++) sum += " << cur.name << "[c * " << n << " + p];\n"
+                 << "        " << out.name << "[c] = (sum + " << n / 2 << ") / " << n << ";\n"
+                 << "    }\n";
+        } else if (spec.type == "QUAN") {
+            out.C = spec.C, out.H = spec.H, out.W = spec.W;
+            out.c_type = "int8_t";
+            emit_array(params, "int32_t", "bias" + id, spec.bias);
+            emit_array(params, "uint8_t", "shift" + id, spec.shift);
+            body << "    // QUAN C " << spec.C << " H " << spec.H << " W " << spec.W << "\n"
+                 << "    for (int c = 0; c < " << spec.C << "; c++)\n"
+                 << "        for (int p = 0; p < " << spec.H * spec.W << "; p++)\n"
+                 << "            " << out.name << "[c * " << spec.H * spec.W << " + p] = int8_t((" << cur.name
+                 << "[c * " << spec.H * spec.W << " + p] - bias" << id << "[c]) >> shift" << id << "[c]);\n";
+        } else if (spec.type == "RELU") {
+            out.C = spec.C, out.H = spec.H, out.W = spec.W;
+            out.c_type = "uint8_t";
+            body << "    // RELU C " << spec.C << " H " << spec.H << " W " << spec.W << "\n"
+                 << "    for (int p = 0; p < " << spec.C * spec.H * spec.W << "; p++) " << out.name
+                 << "[p] = relu(int8_t(" << cur.name << "[p]));\n";
+        }
+        buffers << "alignas(64) " << out.c_type << ' ' << out.name << '[' << out.C * out.H * out.W << "];\n";
+        cur = out;
+    }
+    if (cur.c_type == "int32_t") {
+        cout << "Model must end with an 8-bit output (QUAN or RELU)" << endl;
+        return 1;
+    }
+    const size_t output_size = cur.C * cur.H * cur.W;
+
+    ofstream header(stem + ".h");
+    string guard = prefix;
+    transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+    header << "// Generated by cnn_codegen from " << model_file << ". Do not edit.\n"
+           << "#ifndef " << guard << "_H\n"
+           << "#define " << guard << "_H\n\n"
+           << "#include <cstddef>\n"
+           << "#include <cstdint>\n\n"
+           << "const size_t " << prefix << "_input_size = " << input_size << ";\n"
+           << "const size_t " << prefix << "_output_size = " << output_size << ";\n\n"
+           << "// Run the network on one image of " << prefix << "_input_size bytes.\n"
+           << "// Writes " << prefix << "_output_size logits and returns the index of the largest.\n"
+           << "// Activations live in static buffers, so calls must not overlap.\n"
+           << "size_t " << prefix << "_forward(const uint8_t *image, int8_t *logits);\n\n"
+           << "#endif\n";
+
+    ofstream source(stem + ".cpp");
+    size_t slash = stem.find_last_of("/\\");
+    source << "// Generated by cnn_codegen from " << model_file << ". Do not edit.\n"
+           << "#include \"" << (slash == string::npos ? stem : stem.substr(slash + 1)) << ".h\"\n"
+           << "#include <algorithm>\n\n"
+           << "namespace {\n\n"
+           << params.str()
+           << "alignas(64) int32_t acc[" << scratch_size << "];\n"
+           << buffers.str() << "\n"
+           << "inline uint8_t relu(int8_t x) { return x > 0 ? x : 0; }\n\n"
+           << "}\n\n"
+           << "size_t " << prefix << "_forward(const uint8_t *image, int8_t *logits) {\n"
+           << body.str()
+           << "    size_t rc = 0;\n"
+           << "    for (size_t i = 0; i < " << output_size << "; i++) {\n"
+           << "        logits[i] = int8_t(" << cur.name << "[i]);\n"
+           << "        if (logits[i] > logits[rc]) rc = i;\n"
+           << "    }\n"
+           << "    return rc;\n"
+           << "}\n";
+    cout << "Generated " << stem << ".cpp and " << stem << ".h from " << specs.size() << " layers" << endl;
+    return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef OPENCL_CNN_CONV_DATASET_CPP
+#define OPENCL_CNN_CONV_DATASET_CPP
+
+#include <bits/stdc++.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Packed dataset file:
+//   dataset_header
+//   uint8_t images[N][C][H][W]  (already flipped, row 0 is the top row)
+//   uint8_t labels[N]
+struct dataset_header {
+    char magic[8]; // DATASET_MAGIC
+    uint32_t N, C, H, W;
+};
+
+const char DATASET_MAGIC[8] = {'C', 'N', 'N', 'D', 'A', 'T', 'A', '1'};
+
+// Write a packed dataset file. Returns false if the file cannot be written.
+bool write_packed_dataset(const string &file, uint32_t N, uint32_t C, uint32_t H, uint32_t W,
+                          const uint8_t *images, const uint8_t *labels) {
+    ofstream fs(file, ios::binary);
+    if (!fs) return false;
+    dataset_header header{};
+    memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+    header.N = N, header.C = C, header.H = H, header.W = W;
+    fs.write((const char *) &header, sizeof(header));
+    fs.write((const char *) images, size_t(N) * C * H * W);
+    fs.write((const char *) labels, N);
+    return bool(fs);
+}
+
+// Read-only memory mapping of a packed dataset file.
+// Images and labels point straight into the mapping, so loading is one open and one map.
+class packed_dataset {
+public:
+    size_t N = 0, C = 0, H = 0, W = 0;
+    const uint8_t *images = nullptr;
+    const uint8_t *labels = nullptr;
+
+    packed_dataset() = default;
+
+    packed_dataset(const packed_dataset &) = delete;
+
+    packed_dataset &operator=(const packed_dataset &) = delete;
+
+    // Map the file. Returns false if it does not exist or is not a valid packed dataset.
+    bool open(const string &file) {
+        close();
+        if (!map_file(file)) return false;
+        dataset_header header{};
+        if (size >= sizeof(header)) memcpy(&header, data, sizeof(header));
+        N = header.N, C = header.C, H = header.H, W = header.W;
+        if (memcmp(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0 ||
+            size != sizeof(header) + N * C * H * W + N) {
+            cout << "Not a packed dataset: " << file << endl;
+            close();
+            return false;
+        }
+        images = (const uint8_t *) data + sizeof(header);
+        labels = images + N * C * H * W;
+        return true;
+    }
+
+    const uint8_t *image(size_t i) const { return images + i * C * H * W; }
+
+    void close() {
+        if (data) {
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+            CloseHandle(mapping);
+            CloseHandle(file_handle);
+            mapping = nullptr;
+            file_handle = INVALID_HANDLE_VALUE;
+#else
+            munmap(data, size);
+#endif
+        }
+        data = nullptr;
+        size = 0;
+        images = labels = nullptr;
+        N = C = H = W = 0;
+    }
+
+    ~packed_dataset() { close(); }
+
+private:
+    void *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE, mapping = nullptr;
+
+    bool map_file(const string &file) {
+        file_handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file_handle == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_handle, &file_size);
+        size = file_size.QuadPart;
+        mapping = size ? CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+        data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!data) {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file_handle);
+            return false;
+        }
+        return true;
+    }
+#else
+
+    bool map_file(const string &file) {
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st{};
+        fstat(fd, &st);
+        size = st.st_size;
+        data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+#endif
+};
+
+#endif //OPENCL_CNN_CONV_DATASET_CPP
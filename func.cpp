@@ -7,35 +7,184 @@
 
 #include <bits/stdc++.h>
 
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 
+// One output pixel of cpu_conv, with bounds checks. Only used for the one-pixel border.
+int32_t cpu_conv_pixel(size_t CI, size_t H, size_t W, int co, int h, int w,
+                       const int8_t *weight,
+                       const uint8_t *image) {
+    int32_t acc = 0;
+    for (int dw = -1; dw <= 1; dw++) {
+        for (int dh = -1; dh <= 1; dh++) {
+            int hh = h + dh, ww = w + dw;
+            int hhh = dh + 1, www = dw + 1;
+            if (ww >= 0 && ww < W && hh >= 0 && hh < H) {
+                for (int ci = 0; ci < CI; ci++) {
+                    acc += weight[co * CI * 3 * 3 + ci * 3 * 3 + hhh * 3 + www] *
+                           image[ci * H * W + hh * W + ww];
+                }
+            }
+        }
+    }
+    return acc;
+}
+
 void cpu_conv(size_t CI, size_t CO, size_t H, size_t W,
           const int8_t *weight,
           const uint8_t *image,
           int32_t *dst) {
     for (int co = 0; co < CO; co++) {
         for (int h = 0; h < H; h++) {
-            for (int w = 0; w < W; w++) {
-                int32_t acc = 0;
-                for (int dw = -1; dw <= 1; dw++) {
-                    for (int dh = -1; dh <= 1; dh++) {
-                        int hh = h + dh, ww = w + dw;
-                        int hhh = dh + 1, www = dw + 1;
-                        if (ww >= 0 && ww < W && hh >= 0 && hh < H) {
-                            for (int ci = 0; ci < CI; ci++) {
-                                acc += weight[co * CI * 3 * 3 + ci * 3 * 3 + hhh * 3 + www] *
-                                       image[ci * H * W + hh * W + ww];
-                            }
-                        }
+            int32_t *out = dst + co * H * W + h * W;
+            if (h == 0 || h == H - 1) {
+                for (int w = 0; w < W; w++) out[w] = cpu_conv_pixel(CI, H, W, co, h, w, weight, image);
+                continue;
+            }
+            // Interior of the row: all 9 taps are inside the image, so accumulate
+            // branch-free along the row, one input channel at a time.
+            for (int w = 1; w < W - 1; w++) out[w] = 0;
+            for (int ci = 0; ci < CI; ci++) {
+                const int8_t *k = weight + (co * CI + ci) * 3 * 3;
+                const uint8_t *r0 = image + ci * H * W + (h - 1) * W, *r1 = r0 + W, *r2 = r1 + W;
+                for (int w = 1; w < W - 1; w++) {
+                    out[w] += k[0] * r0[w - 1] + k[1] * r0[w] + k[2] * r0[w + 1] +
+                              k[3] * r1[w - 1] + k[4] * r1[w] + k[5] * r1[w + 1] +
+                              k[6] * r2[w - 1] + k[7] * r2[w] + k[8] * r2[w + 1];
+                }
+            }
+            out[0] = cpu_conv_pixel(CI, H, W, co, h, 0, weight, image);
+            out[W - 1] = cpu_conv_pixel(CI, H, W, co, h, W - 1, weight, image);
+        }
+    }
+}
+
+// One output pixel of cpu_conv_generic, with bounds checks.
+int32_t cpu_conv_generic_pixel(size_t CI, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                               int co, int ho, int wo,
+                               const int8_t *weight,
+                               const uint8_t *image) {
+    int32_t acc = 0;
+    int h0 = ho * int(S) - int(P), w0 = wo * int(S) - int(P);
+    for (int ci = 0; ci < CI; ci++) {
+        for (int kh = 0; kh < K; kh++) {
+            int hh = h0 + kh * int(D);
+            if (hh < 0 || hh >= H) continue;
+            for (int kw = 0; kw < K; kw++) {
+                int ww = w0 + kw * int(D);
+                if (ww >= 0 && ww < W)
+                    acc += weight[((co * CI + ci) * K + kh) * K + kw] * image[(ci * H + hh) * W + ww];
+            }
+        }
+    }
+    return acc;
+}
+
+// First and one past the last output position whose tap at input offset "d" (kernel position * D - P)
+// falls inside an input of size "in", for outputs of size "out" and stride S.
+inline pair<int, int> conv_tap_range(int d, size_t in, size_t out, size_t S) {
+    int lo = d < 0 ? (-d + int(S) - 1) / int(S) : 0;
+    int hi = d >= int(in) ? 0 : min(int(out), (int(in) - 1 - d) / int(S) + 1);
+    return {lo, max(lo, hi)};
+}
+
+// Conv with any square kernel size K, stride S, zero padding P and dilation D.
+// The input is [CI, H, W], the weight [CO, CI, K, K] and the output [CO, HO, WO].
+// Every tap is a strided multiply-add over the output pixels it does not push into padding.
+void cpu_conv_generic(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                      size_t HO, size_t WO,
+                      const int8_t *weight,
+                      const uint8_t *image,
+                      int32_t *dst) {
+    for (int co = 0; co < CO; co++) {
+        int32_t *out = dst + co * HO * WO;
+        fill(out, out + HO * WO, 0);
+        for (int ci = 0; ci < CI; ci++) {
+            for (int kh = 0; kh < K; kh++) {
+                int dh = kh * int(D) - int(P);
+                auto rows = conv_tap_range(dh, H, HO, S);
+                for (int kw = 0; kw < K; kw++) {
+                    int dw = kw * int(D) - int(P);
+                    auto cols = conv_tap_range(dw, W, WO, S);
+                    int32_t k = weight[((co * CI + ci) * K + kh) * K + kw];
+                    for (int ho = rows.first; ho < rows.second; ho++) {
+                        const uint8_t *in = image + (ci * H + ho * S + dh) * W;
+                        int32_t *o = out + ho * WO;
+                        for (int wo = cols.first; wo < cols.second; wo++) o[wo] += k * in[wo * int(S) + dw];
                     }
                 }
-                dst[co * H * W + h * W + w] = acc;
             }
         }
     }
 }
 
+// Unpadded 1x1 conv with stride 1: the product of the [CO, CI] weight and the [CI, H * W] image.
+void cpu_conv_1x1(size_t CI, size_t CO, size_t H, size_t W,
+                  const int8_t *weight,
+                  const uint8_t *image,
+                  int32_t *dst) {
+    size_t HW = H * W;
+    for (int co = 0; co < CO; co++) {
+        int32_t *out = dst + co * HW;
+        fill(out, out + HW, 0);
+        for (int ci = 0; ci < CI; ci++) {
+            int32_t k = weight[co * CI + ci];
+            const uint8_t *in = image + ci * HW;
+            for (int p = 0; p < HW; p++) out[p] += k * in[p];
+        }
+    }
+}
+
+// 3x3 conv with stride 2 and padding 1, output [CO, HO, WO]. Interior pixels take all 9 taps without bounds checks.
+void cpu_conv_3x3s2(size_t CI, size_t CO, size_t H, size_t W, size_t HO, size_t WO,
+                    const int8_t *weight,
+                    const uint8_t *image,
+                    int32_t *dst) {
+    // Output column wo reads input columns 2 wo - 1 .. 2 wo + 1, so [1, w_end) needs no checks.
+    int w_end = max(1, min(int(WO), int(W) / 2));
+    for (int co = 0; co < CO; co++) {
+        for (int ho = 0; ho < HO; ho++) {
+            int32_t *out = dst + (co * HO + ho) * WO;
+            if (ho == 0 || 2 * ho + 1 >= H) {
+                for (int wo = 0; wo < WO; wo++)
+                    out[wo] = cpu_conv_generic_pixel(CI, H, W, 3, 2, 1, 1, co, ho, wo, weight, image);
+                continue;
+            }
+            for (int wo = 1; wo < w_end; wo++) out[wo] = 0;
+            for (int ci = 0; ci < CI; ci++) {
+                const int8_t *k = weight + (co * CI + ci) * 3 * 3;
+                const uint8_t *r0 = image + ci * H * W + (2 * ho - 1) * W, *r1 = r0 + W, *r2 = r1 + W;
+                for (int wo = 1; wo < w_end; wo++) {
+                    int w = 2 * wo - 1;
+                    out[wo] += k[0] * r0[w] + k[1] * r0[w + 1] + k[2] * r0[w + 2] +
+                               k[3] * r1[w] + k[4] * r1[w + 1] + k[5] * r1[w + 2] +
+                               k[6] * r2[w] + k[7] * r2[w + 1] + k[8] * r2[w + 2];
+                }
+            }
+            out[0] = cpu_conv_generic_pixel(CI, H, W, 3, 2, 1, 1, co, ho, 0, weight, image);
+            for (int wo = w_end; wo < WO; wo++)
+                out[wo] = cpu_conv_generic_pixel(CI, H, W, 3, 2, 1, 1, co, ho, wo, weight, image);
+        }
+    }
+}
+
+// Planar conv with the fastest path for the geometry: cpu_conv for 3x3 stride 1 padding 1,
+// cpu_conv_3x3s2, cpu_conv_1x1 for unpadded 1x1 stride 1, and cpu_conv_generic otherwise.
+void cpu_conv_any(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                  size_t HO, size_t WO,
+                  const int8_t *weight,
+                  const uint8_t *image,
+                  int32_t *dst) {
+    if (K == 3 && S == 1 && P == 1 && D == 1) cpu_conv(CI, CO, H, W, weight, image, dst);
+    else if (K == 3 && S == 2 && P == 1 && D == 1) cpu_conv_3x3s2(CI, CO, H, W, HO, WO, weight, image, dst);
+    else if (K == 1 && S == 1 && P == 0) cpu_conv_1x1(CI, CO, H, W, weight, image, dst);
+    else cpu_conv_generic(CI, CO, H, W, K, S, P, D, HO, WO, weight, image, dst);
+}
+
 void cpu_fc(size_t CI, size_t CO,
         const int8_t *weight,
         const uint8_t *feature,
@@ -49,6 +198,151 @@ void cpu_fc(size_t CI, size_t CO,
     }
 }
 
+// Nonzero weights of an int8 matrix, row by row (CSR): the nonzeros of row r are value[offset[r]] up to
+// value[offset[r + 1]], in the columns index[...]. Three bytes per nonzero instead of one per weight, so the
+// encoding also reads less memory below a third of nonzero weights.
+struct sparse_rows {
+    vector<uint32_t> offset;
+    vector<uint16_t> index;
+    vector<int8_t> value;
+
+    size_t bytes() const { return offset.size() * sizeof(uint32_t) + index.size() * sizeof(uint16_t) + value.size(); }
+};
+
+// Largest number of columns of a sparse_rows.
+const size_t SPARSE_MAX_COLUMNS = 65536;
+
+// Compress R rows of C weights, where weight (r, c) is at weight[r * row_step + c * column_step].
+// column_step != 1 compresses the transpose of a row-major matrix.
+sparse_rows compress_rows(size_t R, size_t C, size_t row_step, size_t column_step, const int8_t *weight) {
+    assert(C <= SPARSE_MAX_COLUMNS);
+    sparse_rows sparse;
+    sparse.offset.push_back(0);
+    for (size_t r = 0; r < R; r++) {
+        for (size_t c = 0; c < C; c++) {
+            int8_t w = weight[r * row_step + c * column_step];
+            if (w == 0) continue;
+            sparse.index.push_back(uint16_t(c));
+            sparse.value.push_back(w);
+        }
+        sparse.offset.push_back(uint32_t(sparse.value.size()));
+    }
+    return sparse;
+}
+
+// Fraction of nonzero values among n weights.
+double weight_density(size_t n, const int8_t *weight) {
+    return n ? double(n - count(weight, weight + n, 0)) / n : 1;
+}
+
+// cpu_conv_generic over the nonzero taps only. The weight is compress_rows of [CO, CI * K * K], so every output
+// channel has the list of its nonzero (ci, kh, kw) taps, and the work is proportional to the nonzero weights.
+void cpu_conv_sparse(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                     size_t HO, size_t WO,
+                     const sparse_rows &weight,
+                     const uint8_t *image,
+                     int32_t *dst) {
+    for (int co = 0; co < CO; co++) {
+        int32_t *out = dst + co * HO * WO;
+        fill(out, out + HO * WO, 0);
+        for (uint32_t i = weight.offset[co]; i < weight.offset[co + 1]; i++) {
+            int tap = weight.index[i], ci = tap / int(K * K), kh = tap / int(K) % int(K), kw = tap % int(K);
+            int dh = kh * int(D) - int(P), dw = kw * int(D) - int(P);
+            auto rows = conv_tap_range(dh, H, HO, S), cols = conv_tap_range(dw, W, WO, S);
+            int32_t k = weight.value[i];
+            for (int ho = rows.first; ho < rows.second; ho++) {
+                const uint8_t *in = image + (ci * H + ho * S + dh) * W;
+                int32_t *o = out + ho * WO;
+                for (int wo = cols.first; wo < cols.second; wo++) o[wo] += k * in[wo * int(S) + dw];
+            }
+        }
+    }
+}
+
+// Fc with the weight as compress_rows of [CI, CO]: every input adds its nonzero weights to the outputs.
+// Zero inputs, e.g. after relu, skip their row entirely.
+void cpu_fc_sparse(size_t CI, size_t CO,
+                   const sparse_rows &weight,
+                   const uint8_t *feature,
+                   int32_t *dst) {
+    fill(dst, dst + CO, 0);
+    for (int ci = 0; ci < CI; ci++) {
+        int32_t x = feature[ci];
+        if (x == 0) continue;
+        for (uint32_t i = weight.offset[ci]; i < weight.offset[ci + 1]; i++)
+            dst[weight.index[i]] += x * weight.value[i];
+    }
+}
+
+// True if every weight fits in int4, [-8, 7].
+bool fits_int4(size_t n, const int8_t *weight) {
+    return all_of(weight, weight + n, [](int8_t w) { return w >= -8 && w <= 7; });
+}
+
+// Bytes of a row of C int4 values. Every row starts on a byte, so it can be unpacked on its own.
+inline size_t int4_row_bytes(size_t C) {
+    return (C + 1) / 2;
+}
+
+// Value i of a row packed by pack_int4. Even values are in the low nibble, odd ones in the high nibble.
+inline int32_t int4_value(const uint8_t *row, size_t i) {
+    return int8_t(row[i / 2] << (i % 2 ? 0 : 4)) >> 4;
+}
+
+// An [R, C] int8 matrix with values in [-8, 7] -> R rows of int4_row_bytes(C) bytes, two values per byte.
+uint8_t *pack_int4(size_t R, size_t C, const int8_t *weight) {
+    size_t row = int4_row_bytes(C);
+    auto packed = new uint8_t[R * row]();
+    for (int r = 0; r < R; r++) {
+        for (int c = 0; c < C; c++) packed[r * row + c / 2] |= (weight[r * C + c] & 0xf) << (c % 2 * 4);
+    }
+    return packed;
+}
+
+// Inverse of pack_int4.
+void unpack_int4(size_t R, size_t C, const uint8_t *packed, int8_t *dst) {
+    for (int r = 0; r < R; r++) {
+        for (int c = 0; c < C; c++) dst[r * C + c] = int4_value(packed + r * int4_row_bytes(C), c);
+    }
+}
+
+// Fc with the [CI, CO] weight packed by pack_int4, a row per input. Input by input, so the two values of a byte
+// go to neighbouring outputs and are unpacked in registers.
+void cpu_fc_int4(size_t CI, size_t CO,
+                 const uint8_t *weight,
+                 const uint8_t *feature,
+                 int32_t *dst) {
+    size_t row = int4_row_bytes(CO);
+    fill(dst, dst + CO, 0);
+    for (int ci = 0; ci < CI; ci++) {
+        int32_t x = feature[ci];
+        const uint8_t *w = weight + ci * row;
+        for (int j = 0; j < CO / 2; j++) {
+            dst[2 * j] += (int8_t(w[j] << 4) >> 4) * x;
+            dst[2 * j + 1] += (int8_t(w[j]) >> 4) * x;
+        }
+        if (CO % 2) dst[CO - 1] += int4_value(w, CO - 1) * x;
+    }
+}
+
+// Conv with the [CO, CI, K, K] weight packed by pack_int4, a row per output channel. Every output channel is
+// unpacked into a buffer that stays in L1 and runs as a single channel cpu_conv_any, or cpu_conv_generic if
+// "generic".
+void cpu_conv_int4(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                   size_t HO, size_t WO, bool generic,
+                   const uint8_t *weight,
+                   const uint8_t *image,
+                   int32_t *dst) {
+    size_t taps = CI * K * K;
+    vector<int8_t> channel(taps);
+    for (int co = 0; co < CO; co++) {
+        unpack_int4(1, taps, weight + co * int4_row_bytes(taps), channel.data());
+        int32_t *out = dst + co * HO * WO;
+        if (generic) cpu_conv_generic(CI, 1, H, W, K, S, P, D, HO, WO, channel.data(), image, out);
+        else cpu_conv_any(CI, 1, H, W, K, S, P, D, HO, WO, channel.data(), image, out);
+    }
+}
+
 void cpu_quan(size_t C, size_t H, size_t W,
           const int32_t *bias,
           const uint8_t *shift,
@@ -66,27 +360,62 @@ void cpu_quan(size_t C, size_t H, size_t W,
     }
 }
 
-void cpu_pool(size_t C, size_t H, size_t W, size_t HO, size_t WO,
-          uint8_t *feature,
+// Average of n pooled values summing to sum, rounded half up. Shared by every average pool and GAP.
+inline uint8_t pool_average(uint32_t sum, uint32_t n) {
+    return (sum + n / 2) / n;
+}
+
+// K x K pool with stride S and no padding, max or average. HO = pool_output_size(H, K, S).
+void cpu_pool(size_t C, size_t H, size_t W, size_t HO, size_t WO, size_t K, size_t S, bool average,
+          const uint8_t *feature,
           uint8_t *dst) {
     for (int c = 0; c < C; c++) {
         for (int ho = 0; ho < HO; ho++) {
             for (int wo = 0; wo < WO; wo++) {
-                uint8_t result = 0;
-                for (int dh = 0; dh <= 1; dh++) {
-                    for (int dw = 0; dw <= 1; dw++) {
-                        int h = ho * 2 + dh, w = wo * 2 + dw;
-                        if (h >= 0 && h < H && w > 0 && w < W) {
-                            result = max(result, feature[c * H * W + h * W + w]);
-                        }
+                const uint8_t *in = feature + (c * H + ho * S) * W + wo * S;
+                uint32_t result = 0;
+                for (int dh = 0; dh < K; dh++) {
+                    for (int dw = 0; dw < K; dw++) {
+                        uint32_t v = in[dh * W + dw];
+                        result = average ? result + v : max(result, v);
                     }
                 }
+                dst[c * HO * WO + ho * WO + wo] = average ? pool_average(result, K * K) : result;
+            }
+        }
+    }
+}
+
+// Max pool on the int32 conv output, used when pool is moved before quan. Same window as cpu_pool.
+void cpu_pool_int32(size_t C, size_t H, size_t W, size_t HO, size_t WO, size_t K, size_t S,
+                    const int32_t *feature,
+                    int32_t *dst) {
+    for (int c = 0; c < C; c++) {
+        for (int ho = 0; ho < HO; ho++) {
+            for (int wo = 0; wo < WO; wo++) {
+                const int32_t *in = feature + (c * H + ho * S) * W + wo * S;
+                int32_t result = INT32_MIN;
+                for (int dh = 0; dh < K; dh++) {
+                    for (int dw = 0; dw < K; dw++) result = max(result, in[dh * W + dw]);
+                }
                 dst[c * HO * WO + ho * WO + wo] = result;
             }
         }
     }
 }
 
+// Global average pool, [C, H, W] -> [C].
+void cpu_gap(size_t C, size_t H, size_t W,
+             const uint8_t *feature,
+             uint8_t *dst) {
+    for (int c = 0; c < C; c++) {
+        const uint8_t *in = feature + c * H * W;
+        uint32_t sum = 0;
+        for (int p = 0; p < H * W; p++) sum += in[p];
+        dst[c] = pool_average(sum, H * W);
+    }
+}
+
 
 void cpu_relu(size_t C, size_t H, size_t W,
           int8_t *feature,
@@ -101,4 +430,731 @@ void cpu_relu(size_t C, size_t H, size_t W,
     }
 }
 
+// relu((int8_t) x): the quan output is truncated to int8 before relu clamps it.
+inline uint8_t quan_relu_scalar(int32_t x) {
+    return max((int8_t) 0, (int8_t) x);
+}
+
+#ifdef __SSE2__
+// Vector version of quan_relu_scalar on 4 int32 lanes that were already shifted.
+// Keeping the low byte only if it is below 0x80 is the int8 truncation followed by relu,
+// and it leaves values in [0, 127], so the saturating packs that follow are exact.
+inline __m128i quan_relu_sse(__m128i x) {
+    x = _mm_and_si128(x, _mm_set1_epi32(0xFF));
+    return _mm_and_si128(x, _mm_cmplt_epi32(x, _mm_set1_epi32(0x80)));
+}
+#endif
+
+// Quan and relu of N values with one bias and shift per value, as in a fc feature or one blocked pixel.
+void cpu_quan_relu_lanes(size_t N,
+                         const int32_t *bias,
+                         const uint8_t *shift,
+                         const int32_t *feature,
+                         uint8_t *dst) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    // Per-lane shift counts need the AVX2 variable shift.
+    for (; i + 16 <= N; i += 16) {
+        __m128i v[4];
+        for (int j = 0; j < 2; j++) {
+            __m256i x = _mm256_loadu_si256((const __m256i *) (feature + i + 8 * j));
+            __m256i b = _mm256_loadu_si256((const __m256i *) (bias + i + 8 * j));
+            __m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (shift + i + 8 * j)));
+            x = _mm256_srav_epi32(_mm256_sub_epi32(x, b), s);
+            v[2 * j] = quan_relu_sse(_mm256_castsi256_si128(x));
+            v[2 * j + 1] = quan_relu_sse(_mm256_extracti128_si256(x, 1));
+        }
+        __m128i r = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i *) (dst + i), r);
+    }
+#endif
+    for (; i < N; i++) dst[i] = quan_relu_scalar((feature[i] - bias[i]) >> shift[i]);
+}
+
+// Fused cpu_quan and cpu_relu in one pass, writing uint8 directly.
+void cpu_quan_relu(size_t C, size_t H, size_t W,
+                   const int32_t *bias,
+                   const uint8_t *shift,
+                   const int32_t *feature,
+                   uint8_t *dst) {
+    size_t HW = H * W;
+    // A fc shaped feature has a different bias and shift for every value.
+    if (HW == 1) {
+        cpu_quan_relu_lanes(C, bias, shift, feature, dst);
+        return;
+    }
+    for (int c = 0; c < C; c++) {
+        const int32_t *in = feature + c * HW;
+        uint8_t *out = dst + c * HW;
+        size_t i = 0;
+#ifdef __SSE2__
+        // One bias and shift for the whole channel plane, 16 values per iteration.
+        const __m128i b = _mm_set1_epi32(bias[c]);
+        const __m128i s = _mm_cvtsi32_si128(shift[c]);
+        for (; i + 16 <= HW; i += 16) {
+            __m128i v[4];
+            for (int j = 0; j < 4; j++) {
+                __m128i x = _mm_loadu_si128((const __m128i *) (in + i + 4 * j));
+                v[j] = quan_relu_sse(_mm_sra_epi32(_mm_sub_epi32(x, b), s));
+            }
+            __m128i r = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+            _mm_storeu_si128((__m128i *) (out + i), r);
+        }
+#endif
+        for (; i < HW; i++) out[i] = quan_relu_scalar((in[i] - bias[c]) >> shift[c]);
+    }
+}
+
+// Requantization at the end of a depthwise or pointwise conv: quan, then relu if "relu".
+// Without bias the conv writes its int32 accumulators, with it int8 values (uint8 after relu).
+struct conv_epilogue {
+    const int32_t *bias = nullptr;
+    const uint8_t *shift = nullptr;
+    bool relu = false;
+};
+
+// Write n accumulators of channel c, which share one bias and shift, to element "pos" of dst.
+void store_channel(const conv_epilogue &epilogue, size_t c, size_t n, const int32_t *acc, void *dst, size_t pos) {
+    if (!epilogue.bias) copy(acc, acc + n, (int32_t *) dst + pos);
+    else if (epilogue.relu)
+        cpu_quan_relu(1, 1, n, epilogue.bias + c, epilogue.shift + c, acc, (uint8_t *) dst + pos);
+    else cpu_quan(1, 1, n, epilogue.bias + c, epilogue.shift + c, acc, (int8_t *) dst + pos);
+}
+
+// Depthwise conv: channel c of the [C, H, W] image is convolved with its own K x K filter from the [C, K, K] weight,
+// with stride S, zero padding P and dilation D. The output is [C, HO, WO].
+// Every tap is a multiply-add over the part of the output plane it does not push into padding, contiguous at
+// stride 1. With an epilogue each plane is accumulated in "acc" [HO * WO] and requantized while it is in cache.
+void cpu_dwconv(size_t C, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D, size_t HO, size_t WO,
+                const int8_t *weight,
+                const uint8_t *image,
+                const conv_epilogue &epilogue, int32_t *acc,
+                void *dst) {
+    for (int c = 0; c < C; c++) {
+        int32_t *out = epilogue.bias ? acc : (int32_t *) dst + c * HO * WO;
+        fill(out, out + HO * WO, 0);
+        const uint8_t *plane = image + c * H * W;
+        for (int kh = 0; kh < K; kh++) {
+            int dh = kh * int(D) - int(P);
+            auto rows = conv_tap_range(dh, H, HO, S);
+            for (int kw = 0; kw < K; kw++) {
+                int dw = kw * int(D) - int(P);
+                auto cols = conv_tap_range(dw, W, WO, S);
+                int32_t k = weight[(c * K + kh) * K + kw];
+                for (int ho = rows.first; ho < rows.second; ho++) {
+                    const uint8_t *in = plane + (ho * S + dh) * W + dw;
+                    int32_t *o = out + ho * WO;
+                    if (S == 1) for (int wo = cols.first; wo < cols.second; wo++) o[wo] += k * in[wo];
+                    else for (int wo = cols.first; wo < cols.second; wo++) o[wo] += k * in[wo * int(S)];
+                }
+            }
+        }
+        if (epilogue.bias) store_channel(epilogue, c, HO * WO, acc, dst, c * HO * WO);
+    }
+}
+
+// cpu_dwconv through cpu_conv_generic, one channel at a time. Reference for verification.
+void cpu_dwconv_generic(size_t C, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D, size_t HO, size_t WO,
+                        const int8_t *weight,
+                        const uint8_t *image,
+                        const conv_epilogue &epilogue, int32_t *acc,
+                        void *dst) {
+    for (int c = 0; c < C; c++) {
+        int32_t *out = epilogue.bias ? acc : (int32_t *) dst + c * HO * WO;
+        cpu_conv_generic(1, 1, H, W, K, S, P, D, HO, WO, weight + c * K * K, image + c * H * W, out);
+        if (epilogue.bias) store_channel(epilogue, c, HO * WO, acc, dst, c * HO * WO);
+    }
+}
+
+// Pointwise weight [CO, CI] -> [ceil(CO / 4), ceil(CI / 2), 4] int32 for cpu_pwconv. Every int32 holds the weights
+// of input channels 2i (low int16) and 2i + 1 (high int16) for one output channel. Padding weights are zero.
+int32_t *pack_pwconv_weight(size_t CI, size_t CO, const int8_t *weight) {
+    size_t CIP = (CI + 1) / 2;
+    auto packed = new int32_t[(CO + 3) / 4 * CIP * 4]();
+    for (int co = 0; co < CO; co++) {
+        for (int ci = 0; ci < CI; ci++) {
+            auto w = uint32_t(uint16_t(int16_t(weight[co * CI + ci])));
+            auto &p = packed[(co / 4 * CIP + ci / 2) * 4 + co % 4];
+            p = int32_t(uint32_t(p) | (ci % 2 ? w << 16u : w));
+        }
+    }
+    return packed;
+}
+
+// Weight of input channel ci and output channel j of a 4 output channel tile of pack_pwconv_weight.
+inline int32_t pwconv_weight(const int32_t *tile, size_t ci, size_t j) {
+    int32_t pair = tile[ci / 2 * 4 + j];
+    return ci % 2 ? pair >> 16 : int16_t(pair & 0xFFFF);
+}
+
+#ifdef __SSE2__
+// a[j] += the 8 pixels of x0 and x1 (channels 2i and 2i + 1, zero-extended to int16) times weight pair j of w.
+inline void pwconv_madd_sse(__m128i a[4][2], __m128i x0, __m128i x1, __m128i w) {
+    // Interleaved as int16 pairs, one pixel per int32 lane.
+    __m128i lo = _mm_unpacklo_epi16(x0, x1), hi = _mm_unpackhi_epi16(x0, x1);
+    __m128i wj[4] = {_mm_shuffle_epi32(w, 0x00), _mm_shuffle_epi32(w, 0x55),
+                     _mm_shuffle_epi32(w, 0xAA), _mm_shuffle_epi32(w, 0xFF)};
+    for (int j = 0; j < 4; j++) {
+        a[j][0] = _mm_add_epi32(a[j][0], _mm_madd_epi16(lo, wj[j]));
+        a[j][1] = _mm_add_epi32(a[j][1], _mm_madd_epi16(hi, wj[j]));
+    }
+}
+#endif
+
+// Pointwise (1x1) conv as an int8 GEMM: the [CO, CI] weight times the [CI, HW] image is the [CO, HW] output.
+// The weight comes from pack_pwconv_weight. Blocks of 4 output channels x 8 pixels are accumulated in registers
+// over all input channels, two input channels per multiply-add (pmaddwd), and stored through the epilogue
+// a strip of TILE pixels at a time.
+void cpu_pwconv(size_t CI, size_t CO, size_t HW,
+                const int32_t *packed,
+                const uint8_t *image,
+                const conv_epilogue &epilogue,
+                void *dst) {
+    const size_t CIP = (CI + 1) / 2, TILE = 64;
+    int32_t acc[4][TILE];
+    for (size_t cot = 0; cot < (CO + 3) / 4; cot++) {
+        const int32_t *tile = packed + cot * CIP * 4;
+        size_t rows = min<size_t>(4, CO - cot * 4);
+        for (size_t p0 = 0; p0 < HW; p0 += TILE) {
+            size_t n = min(TILE, HW - p0), p = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            for (; p + 8 <= n; p += 8) {
+                __m128i a[4][2];
+                for (auto &r:a) r[0] = r[1] = zero;
+                const uint8_t *in = image + p0 + p;
+                size_t i = 0;
+                for (; i < CI / 2; i++) {
+                    __m128i x0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in + 2 * i * HW)), zero);
+                    __m128i x1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in + (2 * i + 1) * HW)), zero);
+                    pwconv_madd_sse(a, x0, x1, _mm_loadu_si128((const __m128i *) (tile + i * 4)));
+                }
+                if (CI % 2) {
+                    // The last channel has no partner, its weight pairs have a zero high half.
+                    __m128i x0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in + 2 * i * HW)), zero);
+                    pwconv_madd_sse(a, x0, zero, _mm_loadu_si128((const __m128i *) (tile + i * 4)));
+                }
+                for (int j = 0; j < 4; j++) {
+                    _mm_storeu_si128((__m128i *) (acc[j] + p), a[j][0]);
+                    _mm_storeu_si128((__m128i *) (acc[j] + p + 4), a[j][1]);
+                }
+            }
+#endif
+            for (; p < n; p++) {
+                int32_t a[4] = {0};
+                for (size_t ci = 0; ci < CI; ci++) {
+                    int32_t x = image[ci * HW + p0 + p];
+                    for (int j = 0; j < 4; j++) a[j] += pwconv_weight(tile, ci, j) * x;
+                }
+                for (int j = 0; j < 4; j++) acc[j][p] = a[j];
+            }
+            for (size_t j = 0; j < rows; j++)
+                store_channel(epilogue, cot * 4 + j, n, acc[j], dst, (cot * 4 + j) * HW + p0);
+        }
+    }
+}
+
+// cpu_pwconv through cpu_conv_generic on the plain [CO, CI] weight, one output channel at a time.
+// Reference for verification. "acc" is [H * W].
+void cpu_pwconv_generic(size_t CI, size_t CO, size_t H, size_t W,
+                        const int8_t *weight,
+                        const uint8_t *image,
+                        const conv_epilogue &epilogue, int32_t *acc,
+                        void *dst) {
+    for (int co = 0; co < CO; co++) {
+        int32_t *out = epilogue.bias ? acc : (int32_t *) dst + co * H * W;
+        cpu_conv_generic(CI, 1, H, W, 1, 1, 0, 1, H, W, weight + co * CI, image, out);
+        if (epilogue.bias) store_channel(epilogue, co, H * W, acc, dst, co * H * W);
+    }
+}
+
+// Channel block of the blocked cpu layout [C / CB, H, W, CB].
+// The channels of one pixel are contiguous, so the innermost loops run over CB lanes.
+// Build with -DCHANNEL_BLOCK=32 or 64 to match a wider SIMD unit.
+#ifndef CHANNEL_BLOCK
+#define CHANNEL_BLOCK 16
+#endif
+const size_t CB = CHANNEL_BLOCK;
+
+// Number of channels after padding C to whole blocks.
+inline size_t blocked_channels(size_t C) {
+    return (C + CB - 1) / CB * CB;
+}
+
+// [C, H, W] -> [C / CB, H, W, CB]. Padding channels are written as zero.
+template<class T>
+void to_blocked(size_t C, size_t H, size_t W, const T *src, T *dst) {
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        for (int h = 0; h < H; h++) {
+            for (int w = 0; w < W; w++) {
+                for (int l = 0; l < CB; l++) {
+                    int c = cb * CB + l;
+                    dst[((cb * H + h) * W + w) * CB + l] = c < C ? src[c * H * W + h * W + w] : 0;
+                }
+            }
+        }
+    }
+}
+
+// [C / CB, H, W, CB] -> [C, H, W]. Padding channels are dropped.
+template<class T>
+void from_blocked(size_t C, size_t H, size_t W, const T *src, T *dst) {
+    for (int c = 0; c < C; c++) {
+        for (int h = 0; h < H; h++) {
+            for (int w = 0; w < W; w++) {
+                dst[c * H * W + h * W + w] = src[((c / CB * H + h) * W + w) * CB + c % CB];
+            }
+        }
+    }
+}
+
+// Conv weight [CO, CI, K, K] -> [CO / CB, CI, K, K, CB], padding output channels with zero weights.
+int8_t *block_conv_weight(size_t CI, size_t CO, size_t K, const int8_t *weight) {
+    auto blocked = new int8_t[blocked_channels(CO) * CI * K * K]();
+    for (int co = 0; co < CO; co++) {
+        for (int ci = 0; ci < CI; ci++) {
+            for (int k = 0; k < K * K; k++) {
+                blocked[((co / CB * CI + ci) * K * K + k) * CB + co % CB] = weight[(co * CI + ci) * K * K + k];
+            }
+        }
+    }
+    return blocked;
+}
+
+// Fc weight [CI, CO] whose input is a [C, H, W] feature -> [blocked_channels(C) * H * W, blocked_channels(CO)],
+// with rows in blocked input order and zero rows / columns for padding channels.
+int8_t *block_fc_weight(size_t C, size_t H, size_t W, size_t CO, const int8_t *weight) {
+    size_t COB = blocked_channels(CO);
+    auto blocked = new int8_t[blocked_channels(C) * H * W * COB]();
+    for (int c = 0; c < C; c++) {
+        for (int h = 0; h < H; h++) {
+            for (int w = 0; w < W; w++) {
+                int ci = c * H * W + h * W + w;
+                int cib = ((c / CB * H + h) * W + w) * CB + c % CB;
+                for (int co = 0; co < CO; co++) {
+                    blocked[cib * COB + co] = weight[ci * CO + co];
+                }
+            }
+        }
+    }
+    return blocked;
+}
+
+// One output pixel block of cpu_conv_blocked and cpu_conv_blocked_3x3s2: the 3x3 window centered on input pixel
+// (h, w). BORDER = false drops the bounds checks and may only be used for interior pixels.
+template<bool BORDER>
+void cpu_conv_blocked_pixel(size_t CI, size_t H, size_t W, int cob, int h, int w,
+                            const int8_t *weight,
+                            const uint8_t *image,
+                            int32_t *out) {
+    int32_t acc[CB] = {0};
+    for (int ci = 0; ci < CI; ci++) {
+        const uint8_t *in = image + ci / CB * H * W * CB + ci % CB;
+        const int8_t *wp = weight + (cob * CI + ci) * 3 * 3 * CB;
+        for (int dh = -1; dh <= 1; dh++) {
+            for (int dw = -1; dw <= 1; dw++) {
+                int hh = h + dh, ww = w + dw;
+                if (BORDER && !(ww >= 0 && ww < W && hh >= 0 && hh < H)) continue;
+                int32_t x = in[(hh * W + ww) * CB];
+                const int8_t *k = wp + ((dh + 1) * 3 + (dw + 1)) * CB;
+                for (int l = 0; l < CB; l++) acc[l] += k[l] * x;
+            }
+        }
+    }
+    for (int l = 0; l < CB; l++) out[l] = acc[l];
+}
+
+// Blocked conv. The weight comes from block_conv_weight.
+// Input is [CI / CB, H, W, CB], output is [CO / CB, H, W, CB].
+void cpu_conv_blocked(size_t CI, size_t CO, size_t H, size_t W,
+                      const int8_t *weight,
+                      const uint8_t *image,
+                      int32_t *dst) {
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        for (int h = 0; h < H; h++) {
+            bool border_row = h == 0 || h == H - 1;
+            for (int w = 0; w < W; w++) {
+                int32_t *out = dst + ((cob * H + h) * W + w) * CB;
+                if (border_row || w == 0 || w == W - 1)
+                    cpu_conv_blocked_pixel<true>(CI, H, W, cob, h, w, weight, image, out);
+                else
+                    cpu_conv_blocked_pixel<false>(CI, H, W, cob, h, w, weight, image, out);
+            }
+        }
+    }
+}
+
+// Blocked 3x3 conv with stride 2 and padding 1. The weight comes from block_conv_weight.
+// Input is [CI / CB, H, W, CB], output is [CO / CB, HO, WO, CB].
+void cpu_conv_blocked_3x3s2(size_t CI, size_t CO, size_t H, size_t W, size_t HO, size_t WO,
+                            const int8_t *weight,
+                            const uint8_t *image,
+                            int32_t *dst) {
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        for (int ho = 0; ho < HO; ho++) {
+            // Output pixel (ho, wo) is centered on input pixel (2 ho, 2 wo).
+            int h = 2 * ho;
+            bool border_row = h == 0 || h + 1 >= H;
+            for (int wo = 0; wo < WO; wo++) {
+                int w = 2 * wo;
+                int32_t *out = dst + ((cob * HO + ho) * WO + wo) * CB;
+                if (border_row || w == 0 || w + 1 >= W)
+                    cpu_conv_blocked_pixel<true>(CI, H, W, cob, h, w, weight, image, out);
+                else
+                    cpu_conv_blocked_pixel<false>(CI, H, W, cob, h, w, weight, image, out);
+            }
+        }
+    }
+}
+
+// One output pixel block of cpu_conv_blocked_generic.
+// BORDER = false drops the bounds checks and may only be used where the whole window is inside the image.
+template<bool BORDER>
+void cpu_conv_blocked_generic_pixel(size_t CI, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                                    int cob, int ho, int wo,
+                                    const int8_t *weight,
+                                    const uint8_t *image,
+                                    int32_t *out) {
+    int32_t acc[CB] = {0};
+    int h0 = ho * int(S) - int(P), w0 = wo * int(S) - int(P);
+    for (int ci = 0; ci < CI; ci++) {
+        const uint8_t *in = image + ci / CB * H * W * CB + ci % CB;
+        const int8_t *wp = weight + (cob * CI + ci) * K * K * CB;
+        for (int kh = 0; kh < K; kh++) {
+            int hh = h0 + kh * int(D);
+            if (BORDER && (hh < 0 || hh >= H)) continue;
+            for (int kw = 0; kw < K; kw++) {
+                int ww = w0 + kw * int(D);
+                if (BORDER && (ww < 0 || ww >= W)) continue;
+                int32_t x = in[(hh * W + ww) * CB];
+                const int8_t *k = wp + (kh * K + kw) * CB;
+                for (int l = 0; l < CB; l++) acc[l] += k[l] * x;
+            }
+        }
+    }
+    for (int l = 0; l < CB; l++) out[l] = acc[l];
+}
+
+// Blocked conv with any square kernel size K, stride S, zero padding P and dilation D.
+// The weight comes from block_conv_weight. Input is [CI / CB, H, W, CB], output is [CO / CB, HO, WO, CB].
+void cpu_conv_blocked_generic(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                              size_t HO, size_t WO,
+                              const int8_t *weight,
+                              const uint8_t *image,
+                              int32_t *dst) {
+    int span = int((K - 1) * D); // Window extent minus one.
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        for (int ho = 0; ho < HO; ho++) {
+            int h0 = ho * int(S) - int(P);
+            bool inner_row = h0 >= 0 && h0 + span < H;
+            for (int wo = 0; wo < WO; wo++) {
+                int w0 = wo * int(S) - int(P);
+                int32_t *out = dst + ((cob * HO + ho) * WO + wo) * CB;
+                if (inner_row && w0 >= 0 && w0 + span < W)
+                    cpu_conv_blocked_generic_pixel<false>(CI, H, W, K, S, P, D, cob, ho, wo, weight, image, out);
+                else
+                    cpu_conv_blocked_generic_pixel<true>(CI, H, W, K, S, P, D, cob, ho, wo, weight, image, out);
+            }
+        }
+    }
+}
+
+// Blocked unpadded 1x1 conv with stride 1. Every output pixel block is a [CI] x [CI, CB] product.
+void cpu_conv_blocked_1x1(size_t CI, size_t CO, size_t H, size_t W,
+                          const int8_t *weight,
+                          const uint8_t *image,
+                          int32_t *dst) {
+    size_t HW = H * W;
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        for (int p = 0; p < HW; p++) {
+            int32_t acc[CB] = {0};
+            for (int ci = 0; ci < CI; ci++) {
+                int32_t x = image[(ci / CB * HW + p) * CB + ci % CB];
+                const int8_t *k = weight + (cob * CI + ci) * CB;
+                for (int l = 0; l < CB; l++) acc[l] += k[l] * x;
+            }
+            int32_t *out = dst + (cob * HW + p) * CB;
+            for (int l = 0; l < CB; l++) out[l] = acc[l];
+        }
+    }
+}
+
+// Blocked counterpart of cpu_conv_any: cpu_conv_blocked for 3x3 stride 1 padding 1, cpu_conv_blocked_3x3s2,
+// cpu_conv_blocked_1x1 for unpadded 1x1 stride 1, and cpu_conv_blocked_generic otherwise.
+void cpu_conv_blocked_any(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                          size_t HO, size_t WO,
+                          const int8_t *weight,
+                          const uint8_t *image,
+                          int32_t *dst) {
+    if (K == 3 && S == 1 && P == 1 && D == 1) cpu_conv_blocked(CI, CO, H, W, weight, image, dst);
+    else if (K == 3 && S == 2 && P == 1 && D == 1)
+        cpu_conv_blocked_3x3s2(CI, CO, H, W, HO, WO, weight, image, dst);
+    else if (K == 1 && S == 1 && P == 0) cpu_conv_blocked_1x1(CI, CO, H, W, weight, image, dst);
+    else cpu_conv_blocked_generic(CI, CO, H, W, K, S, P, D, HO, WO, weight, image, dst);
+}
+
+// Blocked conv with the block_conv_weight packed by pack_int4, a row per output channel block. Every block is
+// unpacked into a buffer that stays in L1 and runs as a single block cpu_conv_blocked_any, or
+// cpu_conv_blocked_generic if "generic".
+void cpu_conv_blocked_int4(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                           size_t HO, size_t WO, bool generic,
+                           const uint8_t *weight,
+                           const uint8_t *image,
+                           int32_t *dst) {
+    size_t n = CI * K * K * CB;
+    vector<int8_t> block(n);
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        unpack_int4(1, n, weight + cob * int4_row_bytes(n), block.data());
+        int32_t *out = dst + cob * HO * WO * CB;
+        if (generic) cpu_conv_blocked_generic(CI, CB, H, W, K, S, P, D, HO, WO, block.data(), image, out);
+        else cpu_conv_blocked_any(CI, CB, H, W, K, S, P, D, HO, WO, block.data(), image, out);
+    }
+}
+
+// Blocked cpu_conv_sparse, with the same per output channel tap lists. Channels of a block are CB values apart,
+// so every tap is a strided multiply-add. One output row of a block at a time, which stays in L1 while all the
+// taps of its CB channels are added. Padding output channels are zero.
+void cpu_conv_blocked_sparse(size_t CI, size_t CO, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D,
+                             size_t HO, size_t WO,
+                             const sparse_rows &weight,
+                             const uint8_t *image,
+                             int32_t *dst) {
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        for (int ho = 0; ho < HO; ho++) {
+            int32_t *out = dst + (cob * HO + ho) * WO * CB;
+            fill(out, out + WO * CB, 0);
+            for (int l = 0; l < CB && cob * CB + l < CO; l++) {
+                int co = cob * CB + l;
+                for (uint32_t i = weight.offset[co]; i < weight.offset[co + 1]; i++) {
+                    int tap = weight.index[i], ci = tap / int(K * K), kh = tap / int(K) % int(K), kw = tap % int(K);
+                    int h = ho * int(S) + kh * int(D) - int(P), dw = kw * int(D) - int(P);
+                    if (h < 0 || h >= H) continue;
+                    auto cols = conv_tap_range(dw, W, WO, S);
+                    int32_t k = weight.value[i];
+                    const uint8_t *in = image + (ci / CB * H + h) * W * CB + ci % CB;
+                    for (int wo = cols.first; wo < cols.second; wo++)
+                        out[wo * CB + l] += k * in[(wo * int(S) + dw) * CB];
+                }
+            }
+        }
+    }
+}
+
+// Depthwise weight [C, K, K] -> [C / CB, K, K, CB], padding channels with zero weights.
+int8_t *block_dwconv_weight(size_t C, size_t K, const int8_t *weight) {
+    auto blocked = new int8_t[blocked_channels(C) * K * K]();
+    for (int c = 0; c < C; c++) {
+        for (int k = 0; k < K * K; k++) blocked[(c / CB * K * K + k) * CB + c % CB] = weight[c * K * K + k];
+    }
+    return blocked;
+}
+
+// Write the CB accumulators of one blocked pixel, channels c0 .. c0 + CB - 1, to element "pos" of dst.
+// Bias and shift are padded to blocked_channels(C).
+void store_lanes(const conv_epilogue &epilogue, size_t c0, const int32_t *acc, void *dst, size_t pos) {
+    if (!epilogue.bias) copy(acc, acc + CB, (int32_t *) dst + pos);
+    else if (epilogue.relu)
+        cpu_quan_relu_lanes(CB, epilogue.bias + c0, epilogue.shift + c0, acc, (uint8_t *) dst + pos);
+    else {
+        auto out = (int8_t *) dst + pos;
+        for (int l = 0; l < CB; l++) out[l] = int8_t((acc[l] - epilogue.bias[c0 + l]) >> epilogue.shift[c0 + l]);
+    }
+}
+
+// One output pixel block of cpu_dwconv_blocked.
+// BORDER = false drops the bounds checks and may only be used where the whole window is inside the image.
+template<bool BORDER>
+void cpu_dwconv_blocked_pixel(size_t H, size_t W, size_t K, size_t S, size_t P, size_t D, int cb, int ho, int wo,
+                              const int8_t *weight,
+                              const uint8_t *image,
+                              int32_t *acc) {
+    for (int l = 0; l < CB; l++) acc[l] = 0;
+    int h0 = ho * int(S) - int(P), w0 = wo * int(S) - int(P);
+    const uint8_t *in = image + cb * H * W * CB;
+    const int8_t *wp = weight + cb * K * K * CB;
+    for (int kh = 0; kh < K; kh++) {
+        int hh = h0 + kh * int(D);
+        if (BORDER && (hh < 0 || hh >= H)) continue;
+        for (int kw = 0; kw < K; kw++) {
+            int ww = w0 + kw * int(D);
+            if (BORDER && (ww < 0 || ww >= W)) continue;
+            const uint8_t *x = in + (hh * W + ww) * CB;
+            const int8_t *k = wp + (kh * K + kw) * CB;
+            for (int l = 0; l < CB; l++) acc[l] += k[l] * x[l];
+        }
+    }
+}
+
+// Blocked depthwise conv, vectorized across the CB channels of a pixel: every tap is one lane-wise multiply-add
+// of CB inputs with CB weights. The weight comes from block_dwconv_weight.
+// Input is [C / CB, H, W, CB], output is [C / CB, HO, WO, CB].
+void cpu_dwconv_blocked(size_t C, size_t H, size_t W, size_t K, size_t S, size_t P, size_t D, size_t HO, size_t WO,
+                        const int8_t *weight,
+                        const uint8_t *image,
+                        const conv_epilogue &epilogue,
+                        void *dst) {
+    int span = int((K - 1) * D); // Window extent minus one.
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        for (int ho = 0; ho < HO; ho++) {
+            int h0 = ho * int(S) - int(P);
+            bool inner_row = h0 >= 0 && h0 + span < H;
+            for (int wo = 0; wo < WO; wo++) {
+                int w0 = wo * int(S) - int(P);
+                int32_t acc[CB];
+                if (inner_row && w0 >= 0 && w0 + span < W)
+                    cpu_dwconv_blocked_pixel<false>(H, W, K, S, P, D, cb, ho, wo, weight, image, acc);
+                else
+                    cpu_dwconv_blocked_pixel<true>(H, W, K, S, P, D, cb, ho, wo, weight, image, acc);
+                store_lanes(epilogue, cb * CB, acc, dst, ((cb * HO + ho) * WO + wo) * CB);
+            }
+        }
+    }
+}
+
+// Blocked pointwise conv. The weight comes from block_conv_weight with K = 1: [CO / CB, CI, CB].
+// Input is [CI / CB, HW, CB], output is [CO / CB, HW, CB]. The CB output channels of a pixel are the vector lanes,
+// and 4 pixels share every weight load.
+void cpu_pwconv_blocked(size_t CI, size_t CO, size_t HW,
+                        const int8_t *weight,
+                        const uint8_t *image,
+                        const conv_epilogue &epilogue,
+                        void *dst) {
+    const size_t TILE = 4;
+    for (int cob = 0; cob < blocked_channels(CO) / CB; cob++) {
+        for (size_t p0 = 0; p0 < HW; p0 += TILE) {
+            size_t n = min(TILE, HW - p0);
+            int32_t acc[TILE][CB] = {{0}};
+            for (int ci = 0; ci < CI; ci++) {
+                const int8_t *k = weight + (cob * CI + ci) * CB;
+                const uint8_t *x = image + (ci / CB * HW + p0) * CB + ci % CB;
+                if (n == TILE) {
+                    int32_t x0 = x[0], x1 = x[CB], x2 = x[2 * CB], x3 = x[3 * CB];
+                    for (int l = 0; l < CB; l++) {
+                        acc[0][l] += k[l] * x0;
+                        acc[1][l] += k[l] * x1;
+                        acc[2][l] += k[l] * x2;
+                        acc[3][l] += k[l] * x3;
+                    }
+                } else {
+                    for (size_t j = 0; j < n; j++)
+                        for (int l = 0; l < CB; l++) acc[j][l] += k[l] * x[j * CB];
+                }
+            }
+            for (size_t j = 0; j < n; j++) store_lanes(epilogue, cob * CB, acc[j], dst, (cob * HW + p0 + j) * CB);
+        }
+    }
+}
+
+// Blocked quan. Bias and shift are padded to blocked_channels(C) with zeros.
+void cpu_quan_blocked(size_t C, size_t H, size_t W,
+                      const int32_t *bias,
+                      const uint8_t *shift,
+                      const int32_t *feature,
+                      int8_t *dst) {
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        for (int pos = cb * H * W * CB; pos < (cb + 1) * H * W * CB; pos += CB) {
+            for (int l = 0; l < CB; l++) {
+                int32_t res = (feature[pos + l] - bias[cb * CB + l]) >> shift[cb * CB + l];
+                dst[pos + l] = res;
+            }
+        }
+    }
+}
+
+// Blocked pool, same window as cpu_pool. Every window element is one vector over the CB channels of a block.
+void cpu_pool_blocked(size_t C, size_t H, size_t W, size_t HO, size_t WO, size_t K, size_t S, bool average,
+                      const uint8_t *feature,
+                      uint8_t *dst) {
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        for (int ho = 0; ho < HO; ho++) {
+            for (int wo = 0; wo < WO; wo++) {
+                const uint8_t *window = feature + ((cb * H + ho * S) * W + wo * S) * CB;
+                uint8_t *out = dst + ((cb * HO + ho) * WO + wo) * CB;
+                if (average) {
+                    uint32_t sum[CB] = {0};
+                    for (int dh = 0; dh < K; dh++) {
+                        for (int dw = 0; dw < K; dw++) {
+                            const uint8_t *in = window + (dh * W + dw) * CB;
+                            for (int l = 0; l < CB; l++) sum[l] += in[l];
+                        }
+                    }
+                    for (int l = 0; l < CB; l++) out[l] = pool_average(sum[l], K * K);
+                } else {
+                    uint8_t result[CB] = {0};
+                    for (int dh = 0; dh < K; dh++) {
+                        for (int dw = 0; dw < K; dw++) {
+                            const uint8_t *in = window + (dh * W + dw) * CB;
+                            for (int l = 0; l < CB; l++) result[l] = max(result[l], in[l]);
+                        }
+                    }
+                    for (int l = 0; l < CB; l++) out[l] = result[l];
+                }
+            }
+        }
+    }
+}
+
+// Blocked cpu_gap. The [C] output is the same in both layouts, padded to blocked_channels(C).
+void cpu_gap_blocked(size_t C, size_t H, size_t W,
+                     const uint8_t *feature,
+                     uint8_t *dst) {
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        uint32_t sum[CB] = {0};
+        for (int p = 0; p < H * W; p++) {
+            const uint8_t *in = feature + (cb * H * W + p) * CB;
+            for (int l = 0; l < CB; l++) sum[l] += in[l];
+        }
+        for (int l = 0; l < CB; l++) dst[cb * CB + l] = pool_average(sum[l], H * W);
+    }
+}
+
+// Blocked quan_relu. Bias and shift are padded to blocked_channels(C) with zeros.
+void cpu_quan_relu_blocked(size_t C, size_t H, size_t W,
+                           const int32_t *bias,
+                           const uint8_t *shift,
+                           const int32_t *feature,
+                           uint8_t *dst) {
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        for (int pos = cb * H * W * CB; pos < (cb + 1) * H * W * CB; pos += CB) {
+            cpu_quan_relu_lanes(CB, bias + cb * CB, shift + cb * CB, feature + pos, dst + pos);
+        }
+    }
+}
+
+// Blocked cpu_pool_int32.
+void cpu_pool_int32_blocked(size_t C, size_t H, size_t W, size_t HO, size_t WO, size_t K, size_t S,
+                            const int32_t *feature,
+                            int32_t *dst) {
+    for (int cb = 0; cb < blocked_channels(C) / CB; cb++) {
+        for (int ho = 0; ho < HO; ho++) {
+            for (int wo = 0; wo < WO; wo++) {
+                const int32_t *window = feature + ((cb * H + ho * S) * W + wo * S) * CB;
+                int32_t result[CB];
+                for (int l = 0; l < CB; l++) result[l] = INT32_MIN;
+                for (int dh = 0; dh < K; dh++) {
+                    for (int dw = 0; dw < K; dw++) {
+                        const int32_t *in = window + (dh * W + dw) * CB;
+                        for (int l = 0; l < CB; l++) result[l] = max(result[l], in[l]);
+                    }
+                }
+                int32_t *out = dst + ((cb * HO + ho) * WO + wo) * CB;
+                for (int l = 0; l < CB; l++) out[l] = result[l];
+            }
+        }
+    }
+}
+
+// Raw image rows -> [1, H, W] uint8 feature: pick one byte of every pixel and flip bottom-up images.
+// Source rows are row_stride bytes apart with pixel_bytes bytes per pixel, as stored in a BMP file.
+// Output pixel (h, w) goes to dst[(h * W + w) * dst_step], so dst_step = CB writes the blocked layout directly.
+void cpu_preprocess(size_t H, size_t W, size_t pixel_bytes, size_t row_stride, size_t channel, bool bottom_up,
+                    const uint8_t *raw,
+                    uint8_t *dst, size_t dst_step) {
+    for (int h = 0; h < H; h++) {
+        const uint8_t *row = raw + (bottom_up ? H - 1 - h : h) * row_stride + channel;
+        uint8_t *out = dst + h * W * dst_step;
+        for (int w = 0; w < W; w++) out[w * dst_step] = row[w * pixel_bytes];
+    }
+}
+
 #endif //OPENCL_CNN_CONV_FUNC_CPP
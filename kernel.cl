@@ -1,4 +1,18 @@
 
+__kernel void preprocess(
+    ulong H, ulong W, ulong pixel_bytes, ulong row_stride, ulong channel, int bottom_up,
+    __global const unsigned char *raw,
+    __global unsigned char *dst){
+    // Raw image rows, row_stride bytes apart with pixel_bytes bytes per pixel, as stored in a BMP file.
+    // One byte of every pixel is picked and bottom-up images are flipped.
+    // The output shape is [1, H, W]
+    int h=get_global_id(0);
+    int w=get_global_id(1);
+
+    int row=bottom_up ? H-1-h : h;
+    dst[h*W+w]=raw[row*row_stride+w*pixel_bytes+channel];
+}
+
 __kernel void conv(
     ulong CI, ulong CO, ulong H, ulong W,  // size
     __global const signed char *weight,
@@ -12,13 +26,25 @@ __kernel void conv(
     int co=get_global_id(2);
 
     int acc=0;
-    for(int dw=-1;dw<=1;dw++){
-        for(int dh=-1;dh<=1;dh++){
-            int hh=h+dh, ww=w+dw;
-            int hhh=dh+1, www=dw+1;
-            if(ww>=0 && ww<W && hh>=0 && hh<H){
-                for(int ci=0;ci<CI;ci++){
-                    acc+=weight[co*CI*3*3+ci*3*3+hhh*3+www]*image[ci*H*W+hh*W+ww];
+    if(h>0 && h<H-1 && w>0 && w<W-1){
+        // Interior pixel: all 9 taps are inside the image, no bounds checks.
+        for(int ci=0;ci<CI;ci++){
+            __global const signed char *k=weight+(co*CI+ci)*3*3;
+            __global const unsigned char *p=image+ci*H*W+(h-1)*W+w-1;
+            acc+=k[0]*p[0]    +k[1]*p[1]      +k[2]*p[2]
+                +k[3]*p[W]    +k[4]*p[W+1]    +k[5]*p[W+2]
+                +k[6]*p[2*W]  +k[7]*p[2*W+1]  +k[8]*p[2*W+2];
+        }
+    }else{
+        // One-pixel border: skip the taps that fall into padding.
+        for(int dw=-1;dw<=1;dw++){
+            for(int dh=-1;dh<=1;dh++){
+                int hh=h+dh, ww=w+dw;
+                int hhh=dh+1, www=dw+1;
+                if(ww>=0 && ww<W && hh>=0 && hh<H){
+                    for(int ci=0;ci<CI;ci++){
+                        acc+=weight[co*CI*3*3+ci*3*3+hhh*3+www]*image[ci*H*W+hh*W+ww];
+                    }
                 }
             }
         }
@@ -26,6 +52,349 @@ __kernel void conv(
     dst[co*H*W+h*W+w]=acc;
 }
 
+__kernel void conv_1x1(
+    ulong CI, ulong CO, ulong H, ulong W,  // size
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global int *dst){
+    // Unpadded 1x1 conv with stride 1: the product of the [CO, CI] weight and the [CI, H * W] image.
+    // The input shape is [CI, H, W]
+    // The weight shape is [CO, CI, 1, 1]
+    // The output shape is [CO, H, W]
+    int h=get_global_id(0);
+    int w=get_global_id(1);
+    int co=get_global_id(2);
+
+    int p=h*W+w;
+    int acc=0;
+    for(int ci=0;ci<CI;ci++){
+        acc+=weight[co*CI+ci]*image[ci*H*W+p];
+    }
+    dst[co*H*W+p]=acc;
+}
+
+__kernel void conv_3x3s2(
+    ulong CI, ulong CO, ulong H, ulong W,  // size
+    ulong HO, ulong WO,  // output size
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global int *dst){
+    // 3x3 conv with stride 2 and padding 1: conv on every other input pixel.
+    // The input shape is [CI, H, W]
+    // The weight shape is [CO, CI, 3, 3]
+    // The output shape is [CO, HO, WO]
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int co=get_global_id(2);
+
+    // Center of the window.
+    int h=2*ho, w=2*wo;
+    int acc=0;
+    if(h>0 && h<H-1 && w>0 && w<W-1){
+        // Interior pixel: all 9 taps are inside the image, no bounds checks.
+        for(int ci=0;ci<CI;ci++){
+            __global const signed char *k=weight+(co*CI+ci)*3*3;
+            __global const unsigned char *p=image+ci*H*W+(h-1)*W+w-1;
+            acc+=k[0]*p[0]    +k[1]*p[1]      +k[2]*p[2]
+                +k[3]*p[W]    +k[4]*p[W+1]    +k[5]*p[W+2]
+                +k[6]*p[2*W]  +k[7]*p[2*W+1]  +k[8]*p[2*W+2];
+        }
+    }else{
+        // Top row, left column and the bottom / right edge of even sized inputs: skip the taps in padding.
+        for(int dh=-1;dh<=1;dh++){
+            for(int dw=-1;dw<=1;dw++){
+                int hh=h+dh, ww=w+dw;
+                if(ww>=0 && ww<W && hh>=0 && hh<H){
+                    for(int ci=0;ci<CI;ci++){
+                        acc+=weight[(co*CI+ci)*3*3+(dh+1)*3+dw+1]*image[ci*H*W+hh*W+ww];
+                    }
+                }
+            }
+        }
+    }
+    dst[(co*HO+ho)*WO+wo]=acc;
+}
+
+__kernel void conv_generic(
+    ulong CI, ulong CO, ulong H, ulong W,  // size
+    ulong K, ulong S, ulong P, ulong D,  // kernel size, stride, zero padding, dilation
+    ulong HO, ulong WO,  // output size
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global int *dst){
+    // The input shape is [CI, H, W]
+    // The weight shape is [CO, CI, K, K]
+    // The output shape is [CO, HO, WO]
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int co=get_global_id(2);
+
+    int k=K, d=D, h=H, w=W;
+    int h0=ho*(int)S-(int)P, w0=wo*(int)S-(int)P;
+    int span=(k-1)*d;
+    int acc=0;
+    if(h0>=0 && h0+span<h && w0>=0 && w0+span<w){
+        // Interior pixel: the whole window is inside the image, no bounds checks.
+        for(int ci=0;ci<CI;ci++){
+            for(int kh=0;kh<k;kh++){
+                __global const signed char *kp=weight+((co*CI+ci)*k+kh)*k;
+                __global const unsigned char *p=image+(ci*h+h0+kh*d)*w+w0;
+                for(int kw=0;kw<k;kw++) acc+=kp[kw]*p[kw*d];
+            }
+        }
+    }else{
+        // Skip the taps that fall into padding.
+        for(int ci=0;ci<CI;ci++){
+            for(int kh=0;kh<k;kh++){
+                int hh=h0+kh*d;
+                if(hh<0 || hh>=h) continue;
+                for(int kw=0;kw<k;kw++){
+                    int ww=w0+kw*d;
+                    if(ww>=0 && ww<w) acc+=weight[((co*CI+ci)*k+kh)*k+kw]*image[(ci*h+hh)*w+ww];
+                }
+            }
+        }
+    }
+    dst[(co*HO+ho)*WO+wo]=acc;
+}
+
+int dwconv_acc(
+    ulong H, ulong W, ulong K, ulong S, ulong P, ulong D,
+    int c, int ho, int wo,
+    __global const signed char *weight,
+    __global const unsigned char* image){
+    // Depthwise conv output (c, ho, wo): channel c of the image with its own K x K filter.
+    // The input shape is [C, H, W]
+    // The weight shape is [C, K, K]
+    int k=K, d=D, h=H, w=W;
+    int h0=ho*(int)S-(int)P, w0=wo*(int)S-(int)P;
+    int span=(k-1)*d;
+    __global const signed char *kp=weight+c*k*k;
+    __global const unsigned char *plane=image+c*h*w;
+    int acc=0;
+    if(h0>=0 && h0+span<h && w0>=0 && w0+span<w){
+        // Interior pixel: the whole window is inside the image, no bounds checks.
+        for(int kh=0;kh<k;kh++){
+            __global const unsigned char *p=plane+(h0+kh*d)*w+w0;
+            for(int kw=0;kw<k;kw++) acc+=kp[kh*k+kw]*p[kw*d];
+        }
+    }else{
+        for(int kh=0;kh<k;kh++){
+            int hh=h0+kh*d;
+            if(hh<0 || hh>=h) continue;
+            for(int kw=0;kw<k;kw++){
+                int ww=w0+kw*d;
+                if(ww>=0 && ww<w) acc+=kp[kh*k+kw]*plane[hh*w+ww];
+            }
+        }
+    }
+    return acc;
+}
+
+__kernel void dwconv(
+    ulong C, ulong H, ulong W,  // size
+    ulong K, ulong S, ulong P, ulong D,  // kernel size, stride, zero padding, dilation
+    ulong HO, ulong WO,  // output size
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global int *dst){
+    // The output shape is [C, HO, WO]
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int c=get_global_id(2);
+
+    dst[(c*HO+ho)*WO+wo]=dwconv_acc(H, W, K, S, P, D, c, ho, wo, weight, image);
+}
+
+__kernel void dwconv_quan(
+    ulong C, ulong H, ulong W,  // size
+    ulong K, ulong S, ulong P, ulong D,  // kernel size, stride, zero padding, dilation
+    ulong HO, ulong WO,  // output size
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global const int *bias,
+    __global const unsigned char *shift,
+    int relu,
+    __global signed char *dst){
+    // dwconv followed by quan, and relu if "relu", in one pass. The int32 output is never stored.
+    // The output shape is [C, HO, WO]
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int c=get_global_id(2);
+
+    char res=(dwconv_acc(H, W, K, S, P, D, c, ho, wo, weight, image)-bias[c])>>shift[c];
+    dst[(c*HO+ho)*WO+wo]=relu ? max((char)0, res) : res;
+}
+
+void pwconv_acc(
+    ulong CI, ulong CO, ulong HW,
+    int co0, int p,
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    int *acc){
+    // Pointwise conv outputs co0 .. co0 + 3 of pixel p, so every input value is loaded once for 4 multiply-adds.
+    // The input shape is [CI, HW]
+    // The weight shape is [CO, CI]
+    // Rows past CO repeat the last one and are not stored by the callers.
+    int last=CO-1;
+    __global const signed char *w0=weight+min(co0, last)*CI;
+    __global const signed char *w1=weight+min(co0+1, last)*CI;
+    __global const signed char *w2=weight+min(co0+2, last)*CI;
+    __global const signed char *w3=weight+min(co0+3, last)*CI;
+    int a0=0, a1=0, a2=0, a3=0;
+    for(int ci=0;ci<CI;ci++){
+        int x=image[ci*HW+p];
+        a0+=w0[ci]*x;
+        a1+=w1[ci]*x;
+        a2+=w2[ci]*x;
+        a3+=w3[ci]*x;
+    }
+    acc[0]=a0; acc[1]=a1; acc[2]=a2; acc[3]=a3;
+}
+
+__kernel void pwconv(
+    ulong CI, ulong CO, ulong HW,
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global int *dst){
+    // Pointwise (1x1) conv as a GEMM of the [CO, CI] weight and the [CI, HW] image.
+    // Every work item computes a tile of 4 output channels of one pixel.
+    // The output shape is [CO, HW]
+    int p=get_global_id(0);
+    int co0=get_global_id(1)*4;
+
+    int acc[4];
+    pwconv_acc(CI, CO, HW, co0, p, weight, image, acc);
+    for(int j=0;j<4 && co0+j<CO;j++) dst[(co0+j)*HW+p]=acc[j];
+}
+
+__kernel void pwconv_quan(
+    ulong CI, ulong CO, ulong HW,
+    __global const signed char *weight,
+    __global const unsigned char* image,
+    __global const int *bias,
+    __global const unsigned char *shift,
+    int relu,
+    __global signed char *dst){
+    // pwconv followed by quan, and relu if "relu", in one pass. The int32 output is never stored.
+    // The output shape is [CO, HW]
+    int p=get_global_id(0);
+    int co0=get_global_id(1)*4;
+
+    int acc[4];
+    pwconv_acc(CI, CO, HW, co0, p, weight, image, acc);
+    for(int j=0;j<4 && co0+j<CO;j++){
+        int co=co0+j;
+        char res=(acc[j]-bias[co])>>shift[co];
+        dst[co*HW+p]=relu ? max((char)0, res) : res;
+    }
+}
+
+__kernel void conv_sparse(
+    ulong CI, ulong CO, ulong H, ulong W,  // size
+    ulong K, ulong S, ulong P, ulong D,  // kernel size, stride, zero padding, dilation
+    ulong HO, ulong WO,  // output size
+    __global const uint *offset,
+    __global const ushort *index,
+    __global const signed char *value,
+    __global const unsigned char* image,
+    __global int *dst){
+    // conv_generic over the nonzero taps only. The nonzero weights of output channel co are
+    // value[offset[co]] to value[offset[co+1]], at tap index (ci*K+kh)*K+kw.
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int co=get_global_id(2);
+
+    int k=K, d=D, h=H, w=W;
+    int h0=ho*(int)S-(int)P, w0=wo*(int)S-(int)P;
+    int acc=0;
+    for(uint i=offset[co];i<offset[co+1];i++){
+        int tap=index[i];
+        int hh=h0+tap/k%k*d, ww=w0+tap%k*d;
+        if(hh>=0 && hh<h && ww>=0 && ww<w) acc+=value[i]*image[(tap/(k*k)*h+hh)*w+ww];
+    }
+    dst[(co*HO+ho)*WO+wo]=acc;
+}
+
+__kernel void fc_sparse(
+    ulong CI, ulong CO,
+    __global const uint *offset,
+    __global const ushort *index,
+    __global const signed char *value,
+    __global const unsigned char *feature,
+    __global int *dst){
+    // The nonzero weights of output co are value[offset[co]] to value[offset[co+1]], at input index[...].
+    int co=get_global_id(0);
+    int acc=0;
+    for(uint i=offset[co];i<offset[co+1];i++){
+        acc+=value[i]*feature[index[i]];
+    }
+    dst[co]=acc;
+}
+
+int int4_value(__global const unsigned char *row, int i){
+    // Value i of a row packed by pack_int4: even values are in the low nibble, odd ones in the high nibble.
+    return (char)(row[i/2]<<(i%2 ? 0 : 4))>>4;
+}
+
+__kernel void conv_int4(
+    ulong CI, ulong CO, ulong H, ulong W,  // size
+    ulong K, ulong S, ulong P, ulong D,  // kernel size, stride, zero padding, dilation
+    ulong HO, ulong WO,  // output size
+    __global const unsigned char *weight,
+    __global const unsigned char* image,
+    __global int *dst){
+    // conv_generic on int4 weights, two per byte with a row of (CI*K*K+1)/2 bytes per output channel.
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int co=get_global_id(2);
+
+    int k=K, d=D, h=H, w=W;
+    int h0=ho*(int)S-(int)P, w0=wo*(int)S-(int)P;
+    int span=(k-1)*d;
+    __global const unsigned char *row=weight+co*((CI*K*K+1)/2);
+    int acc=0;
+    if(h0>=0 && h0+span<h && w0>=0 && w0+span<w){
+        // Interior pixel: the whole window is inside the image, no bounds checks.
+        for(int ci=0;ci<CI;ci++){
+            for(int kh=0;kh<k;kh++){
+                int tap=(ci*k+kh)*k;
+                __global const unsigned char *p=image+(ci*h+h0+kh*d)*w+w0;
+                for(int kw=0;kw<k;kw++) acc+=int4_value(row, tap+kw)*p[kw*d];
+            }
+        }
+    }else{
+        // Skip the taps that fall into padding.
+        for(int ci=0;ci<CI;ci++){
+            for(int kh=0;kh<k;kh++){
+                int hh=h0+kh*d;
+                if(hh<0 || hh>=h) continue;
+                for(int kw=0;kw<k;kw++){
+                    int ww=w0+kw*d;
+                    if(ww>=0 && ww<w) acc+=int4_value(row, (ci*k+kh)*k+kw)*image[(ci*h+hh)*w+ww];
+                }
+            }
+        }
+    }
+    dst[(co*HO+ho)*WO+wo]=acc;
+}
+
+__kernel void fc_int4(
+    ulong CI, ulong CO,
+    __global const unsigned char *weight,
+    __global const unsigned char *feature,
+    __global int *dst){
+    // fc on int4 weights, two per byte with a row of (CO+1)/2 bytes per input.
+    // Neighbouring work items read the two halves of the same byte.
+    int co=get_global_id(0);
+    ulong row=(CO+1)/2;
+    int acc=0;
+    for(int ci=0;ci<CI;ci++){
+        acc+=feature[ci]*int4_value(weight+ci*row, co);
+    }
+    dst[co]=acc;
+}
+
 __kernel void fc(
     ulong CI, ulong CO,
     __global const signed char *weight,
@@ -60,27 +429,86 @@ __kernel void quan(
     dst[pos]=(feature[pos]-bias[c])>>shift[c];
 }
 
+__kernel void quan_relu(
+    ulong C, ulong H, ulong W, //if fc, H=W=1
+    __global const int *bias,
+    __global const unsigned char *shift,
+    __global const int *feature,
+    __global unsigned char* dst){
+    // quan followed by relu in one pass.
+    // The input shape is [C, H, W]
+    // The output shape is [C, H, W]
+    int h=get_global_id(0);
+    int w=get_global_id(1);
+    int c=get_global_id(2);
+
+    int pos=c*H*W+h*W+w;
+    char res=(feature[pos]-bias[c])>>shift[c];
+    dst[pos]=max((char)0, res);
+}
+
 __kernel void pool(
-    ulong C, ulong H, ulong W, ulong HO, ulong WO,
+    ulong C, ulong H, ulong W, ulong HO, ulong WO, ulong K, ulong S, int average,
     __global const unsigned char* feature,
     __global unsigned char* dst){
-    
+    // K x K window with stride S, no padding. Average rounds half up, as cpu_pool.
     int ho=get_global_id(0);
     int wo=get_global_id(1);
     int c=get_global_id(2);
 
-    unsigned char result=0;
+    __global const unsigned char* in=feature+(c*H+ho*S)*W+wo*S;
+    uint result=0;
 
-    for(int dh=0;dh<=1;dh++){
-        for(int dw=0;dw<=1;dw++){
-            int h=ho*2+dh, w=wo*2+dw;
-            if(h>=0&&h<H&&w>0&&w<W)
-                result=max(result, feature[c*H*W+h*W+w]);
+    for(int dh=0;dh<K;dh++){
+        for(int dw=0;dw<K;dw++){
+            uint v=in[dh*W+dw];
+            result=average?result+v:max(result, v);
         }
     }
+    uint n=K*K;
+    dst[c*HO*WO+ho*WO+wo]=average?(result+n/2)/n:result;
+}
+
+__kernel void pool_int32(
+    ulong C, ulong H, ulong W, ulong HO, ulong WO, ulong K, ulong S,
+    __global const int* feature,
+    __global int* dst){
+    // Max pool on the conv output, before quan. Same window as pool.
+    int ho=get_global_id(0);
+    int wo=get_global_id(1);
+    int c=get_global_id(2);
+
+    __global const int* in=feature+(c*H+ho*S)*W+wo*S;
+    int result=INT_MIN;
+
+    for(int dh=0;dh<K;dh++){
+        for(int dw=0;dw<K;dw++)
+            result=max(result, in[dh*W+dw]);
+    }
     dst[c*HO*WO+ho*WO+wo]=result;
 }
 
+__kernel void gap(
+    ulong C, ulong H, ulong W,
+    __global const unsigned char* feature,
+    __global unsigned char* dst){
+    // Global average pool, one channel per work item. Four partial sums keep the loads independent.
+    int c=get_global_id(0);
+
+    __global const unsigned char* in=feature+c*H*W;
+    uint n=H*W, sum0=0, sum1=0, sum2=0, sum3=0;
+    int p=0;
+    for(;p+4<=n;p+=4){
+        sum0+=in[p];
+        sum1+=in[p+1];
+        sum2+=in[p+2];
+        sum3+=in[p+3];
+    }
+    for(;p<n;p++) sum0+=in[p];
+    uint sum=sum0+sum1+sum2+sum3;
+    dst[c]=(sum+n/2)/n;
+}
+
 __kernel void relu(
     ulong C, ulong H, ulong W,
     __global signed char* feature,
@@ -1,6 +1,6 @@
 #include "cnn.cpp"
 #include "timer.cpp"
-#include "util.cpp"
+#include "stream.cpp"
 
 using namespace std;
 
@@ -8,29 +8,66 @@ const char IMAGE_DIR[] = "../test_images/";
 const char IMAGE_LIST_FILE[] = "../image_list.txt";
 const char KERNEL_FILE[] = "../kernel.cl";
 const char MODEL_FILE[] = "../model.txt";
-const int N_IMAGES = 10000;
+const char DATASET_FILE[] = "../mnist.bin"; // Written by pack_dataset
 const int N_TESTS = 10000;
-uint8_t images[N_IMAGES][1 * 28 * 28];
-int labels[N_IMAGES];
+const size_t BATCH_SIZE = 64;
+// Without a packed dataset, upload the undecoded BMP pixels and let a preprocess layer
+// flip them and pick the channel on the device.
+const bool RAW_INPUT = true;
+// Count cycles, cache misses etc. of every cpu layer (Linux only). Adds two syscalls per layer.
+const bool HARDWARE_COUNTERS = false;
 
 
 int main() {
-    load_mnist(N_IMAGES, IMAGE_LIST_FILE, IMAGE_DIR, images, labels);
+    // Read the packed dataset if there is one, otherwise decode the BMPs.
+    // Either way the images are loaded in the background while earlier batches are being classified.
+    packed_dataset dataset;
+    image_loader loader;
+    size_t image_size = 1 * 28 * 28;
+    raw_image_format raw{};
+    bool raw_input = false;
+    if (dataset.open(DATASET_FILE) && dataset.N >= N_TESTS && dataset.C * dataset.H * dataset.W == 1 * 28 * 28) {
+        loader = packed_loader(dataset);
+    } else {
+        // Take the raw format from the first image.
+        vector<uint8_t> probe(28 * 28 * 4);
+        raw_input = RAW_INPUT && load_bmp_pixels(IMAGE_DIR + read_image_list(IMAGE_LIST_FILE, 1)[0], probe.data(),
+                                                 probe.size(), raw.W, raw.H, raw.pixel_bytes, raw.row_stride,
+                                                 raw.bottom_up);
+        if (raw_input) {
+            image_size = raw.size();
+            loader = bmp_raw_loader(IMAGE_LIST_FILE, IMAGE_DIR, N_TESTS, image_size);
+        } else {
+            loader = bmp_list_loader(IMAGE_LIST_FILE, IMAGE_DIR, N_TESTS);
+        }
+    }
+    dataset_stream stream(loader, N_TESTS, image_size, BATCH_SIZE);
+
     cnn cnn_instance(1, 28, 28, 10,
                      KERNEL_FILE, MODEL_FILE);
+    cnn_instance.optimize();
+    if (raw_input) cnn_instance.set_raw_input(raw);
+    cnn_instance.set_cpu_layout(BLOCKED);
+    if (HARDWARE_COUNTERS) set_perf_counters(true);
 
-    int correct = 0;
-    for (int i = 0; i < N_TESTS; i++)if (cnn_instance.opencl_forward(images[i]) == labels[i])++correct;
+    int opencl_correct = 0, cpu_correct = 0;
+    while (auto batch = stream.next()) {
+        for (size_t i = 0; i < batch->count; i++) {
+            if (cnn_instance.opencl_forward(batch->image(i)) == batch->labels[i])++opencl_correct;
+            if (cnn_instance.cpu_forward(batch->image(i)) == batch->labels[i])++cpu_correct;
+        }
+    }
 
-    cout << "OPENCL CORRECT: " << correct << '/' << N_TESTS << endl;
-    cnn_instance.report_opencl_time();
+    cnn_instance.report_model_summary();
 
-    correct = 0;
-    for (int i = 0; i < N_TESTS; i++)if (cnn_instance.cpu_forward(images[i]) == labels[i])++correct;
+    cout << "OPENCL CORRECT: " << opencl_correct << '/' << N_TESTS << endl;
+    cnn_instance.report_opencl_time();
+    cnn_instance.report_opencl_roofline();
 
-    cout << "CPU CORRECT: " << correct << '/' << N_TESTS << endl;
+    cout << "CPU CORRECT: " << cpu_correct << '/' << N_TESTS << endl;
 
     cnn_instance.report_cpu_time();
+    cnn_instance.report_cpu_roofline();
 
     return 0;
 }
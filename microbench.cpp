@@ -0,0 +1,508 @@
+// Microbenchmarks of every cpu_* function in func.cpp and every kernel in kernel.cl,
+// over a sweep of shapes well beyond the MNIST model. One line per kernel, variant and shape:
+// time per call, achieved GOPS (a multiply-add counts as 2 ops) and effective bandwidth
+// (every input, parameter and output byte touched once).
+// OpenCL kernels are timed with profiling events, so only device time is counted.
+//
+// Usage: cnn_microbench [--kernel FILE] [--filter NAME] [--min-time SECONDS]
+
+#include "cnn.cpp"
+
+using namespace std;
+
+struct microbench_options {
+    string kernel = "../kernel.cl";
+    string filter; // Only run cases whose name contains this.
+    double min_time = 0.1; // Seconds per case.
+};
+
+microbench_options options;
+mt19937 rng(2021);
+
+// Random array in [lo, hi]. Allocated with new[] because the layers take ownership of their parameters.
+template<class T>
+T *random_array(size_t n, int lo, int hi) {
+    uniform_int_distribution<int> dist(lo, hi);
+    auto ptr = new T[n];
+    for (size_t i = 0; i < n; i++) ptr[i] = dist(rng);
+    return ptr;
+}
+
+// random_array of weights in [-128, 127], of which about 1 - density are pruned to zero.
+int8_t *random_sparse_weight(size_t n, double density) {
+    auto weight = random_array<int8_t>(n, -128, 127);
+    uniform_real_distribution<double> keep(0, 1);
+    for (size_t i = 0; i < n; i++)
+        if (keep(rng) >= density) weight[i] = 0;
+    return weight;
+}
+
+void report(const string &name, const string &variant, const string &shape, double seconds, double ops, double bytes) {
+    cout << left << setw(12) << name << setw(10) << variant << setw(26) << shape << right << fixed << setprecision(0)
+         << setw(14) << seconds * 1e9 << " ns/op" << setprecision(2)
+         << setw(10) << ops / seconds / 1e9 << " GOPS"
+         << setw(10) << bytes / seconds / 1e9 << " GB/s" << endl;
+    cout.unsetf(ios::floatfield);
+}
+
+// Seconds per call of f, doubling the number of calls until they take min_time.
+double time_cpu(const function<void()> &f) {
+    f(); // Warm up caches and page in the buffers.
+    for (size_t calls = 1;; calls *= 2) {
+        auto op = steady_clock::now();
+        for (size_t i = 0; i < calls; i++) f();
+        double t = duration<double>(steady_clock::now() - op).count();
+        if (t >= options.min_time) return t / calls;
+    }
+}
+
+// Device seconds per call of the layer's kernel.
+double time_opencl(layer *l, cl_mem input) {
+    l->opencl_forward(input);
+    l->opencl_time.reset();
+    size_t calls = 0;
+    auto op = steady_clock::now();
+    while (duration<double>(steady_clock::now() - op).count() < options.min_time) {
+        l->opencl_forward(input);
+        ++calls;
+    }
+    clFinish(l->command_queue);
+    return l->opencl_time.seconds() / calls;
+}
+
+class microbench {
+    cl_platform_id platform = nullptr;
+    cl_device_id device = nullptr;
+    cl_context context = nullptr;
+    cl_command_queue queue = nullptr;
+    cl_program program = nullptr;
+
+public:
+    explicit microbench(const string &kernel_file) {
+        ret = clGetPlatformIDs(1, &platform, nullptr);
+        check
+        ret = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, nullptr);
+        check
+        context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &ret);
+        check
+        queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &ret);
+        check
+        string src = cnn::read_file(kernel_file);
+        program = clCreateProgramWithSource(context, 1, (const char **) &src, nullptr, &ret);
+        check
+        ret = clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr);
+        check
+    }
+
+    ~microbench() {
+        clReleaseProgram(program);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+    }
+
+    // Device copy of a host array.
+    cl_mem device_copy(const void *src, size_t bytes) {
+        cl_mem mem = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes, (void *) src, &ret);
+        check
+        return mem;
+    }
+
+    // Time the layer's kernel on a copy of input, then free both.
+    void run_opencl(const string &name, const string &shape, layer *l, const void *input, size_t input_bytes,
+                    double ops, double bytes) {
+        cl_mem mem = device_copy(input, input_bytes);
+        report(name, "opencl", shape, time_opencl(l, mem), ops, bytes);
+        clReleaseMemObject(mem);
+        delete l;
+    }
+
+    // K x K conv with stride S and "same" padding. "planar" and "blocked" take the fast path for the geometry
+    // if there is one, "generic" is cpu_conv_generic.
+    void conv(size_t CI, size_t CO, size_t H, size_t W, size_t K = 3, size_t S = 1) {
+        size_t P = (K - 1) / 2, HO = conv_output_size(H, K, S, P, 1), WO = conv_output_size(W, K, S, P, 1);
+        string shape = "CI" + to_string(CI) + " CO" + to_string(CO) + " " + to_string(H) + "x" + to_string(W);
+        if (K != 3 || S != 1) shape += " k" + to_string(K) + "s" + to_string(S);
+        double ops = 2.0 * CI * CO * HO * WO * K * K, bytes = CI * H * W + CO * CI * K * K + CO * HO * WO * 4.0;
+        auto weight = random_array<int8_t>(CO * CI * K * K, -128, 127);
+        unique_ptr<uint8_t[]> image(random_array<uint8_t>(blocked_channels(CI) * H * W, 0, 255));
+        unique_ptr<int32_t[]> out(new int32_t[blocked_channels(CO) * HO * WO]);
+        report("conv", "planar", shape, time_cpu([&] {
+            cpu_conv_any(CI, CO, H, W, K, S, P, 1, HO, WO, weight, image.get(), out.get());
+        }), ops, bytes);
+        report("conv", "generic", shape, time_cpu([&] {
+            cpu_conv_generic(CI, CO, H, W, K, S, P, 1, HO, WO, weight, image.get(), out.get());
+        }), ops, bytes);
+        unique_ptr<int8_t[]> blocked(block_conv_weight(CI, CO, K, weight));
+        report("conv", "blocked", shape, time_cpu([&] {
+            cpu_conv_blocked_any(CI, CO, H, W, K, S, P, 1, HO, WO, blocked.get(), image.get(), out.get());
+        }), ops, bytes);
+        run_opencl("conv", shape, new conv_layer(context, queue, program, CI, CO, H, W, weight, K, S, P, 1),
+                   image.get(), CI * H * W, ops, bytes);
+    }
+
+    // Depthwise K x K conv with stride S and "same" padding. "fused" ends in quan_relu, as after cnn::fuse_conv_quan.
+    void dwconv(size_t C, size_t H, size_t W, size_t K = 3, size_t S = 1) {
+        size_t P = (K - 1) / 2, HO = conv_output_size(H, K, S, P, 1), WO = conv_output_size(W, K, S, P, 1);
+        size_t CBL = blocked_channels(C);
+        string shape = "C" + to_string(C) + " " + to_string(H) + "x" + to_string(W);
+        if (K != 3 || S != 1) shape += " k" + to_string(K) + "s" + to_string(S);
+        double ops = 2.0 * C * HO * WO * K * K, bytes = C * H * W + C * K * K + C * HO * WO * 4.0;
+        auto weight = random_array<int8_t>(C * K * K, -128, 127);
+        unique_ptr<int32_t[]> bias(random_array<int32_t>(CBL, -1000, 1000));
+        unique_ptr<uint8_t[]> shift(random_array<uint8_t>(CBL, 0, 12));
+        unique_ptr<uint8_t[]> image(random_array<uint8_t>(CBL * H * W, 0, 255));
+        unique_ptr<int32_t[]> out(new int32_t[CBL * HO * WO]), acc(new int32_t[HO * WO]);
+        conv_epilogue quan_relu;
+        quan_relu.bias = bias.get(), quan_relu.shift = shift.get(), quan_relu.relu = true;
+        report("dwconv", "planar", shape, time_cpu([&] {
+            cpu_dwconv(C, H, W, K, S, P, 1, HO, WO, weight, image.get(), conv_epilogue(), acc.get(), out.get());
+        }), ops, bytes);
+        report("dwconv", "fused", shape, time_cpu([&] {
+            cpu_dwconv(C, H, W, K, S, P, 1, HO, WO, weight, image.get(), quan_relu, acc.get(), out.get());
+        }), ops, bytes - C * HO * WO * 3.0);
+        unique_ptr<int8_t[]> blocked(block_dwconv_weight(C, K, weight));
+        report("dwconv", "blocked", shape, time_cpu([&] {
+            cpu_dwconv_blocked(C, H, W, K, S, P, 1, HO, WO, blocked.get(), image.get(), conv_epilogue(), out.get());
+        }), ops, bytes);
+        run_opencl("dwconv", shape, new dwconv_layer(context, queue, program, C, H, W, weight, K, S, P, 1),
+                   image.get(), C * H * W, ops, bytes);
+    }
+
+    // Pointwise conv. "fused" ends in quan_relu, as after cnn::fuse_conv_quan.
+    void pwconv(size_t CI, size_t CO, size_t H, size_t W) {
+        size_t HW = H * W, CBL = blocked_channels(CO);
+        string shape = "CI" + to_string(CI) + " CO" + to_string(CO) + " " + to_string(H) + "x" + to_string(W);
+        double ops = 2.0 * CI * CO * HW, bytes = CI * HW + CI * CO + CO * HW * 4.0;
+        auto weight = random_array<int8_t>(CO * CI, -128, 127);
+        unique_ptr<int32_t[]> bias(random_array<int32_t>(CBL, -1000, 1000));
+        unique_ptr<uint8_t[]> shift(random_array<uint8_t>(CBL, 0, 12));
+        unique_ptr<uint8_t[]> image(random_array<uint8_t>(blocked_channels(CI) * HW, 0, 255));
+        unique_ptr<int32_t[]> out(new int32_t[CBL * HW]);
+        conv_epilogue quan_relu;
+        quan_relu.bias = bias.get(), quan_relu.shift = shift.get(), quan_relu.relu = true;
+        unique_ptr<int32_t[]> packed(pack_pwconv_weight(CI, CO, weight));
+        report("pwconv", "planar", shape, time_cpu([&] {
+            cpu_pwconv(CI, CO, HW, packed.get(), image.get(), conv_epilogue(), out.get());
+        }), ops, bytes);
+        report("pwconv", "fused", shape, time_cpu([&] {
+            cpu_pwconv(CI, CO, HW, packed.get(), image.get(), quan_relu, out.get());
+        }), ops, bytes - CO * HW * 3.0);
+        unique_ptr<int8_t[]> blocked(block_conv_weight(CI, CO, 1, weight));
+        report("pwconv", "blocked", shape, time_cpu([&] {
+            cpu_pwconv_blocked(CI, CO, HW, blocked.get(), image.get(), conv_epilogue(), out.get());
+        }), ops, bytes);
+        run_opencl("pwconv", shape, new pwconv_layer(context, queue, program, CI, CO, H, W, weight),
+                   image.get(), CI * HW, ops, bytes);
+    }
+
+    // 3x3 conv and fc with a fraction "density" of nonzero weights, dense kernels against the sparse ones.
+    // Both count the ops of the dense layer, so GOPS compare the time for the same result.
+    void sparse(size_t CI, size_t CO, size_t H, size_t W, double density) {
+        stringstream ss;
+        ss << "CI" << CI << " CO" << CO;
+        if (H * W > 1) ss << " " << H << "x" << W;
+        ss << " d" << fixed << setprecision(2) << density;
+        string shape = ss.str();
+        bool conv = H * W > 1;
+        size_t K = conv ? 3 : 1, CIB = conv ? blocked_channels(CI) : CI, COB = blocked_channels(CO);
+        double ops = 2.0 * CI * CO * H * W * K * K, input_bytes = CI * H * W, output_bytes = CO * H * W * 4.0;
+        auto weight = random_sparse_weight(CO * CI * K * K, density);
+        auto weight_copy = new_array_copy(vector<int8_t>(weight, weight + CO * CI * K * K));
+        unique_ptr<uint8_t[]> image(random_array<uint8_t>(CIB * H * W, 0, 255));
+        unique_ptr<int32_t[]> out(new int32_t[COB * H * W]);
+        unique_ptr<int8_t[]> blocked(conv ? block_conv_weight(CI, CO, K, weight)
+                                          : block_fc_weight(CI, 1, 1, CO, weight));
+        double dense_bytes = input_bytes + CO * CI * K * K + output_bytes;
+        string name = conv ? "conv" : "fc";
+        report(name, "planar", shape, time_cpu([&] {
+            if (conv) cpu_conv(CI, CO, H, W, weight, image.get(), out.get());
+            else cpu_fc(CI, CO, weight, image.get(), out.get());
+        }), ops, dense_bytes);
+        report(name, "blocked", shape, time_cpu([&] {
+            if (conv) cpu_conv_blocked(CI, CO, H, W, blocked.get(), image.get(), out.get());
+            else cpu_fc(CIB, COB, blocked.get(), image.get(), out.get());
+        }), ops, dense_bytes);
+
+        // Same encodings as conv_layer::set_sparse and fc_layer::set_sparse.
+        auto rows = conv ? compress_rows(CO, CI * K * K, CI * K * K, 1, weight) : compress_rows(CI, CO, CO, 1, weight);
+        auto blocked_rows = conv ? rows : compress_rows(CIB, COB, COB, 1, blocked.get());
+        double sparse_bytes = input_bytes + rows.bytes() + output_bytes;
+        name += "_sparse";
+        report(name, "planar", shape, time_cpu([&] {
+            if (conv) cpu_conv_sparse(CI, CO, H, W, K, 1, 1, 1, H, W, rows, image.get(), out.get());
+            else cpu_fc_sparse(CI, CO, rows, image.get(), out.get());
+        }), ops, sparse_bytes);
+        report(name, "blocked", shape, time_cpu([&] {
+            if (conv) cpu_conv_blocked_sparse(CI, CO, H, W, K, 1, 1, 1, H, W, blocked_rows, image.get(), out.get());
+            else cpu_fc_sparse(CIB, COB, blocked_rows, image.get(), out.get());
+        }), ops, sparse_bytes);
+
+        layer *dense_layer, *sparse_layer;
+        if (conv) {
+            dense_layer = new conv_layer(context, queue, program, CI, CO, H, W, weight);
+            auto l = new conv_layer(context, queue, program, CI, CO, H, W, weight_copy);
+            l->set_sparse(context, program, true);
+            sparse_layer = l;
+        } else {
+            dense_layer = new fc_layer(context, queue, program, CI, CO, weight);
+            auto l = new fc_layer(context, queue, program, CI, CO, weight_copy);
+            l->set_sparse(context, program, true);
+            sparse_layer = l;
+        }
+        run_opencl(conv ? "conv" : "fc", shape, dense_layer, image.get(), CI * H * W, ops, dense_bytes);
+        run_opencl(name, shape, sparse_layer, image.get(), CI * H * W, ops, sparse_bytes);
+    }
+
+    // 3x3 conv and fc with weights in [-8, 7], as int8 against the same weights packed as int4.
+    void int4(size_t CI, size_t CO, size_t H, size_t W) {
+        string shape = "CI" + to_string(CI) + " CO" + to_string(CO);
+        if (H * W > 1) shape += " " + to_string(H) + "x" + to_string(W);
+        bool conv = H * W > 1;
+        size_t K = conv ? 3 : 1, CIB = conv ? blocked_channels(CI) : CI, COB = blocked_channels(CO);
+        double ops = 2.0 * CI * CO * H * W * K * K, input_bytes = CI * H * W, output_bytes = CO * H * W * 4.0;
+        auto weight = random_array<int8_t>(CO * CI * K * K, -8, 7);
+        auto weight_copy = new_array_copy(vector<int8_t>(weight, weight + CO * CI * K * K));
+        unique_ptr<uint8_t[]> image(random_array<uint8_t>(CIB * H * W, 0, 255));
+        unique_ptr<int32_t[]> out(new int32_t[COB * H * W]);
+        unique_ptr<int8_t[]> blocked(conv ? block_conv_weight(CI, CO, K, weight)
+                                          : block_fc_weight(CI, 1, 1, CO, weight));
+        // Same rows as conv_layer::set_int4 and fc_layer::set_int4.
+        size_t rows = conv ? CO : CI, columns = conv ? CI * K * K : CO;
+        unique_ptr<uint8_t[]> packed(pack_int4(rows, columns, weight));
+        unique_ptr<uint8_t[]> packed_blocked(conv ? pack_int4(COB / CB, CI * K * K * CB, blocked.get())
+                                                  : pack_int4(CIB, COB, blocked.get()));
+        double int8_bytes = input_bytes + CO * CI * K * K + output_bytes;
+        double int4_bytes = input_bytes + rows * int4_row_bytes(columns) + output_bytes;
+        string name = conv ? "conv" : "fc";
+        report(name, "planar", shape, time_cpu([&] {
+            if (conv) cpu_conv(CI, CO, H, W, weight, image.get(), out.get());
+            else cpu_fc(CI, CO, weight, image.get(), out.get());
+        }), ops, int8_bytes);
+        report(name, "blocked", shape, time_cpu([&] {
+            if (conv) cpu_conv_blocked(CI, CO, H, W, blocked.get(), image.get(), out.get());
+            else cpu_fc(CIB, COB, blocked.get(), image.get(), out.get());
+        }), ops, int8_bytes);
+        name += "_int4";
+        report(name, "planar", shape, time_cpu([&] {
+            if (conv) cpu_conv_int4(CI, CO, H, W, K, 1, 1, 1, H, W, false, packed.get(), image.get(), out.get());
+            else cpu_fc_int4(CI, CO, packed.get(), image.get(), out.get());
+        }), ops, int4_bytes);
+        report(name, "blocked", shape, time_cpu([&] {
+            if (conv)
+                cpu_conv_blocked_int4(CI, CO, H, W, K, 1, 1, 1, H, W, false, packed_blocked.get(), image.get(),
+                                      out.get());
+            else cpu_fc_int4(CIB, COB, packed_blocked.get(), image.get(), out.get());
+        }), ops, int4_bytes);
+
+        layer *int8_layer, *int4_layer;
+        if (conv) {
+            int8_layer = new conv_layer(context, queue, program, CI, CO, H, W, weight);
+            auto l = new conv_layer(context, queue, program, CI, CO, H, W, weight_copy);
+            l->set_int4(context, program, true);
+            int4_layer = l;
+        } else {
+            int8_layer = new fc_layer(context, queue, program, CI, CO, weight);
+            auto l = new fc_layer(context, queue, program, CI, CO, weight_copy);
+            l->set_int4(context, program, true);
+            int4_layer = l;
+        }
+        run_opencl(conv ? "conv" : "fc", shape, int8_layer, image.get(), CI * H * W, ops, int8_bytes);
+        run_opencl(name, shape, int4_layer, image.get(), CI * H * W, ops, int4_bytes);
+    }
+
+    void fc(size_t CI, size_t CO) {
+        string shape = "CI" + to_string(CI) + " CO" + to_string(CO);
+        double ops = 2.0 * CI * CO, bytes = CI + CI * CO + CO * 4.0;
+        auto weight = random_array<int8_t>(CI * CO, -128, 127);
+        unique_ptr<uint8_t[]> feature(random_array<uint8_t>(CI, 0, 255));
+        unique_ptr<int32_t[]> out(new int32_t[CO]);
+        report("fc", "planar", shape, time_cpu([&] { cpu_fc(CI, CO, weight, feature.get(), out.get()); }), ops, bytes);
+        run_opencl("fc", shape, new fc_layer(context, queue, program, CI, CO, weight), feature.get(), CI, ops, bytes);
+    }
+
+    // quan and quan_relu, planar and blocked.
+    void quan(size_t C, size_t H, size_t W) {
+        string shape = "C" + to_string(C) + " " + to_string(H) + "x" + to_string(W);
+        size_t CBL = blocked_channels(C);
+        double ops = double(C) * H * W, bytes = C * H * W * 5.0 + C * 5.0;
+        auto bias = random_array<int32_t>(CBL, -1000, 1000);
+        auto shift = random_array<uint8_t>(CBL, 0, 12);
+        unique_ptr<int32_t[]> feature(random_array<int32_t>(CBL * H * W, -100000, 100000));
+        unique_ptr<uint8_t[]> out(new uint8_t[CBL * H * W]);
+        auto dst = (int8_t *) out.get();
+        report("quan", "planar", shape,
+               time_cpu([&] { cpu_quan(C, H, W, bias, shift, feature.get(), dst); }), ops, bytes);
+        report("quan", "blocked", shape,
+               time_cpu([&] { cpu_quan_blocked(C, H, W, bias, shift, feature.get(), dst); }), ops, bytes);
+        report("quan_relu", "planar", shape,
+               time_cpu([&] { cpu_quan_relu(C, H, W, bias, shift, feature.get(), out.get()); }), ops, bytes);
+        report("quan_relu", "blocked", shape,
+               time_cpu([&] { cpu_quan_relu_blocked(C, H, W, bias, shift, feature.get(), out.get()); }), ops, bytes);
+        // The layers take ownership of bias and shift, so each gets its own copy.
+        run_opencl("quan", shape, new quan_layer(context, queue, program, C, H, W,
+                                                 new_array_copy(vector<int32_t>(bias, bias + C)),
+                                                 new_array_copy(vector<uint8_t>(shift, shift + C))),
+                   feature.get(), C * H * W * 4, ops, bytes);
+        run_opencl("quan_relu", shape, new quan_relu_layer(context, queue, program, C, H, W, bias, shift),
+                   feature.get(), C * H * W * 4, ops, bytes);
+    }
+
+    void relu(size_t C, size_t H, size_t W) {
+        string shape = "C" + to_string(C) + " " + to_string(H) + "x" + to_string(W);
+        double ops = double(C) * H * W, bytes = C * H * W * 2.0;
+        unique_ptr<int8_t[]> feature(random_array<int8_t>(C * H * W, -128, 127));
+        unique_ptr<uint8_t[]> out(new uint8_t[C * H * W]);
+        report("relu", "planar", shape, time_cpu([&] { cpu_relu(C, H, W, feature.get(), out.get()); }), ops, bytes);
+        run_opencl("relu", shape, new relu_layer(context, queue, program, C, H, W), feature.get(), C * H * W, ops,
+                   bytes);
+    }
+
+    // K x K pool with stride S: max, average and pool_int32, planar and blocked.
+    void pool(size_t C, size_t H, size_t W, size_t K = 2, size_t S = 2) {
+        string shape = "C" + to_string(C) + " " + to_string(H) + "x" + to_string(W);
+        if (K != 2 || S != 2) shape += " k" + to_string(K) + "s" + to_string(S);
+        size_t CBL = blocked_channels(C), HO = pool_output_size(H, K, S), WO = pool_output_size(W, K, S);
+        double ops = double(K * K) * C * HO * WO, bytes = C * H * W + C * HO * WO;
+        unique_ptr<uint8_t[]> feature(random_array<uint8_t>(CBL * H * W, 0, 127));
+        unique_ptr<uint8_t[]> out(new uint8_t[CBL * HO * WO]);
+        for (bool average:{false, true}) {
+            string name = average ? "avg_pool" : "pool";
+            report(name, "planar", shape, time_cpu([&] {
+                cpu_pool(C, H, W, HO, WO, K, S, average, feature.get(), out.get());
+            }), ops, bytes);
+            report(name, "blocked", shape, time_cpu([&] {
+                cpu_pool_blocked(C, H, W, HO, WO, K, S, average, feature.get(), out.get());
+            }), ops, bytes);
+            run_opencl(name, shape, new pool_layer(context, queue, program, C, H, W, K, S, average), feature.get(),
+                       C * H * W, ops, bytes);
+        }
+
+        unique_ptr<int32_t[]> feature32(random_array<int32_t>(CBL * H * W, -100000, 100000));
+        unique_ptr<int32_t[]> out32(new int32_t[CBL * HO * WO]);
+        report("pool_int32", "planar", shape,
+               time_cpu([&] { cpu_pool_int32(C, H, W, HO, WO, K, S, feature32.get(), out32.get()); }), ops,
+               bytes * 4);
+        report("pool_int32", "blocked", shape,
+               time_cpu([&] { cpu_pool_int32_blocked(C, H, W, HO, WO, K, S, feature32.get(), out32.get()); }), ops,
+               bytes * 4);
+        run_opencl("pool_int32", shape, new pool_layer(context, queue, program, C, H, W, K, S, false, true),
+                   feature32.get(), C * H * W * 4, ops, bytes * 4);
+    }
+
+    // Global average pool, planar and blocked.
+    void gap(size_t C, size_t H, size_t W) {
+        string shape = "C" + to_string(C) + " " + to_string(H) + "x" + to_string(W);
+        double ops = double(C) * H * W, bytes = C * H * W + C;
+        unique_ptr<uint8_t[]> feature(random_array<uint8_t>(blocked_channels(C) * H * W, 0, 127));
+        unique_ptr<uint8_t[]> out(new uint8_t[blocked_channels(C)]);
+        report("gap", "planar", shape, time_cpu([&] { cpu_gap(C, H, W, feature.get(), out.get()); }), ops, bytes);
+        report("gap", "blocked", shape,
+               time_cpu([&] { cpu_gap_blocked(C, H, W, feature.get(), out.get()); }), ops, bytes);
+        run_opencl("gap", shape, new gap_layer(context, queue, program, C, H, W), feature.get(), C * H * W, ops,
+                   bytes);
+    }
+
+    // 32 bit bottom-up BMP rows.
+    void preprocess(size_t H, size_t W) {
+        string shape = to_string(H) + "x" + to_string(W) + " BGRA";
+        raw_image_format format{H, W, 4, W * 4, 0, true};
+        double ops = double(H) * W, bytes = format.size() + H * W;
+        unique_ptr<uint8_t[]> raw(random_array<uint8_t>(format.size(), 0, 255));
+        unique_ptr<uint8_t[]> out(new uint8_t[H * W]);
+        report("preprocess", "planar", shape, time_cpu([&] {
+            cpu_preprocess(H, W, format.pixel_bytes, format.row_stride, format.channel, format.bottom_up, raw.get(),
+                           out.get(), 1);
+        }), ops, bytes);
+        run_opencl("preprocess", shape, new preprocess_layer(context, queue, program, format), raw.get(),
+                   format.size(), ops, bytes);
+    }
+};
+
+int main(int argc, char **argv) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string key = argv[i], value = argv[i + 1];
+        if (key == "--kernel") options.kernel = value;
+        else if (key == "--filter") options.filter = value;
+        else if (key == "--min-time") options.min_time = atof(value.c_str());
+        else {
+            cout << "Usage: " << argv[0] << " [--kernel FILE] [--filter NAME] [--min-time SECONDS]" << endl;
+            return 1;
+        }
+    }
+    microbench bench(options.kernel);
+    auto enabled = [](const string &name) { return name.find(options.filter) != string::npos; };
+
+    // MNIST shapes first, then larger ones.
+    if (enabled("conv")) {
+        for (auto s:vector<array<size_t, 4>>{{1,  16,  28, 28},
+                                             {16, 16,  14, 14},
+                                             {16, 32,  56, 56},
+                                             {32, 64,  28, 28},
+                                             {64, 64,  56, 56},
+                                             {128, 128, 14, 14}})
+            bench.conv(s[0], s[1], s[2], s[3]);
+        // 1x1, 3x3 stride 2 and 5x5, as CI, CO, H, W, K, S.
+        for (auto s:vector<array<size_t, 6>>{{64, 64,  56, 56, 1, 1},
+                                             {64, 256, 28, 28, 1, 1},
+                                             {16, 32,  56, 56, 3, 2},
+                                             {64, 128, 56, 56, 3, 2},
+                                             {16, 16,  28, 28, 5, 1}})
+            bench.conv(s[0], s[1], s[2], s[3], s[4], s[5]);
+    }
+    if (enabled("dwconv")) {
+        for (auto s:vector<array<size_t, 5>>{{16,  28,  28,  3, 1},
+                                             {32,  112, 112, 3, 1},
+                                             {64,  56,  56,  3, 2},
+                                             {128, 28,  28,  3, 1},
+                                             {128, 28,  28,  5, 1},
+                                             {256, 14,  14,  3, 1}})
+            bench.dwconv(s[0], s[1], s[2], s[3], s[4]);
+    }
+    if (enabled("pwconv")) {
+        for (auto s:vector<array<size_t, 4>>{{16,  32,  28,  28},
+                                             {32,  64,  112, 112},
+                                             {64,  128, 56,  56},
+                                             {128, 128, 28,  28},
+                                             {256, 256, 14,  14}})
+            bench.pwconv(s[0], s[1], s[2], s[3]);
+    }
+    if (enabled("fc")) {
+        for (auto s:vector<array<size_t, 2>>{{784,  128},
+                                             {128,  10},
+                                             {1024, 1024},
+                                             {4096, 1024}})
+            bench.fc(s[0], s[1]);
+    }
+    if (enabled("sparse")) {
+        for (double density:{0.05, 0.1, 0.2, 0.3, 0.5}) {
+            for (auto s:vector<array<size_t, 4>>{{16,   16,   14, 14},
+                                                 {64,   64,   56, 56},
+                                                 {784,  128,  1,  1},
+                                                 {4096, 1024, 1,  1}})
+                bench.sparse(s[0], s[1], s[2], s[3], density);
+        }
+    }
+    if (enabled("int4")) {
+        for (auto s:vector<array<size_t, 4>>{{16,   16,   14, 14},
+                                             {64,   64,   56, 56},
+                                             {784,  128,  1,  1},
+                                             {4096, 1024, 1,  1}})
+            bench.int4(s[0], s[1], s[2], s[3]);
+    }
+    auto feature_shapes = vector<array<size_t, 3>>{{16,  28,  28},
+                                                   {16,  14,  14},
+                                                   {64,  56,  56},
+                                                   {128, 112, 112}};
+    if (enabled("quan")) for (auto s:feature_shapes) bench.quan(s[0], s[1], s[2]);
+    if (enabled("relu")) for (auto s:feature_shapes) bench.relu(s[0], s[1], s[2]);
+    if (enabled("pool")) {
+        for (auto s:feature_shapes) bench.pool(s[0], s[1], s[2]);
+        bench.pool(64, 56, 56, 3, 2);
+    }
+    if (enabled("gap")) {
+        for (auto s:feature_shapes) bench.gap(s[0], s[1], s[2]);
+        bench.gap(16, 7, 7);
+    }
+    if (enabled("preprocess")) for (size_t s:{28, 224, 1024}) bench.preprocess(s, s);
+    return 0;
+}
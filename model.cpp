@@ -0,0 +1,230 @@
+#ifndef OPENCL_CNN_CONV_MODEL_CPP
+#define OPENCL_CNN_CONV_MODEL_CPP
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+// Plain description of one layer in model.txt.
+// Shared by cnn::parse_model_file and the code generator, so neither needs the other's dependencies.
+struct layer_spec {
+    string type; // CONV, DWCONV, PWCONV, FC, QUAN, RELU, POOL or GAP
+    size_t CI = 0, CO = 0; // CONV, PWCONV, FC
+    size_t C = 0, H = 0, W = 0; // DWCONV, QUAN, RELU, POOL, GAP. CONV and PWCONV use H and W as well.
+    // CONV, DWCONV: square kernel size, stride, zero padding and dilation.
+    // The output is conv_output_size(H) x ...(W). PWCONV is always K = 1, stride 1, no padding.
+    // POOL: square window K and stride, without padding. The output is pool_output_size(H) x ...(W).
+    size_t K = 3, stride = 1, pad = 1, dilation = 1;
+    bool average = false; // POOL: average instead of max.
+    vector<int8_t> weight; // CONV: [CO, CI, K, K], DWCONV: [C, K, K], PWCONV: [CO, CI], FC: [CI, CO]
+    vector<int32_t> bias; // QUAN: [C]
+    vector<uint8_t> shift; // QUAN: [C]
+};
+
+// Output size of a conv along one axis.
+inline size_t conv_output_size(size_t in, size_t K, size_t stride, size_t pad, size_t dilation) {
+    return (in + 2 * pad - dilation * (K - 1) - 1) / stride + 1;
+}
+
+// Output size of a pool along one axis.
+inline size_t pool_output_size(size_t in, size_t K, size_t stride) {
+    return (in - K) / stride + 1;
+}
+
+// Optional [K <k>] [STRIDE <s>] [PAD <p>] [DILATION <d>] of CONV and DWCONV.
+// K defaults to 3, STRIDE and DILATION to 1, and PAD to dilation * (K - 1) / 2, which keeps the size at stride 1.
+void read_conv_geometry(istream &fs, layer_spec &spec) {
+    string s;
+    bool pad = false;
+    while (fs >> ws && isalpha(fs.peek())) {
+        fs >> s;
+        if (s == "K") fs >> spec.K;
+        else if (s == "STRIDE") fs >> spec.stride;
+        else if (s == "PAD") fs >> spec.pad, pad = true;
+        else if (s == "DILATION") fs >> spec.dilation;
+        else assert(false);
+    }
+    if (!pad) spec.pad = spec.dilation * (spec.K - 1) / 2;
+    assert(spec.K > 0 && spec.stride > 0 && spec.dilation > 0);
+    assert(spec.H + 2 * spec.pad > spec.dilation * (spec.K - 1));
+    assert(spec.W + 2 * spec.pad > spec.dilation * (spec.K - 1));
+}
+
+// Optional [K <k>] [STRIDE <s>] [MODE MAX|AVG] of POOL, up to the end of the line.
+// K defaults to 2 and STRIDE to K, so a bare POOL is the 2x2 max pool of the MNIST model.
+void read_pool_geometry(istream &fs, layer_spec &spec) {
+    string line, s;
+    bool stride = false;
+    spec.K = 2, spec.pad = 0;
+    // No weights follow a POOL, the next layer does.
+    getline(fs, line);
+    stringstream keys(line);
+    while (keys >> s) {
+        if (s == "K") keys >> spec.K;
+        else if (s == "STRIDE") keys >> spec.stride, stride = true;
+        else if (s == "MODE") {
+            keys >> s;
+            assert(s == "MAX" || s == "AVG");
+            spec.average = s == "AVG";
+        } else assert(false);
+    }
+    if (!stride) spec.stride = spec.K;
+    assert(spec.K > 0 && spec.stride > 0 && spec.H >= spec.K && spec.W >= spec.K);
+}
+
+// CONV CO <co> CI <ci> H <h> W <w> [geometry] <weights>
+// DWCONV C <c> H <h> W <w> [geometry] <weights>
+// PWCONV CO <co> CI <ci> H <h> W <w> <weights>
+// POOL C <c> H <h> W <w> [pool geometry]
+// GAP C <c> H <h> W <w>, global average pool to [C, 1, 1]
+vector<layer_spec> read_model_file(const string &model_file) {
+    ifstream fs(model_file);
+    vector<layer_spec> specs;
+    string s;
+    int param;
+    while (fs >> s) {
+        layer_spec spec;
+        spec.type = s;
+        if (s == "CONV" || s == "PWCONV") {
+            fs >> s;
+            assert(s == "CO");
+            fs >> spec.CO >> s;
+            assert(s == "CI");
+            fs >> spec.CI >> s;
+            assert(s == "H");
+            fs >> spec.H >> s;
+            assert(s == "W");
+            fs >> spec.W;
+            if (spec.type == "CONV") read_conv_geometry(fs, spec);
+            else spec.K = 1, spec.pad = 0;
+            spec.weight.resize(spec.CO * spec.CI * spec.K * spec.K);
+            for (auto &weight:spec.weight) {
+                fs >> param;
+                weight = param;
+            }
+        } else if (s == "DWCONV") {
+            fs >> s;
+            assert(s == "C");
+            fs >> spec.C >> s;
+            assert(s == "H");
+            fs >> spec.H >> s;
+            assert(s == "W");
+            fs >> spec.W;
+            read_conv_geometry(fs, spec);
+            spec.weight.resize(spec.C * spec.K * spec.K);
+            for (auto &weight:spec.weight) {
+                fs >> param;
+                weight = param;
+            }
+        } else if (s == "FC") {
+            fs >> s;
+            assert(s == "CI");
+            fs >> spec.CI >> s;
+            assert(s == "CO");
+            fs >> spec.CO;
+            spec.weight.resize(spec.CI * spec.CO);
+            for (auto &weight:spec.weight) {
+                fs >> param;
+                weight = param;
+            }
+        } else if (s == "RELU" || s == "POOL" || s == "GAP" || s == "QUAN") {
+            fs >> s;
+            assert(s == "C");
+            fs >> spec.C >> s;
+            assert(s == "H");
+            fs >> spec.H >> s;
+            assert(s == "W");
+            fs >> spec.W;
+            if (spec.type == "POOL") read_pool_geometry(fs, spec);
+            if (spec.type == "QUAN") {
+                spec.bias.resize(spec.C);
+                spec.shift.resize(spec.C);
+                fs >> s;
+                assert(s == "BIAS");
+                for (auto &bias:spec.bias) {
+                    fs >> param;
+                    bias = param;
+                }
+                fs >> s;
+                assert(s == "SHIFT");
+                for (auto &shift:spec.shift) {
+                    fs >> param;
+                    shift = param;
+                }
+            }
+        } else {
+            cout << "No such layer: " << s << endl;
+            exit(1);
+        }
+        specs.push_back(move(spec));
+    }
+    return specs;
+}
+
+// One line of parameters, optionally after a keyword.
+template<class T>
+void write_model_values(ostream &fs, const char *name, const vector<T> &values) {
+    if (name) fs << name << ' ';
+    for (auto v:values) fs << int(v) << ' ';
+    fs << '\n';
+}
+
+// Geometry keys of CONV and DWCONV. Only what differs from the defaults, so 3x3 models keep the original format.
+void write_conv_geometry(ostream &fs, const layer_spec &spec) {
+    if (spec.K != 3) fs << " K " << spec.K;
+    if (spec.stride != 1) fs << " STRIDE " << spec.stride;
+    if (spec.dilation != 1) fs << " DILATION " << spec.dilation;
+    if (spec.pad != spec.dilation * (spec.K - 1) / 2) fs << " PAD " << spec.pad;
+}
+
+// Geometry keys of POOL, only what differs from the 2x2 max pool.
+void write_pool_geometry(ostream &fs, const layer_spec &spec) {
+    if (spec.K != 2) fs << " K " << spec.K;
+    if (spec.stride != spec.K) fs << " STRIDE " << spec.stride;
+    if (spec.average) fs << " MODE AVG";
+}
+
+// Write layers in the model.txt format read by read_model_file. Returns false if the file cannot be written.
+bool write_model_file(const string &model_file, const vector<layer_spec> &specs) {
+    ofstream fs(model_file);
+    if (!fs) return false;
+    for (auto &spec:specs) {
+        if (spec.type == "CONV") {
+            fs << "CONV CO " << spec.CO << " CI " << spec.CI << " H " << spec.H << " W " << spec.W;
+            write_conv_geometry(fs, spec);
+            fs << '\n';
+            write_model_values(fs, nullptr, spec.weight);
+        } else if (spec.type == "DWCONV") {
+            fs << "DWCONV C " << spec.C << " H " << spec.H << " W " << spec.W;
+            write_conv_geometry(fs, spec);
+            fs << '\n';
+            write_model_values(fs, nullptr, spec.weight);
+        } else if (spec.type == "PWCONV") {
+            fs << "PWCONV CO " << spec.CO << " CI " << spec.CI << " H " << spec.H << " W " << spec.W << '\n';
+            write_model_values(fs, nullptr, spec.weight);
+        } else if (spec.type == "FC") {
+            fs << "FC CI " << spec.CI << " CO " << spec.CO << '\n';
+            write_model_values(fs, nullptr, spec.weight);
+        } else {
+            fs << spec.type << " C " << spec.C << " H " << spec.H << " W " << spec.W;
+            if (spec.type == "POOL") write_pool_geometry(fs, spec);
+            fs << '\n';
+            if (spec.type == "QUAN") {
+                write_model_values(fs, "BIAS", spec.bias);
+                write_model_values(fs, "SHIFT", spec.shift);
+            }
+        }
+        fs << '\n';
+    }
+    return bool(fs);
+}
+
+// Copy a parsed parameter vector into a new[] array, which the layers take ownership of.
+template<class T>
+T *new_array_copy(const vector<T> &v) {
+    auto ptr = new T[v.size()];
+    copy(v.begin(), v.end(), ptr);
+    return ptr;
+}
+
+#endif //OPENCL_CNN_CONV_MODEL_CPP
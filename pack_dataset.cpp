@@ -0,0 +1,29 @@
+// Convert the BMP test set into one packed dataset file (see dataset.cpp).
+//
+// Usage: pack_dataset <image_list> <image_dir> <N> <output_file>
+
+#include "util.cpp"
+#include "dataset.cpp"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+    if (argc < 5) {
+        cout << "Usage: " << argv[0] << " <image_list> <image_dir> <N> <output_file>" << endl;
+        return 1;
+    }
+    int N = atoi(argv[3]);
+    auto images = new uint8_t[N][784];
+    auto labels = new int[N];
+    load_mnist(N, argv[1], argv[2], images, labels);
+
+    vector<uint8_t> packed_labels(labels, labels + N);
+    if (!write_packed_dataset(argv[4], N, 1, 28, 28, (const uint8_t *) images, packed_labels.data())) {
+        cout << "Cannot write " << argv[4] << endl;
+        return 1;
+    }
+    cout << "Packed " << N << " images into " << argv[4] << endl;
+    delete[] images;
+    delete[] labels;
+    return 0;
+}
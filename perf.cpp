@@ -0,0 +1,199 @@
+#ifndef OPENCL_CNN_CONV_PERF_CPP
+#define OPENCL_CNN_CONV_PERF_CPP
+
+#include <bits/stdc++.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Hardware performance counters through perf_event_open, attributed to the cpu_forward of each layer.
+// Off by default. Only user-space events of the calling thread are counted, which perf_event_paranoid <= 2 allows.
+// Counters the kernel or the machine does not provide (containers, VMs) are reported as unavailable,
+// and without any counter set_perf_counters fails and nothing is recorded.
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
+
+const char *const PERF_COUNTER_NAMES[PERF_COUNTERS] = {"cycles", "instructions", "L1d misses", "LLC misses",
+                                                       "branch misses"};
+
+// One counter reading, or the difference of two.
+typedef array<uint64_t, PERF_COUNTERS> perf_sample;
+
+// A group read: the counters, and how long the group was enabled and how long it actually ran on the PMU.
+// running < enabled when the group was multiplexed with other events, and 0 if it was never scheduled,
+// e.g. with a counter held by the NMI watchdog or on a core type without some of the events.
+struct perf_reading {
+    perf_sample values{};
+    uint64_t enabled = 0, running = 0;
+};
+
+// Totals of the samples of one layer. Lock-free like latency_histogram.
+struct perf_totals {
+    atomic<uint64_t> samples{0};
+    array<atomic<uint64_t>, PERF_COUNTERS> values;
+
+    perf_totals() { reset(); }
+
+    void add(const perf_sample &delta) {
+        samples.fetch_add(1, memory_order_relaxed);
+        for (int i = 0; i < PERF_COUNTERS; i++) values[i].fetch_add(delta[i], memory_order_relaxed);
+    }
+
+    // Mean per sample.
+    double mean(int counter) const {
+        uint64_t n = samples.load(memory_order_relaxed);
+        return n ? double(values[counter].load(memory_order_relaxed)) / n : 0;
+    }
+
+    void reset() {
+        samples = 0;
+        for (auto &v:values) v = 0;
+    }
+};
+
+static atomic<bool> perf_on(false);
+static array<atomic<bool>, PERF_COUNTERS> perf_available{}; // Opened by the first thread that tried.
+
+inline bool perf_counters_enabled() { return perf_on.load(memory_order_relaxed); }
+
+// The counter group of the calling thread, opened on first use.
+class perf_group {
+public:
+    perf_group() {
+#ifdef __linux__
+        const pair<uint32_t, uint64_t> events[PERF_COUNTERS] = {
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8u) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16u)},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}};
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0));
+            if (fd < 0) {
+                error = errno;
+                continue;
+            }
+            if (leader < 0) leader = fd;
+            slots[i] = members++;
+            fds.push_back(fd);
+            perf_available[i] = true;
+        }
+        if (leader >= 0) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    perf_group(const perf_group &) = delete;
+
+    perf_group &operator=(const perf_group &) = delete;
+
+    ~perf_group() {
+#ifdef __linux__
+        for (int fd:fds) close(fd);
+#endif
+    }
+
+    bool ok() const { return leader >= 0; }
+
+    // errno of the last counter that could not be opened.
+    int last_error() const { return error; }
+
+    // Current value of every counter, 0 for the unavailable ones, and the group times.
+    perf_reading read_all() const {
+        perf_reading reading;
+#ifdef __linux__
+        // nr, time_enabled, time_running, then one value per member.
+        uint64_t buffer[3 + PERF_COUNTERS];
+        if (leader >= 0 && read(leader, buffer, sizeof(buffer)) > 0) {
+            reading.enabled = buffer[1];
+            reading.running = buffer[2];
+            for (int i = 0; i < PERF_COUNTERS; i++)
+                if (slots[i] >= 0) reading.values[i] = buffer[3 + slots[i]];
+        }
+#endif
+        return reading;
+    }
+
+    static perf_group &of_thread() {
+        static thread_local perf_group group;
+        return group;
+    }
+
+private:
+    int leader = -1, members = 0, error = 0;
+    int slots[PERF_COUNTERS] = {-1, -1, -1, -1, -1}; // Position in the group read, -1 if not opened.
+    vector<int> fds;
+};
+
+// Switch the counters on or off. Returns false, and leaves them off, if no counter can be opened.
+bool set_perf_counters(bool on) {
+    if (on) {
+        auto &group = perf_group::of_thread();
+        if (!group.ok()) {
+            cerr << "Hardware counters unavailable: " << strerror(group.last_error())
+                 << " (check /proc/sys/kernel/perf_event_paranoid)" << endl;
+            perf_on = false;
+            return false;
+        }
+    }
+    perf_on = on;
+    return true;
+}
+
+// Counter difference over a scope, added to a layer's totals, if counters were on when it started and the
+// calling thread has a counter group. Scaled up by enabled / running time when the group was multiplexed,
+// and dropped when the group did not run at all, so the layer shows n/a instead of zeros.
+class scoped_perf {
+    perf_totals *totals = nullptr;
+    perf_reading op;
+
+public:
+    explicit scoped_perf(perf_totals &totals_) {
+        if (!perf_counters_enabled()) return;
+        // Every thread opens its own group, which can fail on a worker thread even if it worked on the first.
+        auto &group = perf_group::of_thread();
+        if (!group.ok()) return;
+        totals = &totals_;
+        op = group.read_all();
+    }
+
+    scoped_perf(const scoped_perf &) = delete;
+
+    scoped_perf &operator=(const scoped_perf &) = delete;
+
+    ~scoped_perf() {
+        if (!totals) return;
+        auto ed = perf_group::of_thread().read_all();
+        uint64_t enabled = ed.enabled - op.enabled, running = ed.running - op.running;
+        if (running == 0) return;
+        perf_sample delta{};
+        for (int i = 0; i < PERF_COUNTERS; i++)
+            delta[i] = uint64_t(double(ed.values[i] - op.values[i]) * enabled / running + 0.5);
+        totals->add(delta);
+    }
+};
+
+#endif //OPENCL_CNN_CONV_PERF_CPP
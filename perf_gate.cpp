@@ -0,0 +1,314 @@
+// Performance regression gate. Runs a fixed benchmark several times, then compares the end-to-end and per-layer
+// latency and the throughput with a baseline recorded by the same tool on the same machine.
+// A metric regresses when the 95% confidence interval of the difference of the means (Welch) lies entirely
+// above the tolerance, so noise alone does not fail the gate. Exits 1 on a regression, 2 on a usage error or a
+// baseline recorded with another model, dataset, backend, image count, warmup or trial count.
+//
+// Baselines only mean something for the host, build and OpenCL runtime they were recorded on, so record one
+// on the gate machine first:
+//   cnn_perf_gate --write-baseline perf_baseline.json
+//   cnn_perf_gate --baseline perf_baseline.json
+//
+// Options: [--model FILE] [--kernel FILE] [--dataset FILE] [--backend cpu|opencl] [--images N] [--trials N]
+//          [--warmup N] [--tolerance PERCENT]
+
+#include "cnn.cpp"
+#include "dataset.cpp"
+
+using namespace std;
+
+struct gate_options {
+    string model = "../model.txt";
+    string kernel = "../kernel.cl";
+    string dataset = "../mnist.bin";
+    string backend = "cpu";
+    string baseline, write_baseline;
+    size_t images = 2000; // Per trial.
+    size_t trials = 10;
+    size_t warmup = 200;
+    double tolerance = 5; // Percent of the baseline mean.
+};
+
+// Mean and sample standard deviation of one metric over the trials.
+struct metric_stats {
+    double mean = 0, stddev = 0;
+    size_t n = 0;
+};
+
+metric_stats stats_of(const vector<double> &values) {
+    metric_stats s;
+    s.n = values.size();
+    for (double v:values) s.mean += v / s.n;
+    for (double v:values) s.stddev += (v - s.mean) * (v - s.mean);
+    s.stddev = s.n > 1 ? sqrt(s.stddev / (s.n - 1)) : 0;
+    return s;
+}
+
+// Two-sided 95% quantile of Student's t distribution.
+double t_quantile_95(double df) {
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1) return table[0];
+    return df <= 30 ? table[int(df) - 1] : 1.96;
+}
+
+// 95% confidence interval of current.mean - baseline.mean, with Welch's degrees of freedom.
+pair<double, double> difference_interval(const metric_stats &baseline, const metric_stats &current) {
+    double vb = baseline.stddev * baseline.stddev / max<size_t>(baseline.n, 1);
+    double vc = current.stddev * current.stddev / max<size_t>(current.n, 1);
+    double se = sqrt(vb + vc);
+    double df = 1;
+    if (vb + vc > 0) {
+        double denominator = (baseline.n > 1 ? vb * vb / (baseline.n - 1) : 0) +
+                             (current.n > 1 ? vc * vc / (current.n - 1) : 0);
+        df = denominator > 0 ? (vb + vc) * (vb + vc) / denominator : 1;
+    }
+    double diff = current.mean - baseline.mean, half = t_quantile_95(df) * se;
+    return {diff - half, diff + half};
+}
+
+// Just enough of a JSON reader for the files written by write_baseline_file.
+class json_reader {
+public:
+    explicit json_reader(string text_) : text(move(text_)) {}
+
+    // Metrics of the "metrics" object and the string fields of the "config" object.
+    bool parse(map<string, metric_stats> &metrics, map<string, string> &config) {
+        if (!expect('{')) return false;
+        while (true) {
+            string key;
+            if (!read_string(key) || !expect(':')) return false;
+            if (key == "metrics" || key == "config") {
+                if (!expect('{')) return false;
+                while (peek() != '}') {
+                    string name;
+                    if (!read_string(name) || !expect(':')) return false;
+                    if (key == "config") {
+                        string value;
+                        if (peek() == '"') {
+                            if (!read_string(value)) return false;
+                        } else value = read_token();
+                        config[name] = value;
+                    } else if (!read_metric(metrics[name])) return false;
+                    if (peek() == ',') ++pos;
+                }
+                ++pos;
+            } else {
+                read_token();
+            }
+            if (peek() == ',') ++pos;
+            else return expect('}');
+        }
+    }
+
+private:
+    string text;
+    size_t pos = 0;
+
+    char peek() {
+        while (pos < text.size() && isspace((unsigned char) text[pos])) ++pos;
+        return pos < text.size() ? text[pos] : '\0';
+    }
+
+    bool expect(char c) {
+        if (peek() != c) return false;
+        ++pos;
+        return true;
+    }
+
+    bool read_string(string &s) {
+        if (!expect('"')) return false;
+        s.clear();
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] == '\\' && pos + 1 < text.size()) ++pos;
+            s += text[pos++];
+        }
+        return expect('"');
+    }
+
+    // A number, true, false or null.
+    string read_token() {
+        peek();
+        size_t op = pos;
+        while (pos < text.size() && (isalnum((unsigned char) text[pos]) || strchr("+-.", text[pos]))) ++pos;
+        return text.substr(op, pos - op);
+    }
+
+    bool read_metric(metric_stats &s) {
+        if (!expect('{')) return false;
+        while (peek() != '}') {
+            string field;
+            if (!read_string(field) || !expect(':')) return false;
+            double value = atof(read_token().c_str());
+            if (field == "mean") s.mean = value;
+            else if (field == "stddev") s.stddev = value;
+            else if (field == "n") s.n = size_t(value);
+            if (peek() == ',') ++pos;
+        }
+        ++pos;
+        return true;
+    }
+};
+
+// Every metric is a latency in us, where lower is better, except throughput.
+bool higher_is_better(const string &metric) { return metric == "images_per_s"; }
+
+// Run the trials and collect one value per trial for every metric.
+map<string, vector<double>> run_trials(const gate_options &options, const packed_dataset &dataset) {
+    cnn cnn_instance(dataset.C, dataset.H, dataset.W, 0, options.kernel, options.model);
+    cnn_instance.optimize();
+    cnn_instance.set_cpu_layout(BLOCKED);
+    bool opencl = options.backend == "opencl";
+    auto &layers = cnn_instance.get_layers();
+
+    size_t next = 0;
+    auto forward = [&]() {
+        const uint8_t *image = dataset.image(next);
+        next = (next + 1) % dataset.N;
+        if (opencl) cnn_instance.opencl_forward(image);
+        else cnn_instance.cpu_forward(image);
+    };
+    for (size_t i = 0; i < options.warmup; i++) forward();
+
+    map<string, vector<double>> values;
+    for (size_t trial = 0; trial < options.trials; trial++) {
+        for (auto layer:layers) (opencl ? layer->opencl_time : layer->cpu_time).reset();
+        auto op = steady_clock::now();
+        for (size_t i = 0; i < options.images; i++) forward();
+        double seconds = duration<double>(steady_clock::now() - op).count();
+        values["forward_us"].push_back(seconds / options.images * 1e6);
+        values["images_per_s"].push_back(options.images / seconds);
+        for (size_t l = 0; l < layers.size(); l++) {
+            auto &time = opencl ? layers[l]->opencl_time : layers[l]->cpu_time;
+            values["layer_" + to_string(l) + "_" + layers[l]->type() + "_us"].push_back(time.mean_ns() / 1e3);
+        }
+    }
+    return values;
+}
+
+// Settings a baseline is only comparable under. Numbers are kept as their text, like json_reader returns them.
+// The kernel file is left out: changes to the kernels are what the gate measures.
+map<string, string> config_of(const gate_options &options) {
+    return {{"model",   options.model},
+            {"dataset", options.dataset},
+            {"backend", options.backend},
+            {"images",  to_string(options.images)},
+            {"warmup",  to_string(options.warmup)},
+            {"trials",  to_string(options.trials)}};
+}
+
+bool write_baseline_file(const string &file, const gate_options &options, const map<string, metric_stats> &metrics) {
+    ofstream fs(file);
+    if (!fs) return false;
+    auto config = config_of(options);
+    fs << "{\n  \"config\": {";
+    const char *separator = "";
+    for (auto &p:config) {
+        bool number = p.first == "images" || p.first == "warmup" || p.first == "trials";
+        fs << separator << json_string(p.first) << ": " << (number ? p.second : json_string(p.second));
+        separator = ", ";
+    }
+    fs << "},\n  \"metrics\": {";
+    separator = "\n";
+    for (auto &p:metrics) {
+        fs << separator << "    \"" << p.first << "\": {\"mean\": " << p.second.mean << ", \"stddev\": "
+           << p.second.stddev << ", \"n\": " << p.second.n << "}";
+        separator = ",\n";
+    }
+    fs << "\n  }\n}" << endl;
+    return bool(fs);
+}
+
+int main(int argc, char **argv) {
+    gate_options options;
+    bool usage = argc % 2 == 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string key = argv[i], value = argv[i + 1];
+        if (key == "--model") options.model = value;
+        else if (key == "--kernel") options.kernel = value;
+        else if (key == "--dataset") options.dataset = value;
+        else if (key == "--backend") options.backend = value;
+        else if (key == "--baseline") options.baseline = value;
+        else if (key == "--write-baseline") options.write_baseline = value;
+        else if (key == "--images") options.images = max(1, atoi(value.c_str()));
+        else if (key == "--trials") options.trials = max(2, atoi(value.c_str()));
+        else if (key == "--warmup") options.warmup = atoi(value.c_str());
+        else if (key == "--tolerance") options.tolerance = atof(value.c_str());
+        else usage = true;
+    }
+    if (usage || (options.backend != "cpu" && options.backend != "opencl") ||
+        options.baseline.empty() == options.write_baseline.empty()) {
+        cout << "Usage: " << argv[0] << " (--baseline FILE | --write-baseline FILE)\n"
+             << "       [--model FILE] [--kernel FILE] [--dataset FILE] [--backend cpu|opencl] [--images N]\n"
+             << "       [--trials N] [--warmup N] [--tolerance PERCENT]" << endl;
+        return 2;
+    }
+    packed_dataset dataset;
+    if (!dataset.open(options.dataset) || dataset.N == 0) {
+        cout << "Cannot open " << options.dataset << ", create it with pack_dataset" << endl;
+        return 2;
+    }
+
+    // Check the baseline before spending the trials on it.
+    map<string, metric_stats> baseline;
+    map<string, string> config;
+    if (!options.baseline.empty() && !json_reader(cnn::read_file(options.baseline)).parse(baseline, config)) {
+        cout << "Cannot read baseline " << options.baseline << endl;
+        return 2;
+    }
+    // Means over other images, trials or another model are not comparable, whatever the intervals say.
+    bool comparable = true;
+    for (auto &p:config_of(options)) {
+        if (options.baseline.empty() || config[p.first] == p.second) continue;
+        cout << "Baseline was recorded with " << p.first << " " << (config.count(p.first) ? config[p.first] : "unset")
+             << ", this run uses " << p.second << endl;
+        comparable = false;
+    }
+    if (!comparable) return 2;
+
+    map<string, metric_stats> current;
+    for (auto &p:run_trials(options, dataset)) current[p.first] = stats_of(p.second);
+
+    if (!options.write_baseline.empty()) {
+        if (!write_baseline_file(options.write_baseline, options, current)) {
+            cout << "Cannot write " << options.write_baseline << endl;
+            return 2;
+        }
+        cout << "Wrote baseline of " << current.size() << " metrics to " << options.write_baseline << endl;
+        return 0;
+    }
+
+    bool regressed = false;
+    cout << left << setw(28) << "metric" << right << setw(14) << "baseline" << setw(14) << "current"
+         << setw(10) << "change" << setw(27) << "95% CI of change" << "  verdict" << endl;
+    cout << fixed << setprecision(2);
+    for (auto &p:current) {
+        auto it = baseline.find(p.first);
+        if (it == baseline.end()) {
+            cout << left << setw(28) << p.first << right << setw(14) << "-" << setw(14) << p.second.mean
+                 << "  not in baseline" << endl;
+            continue;
+        }
+        auto &base = it->second;
+        auto ci = difference_interval(base, p.second);
+        double scale = base.mean ? 100 / base.mean : 0;
+        // Flip throughput so that a positive change is always worse.
+        double sign = higher_is_better(p.first) ? -1 : 1;
+        double worse_lo = sign > 0 ? ci.first : -ci.second, worse_hi = sign > 0 ? ci.second : -ci.first;
+        string verdict = "ok";
+        if (worse_lo * scale > options.tolerance) {
+            verdict = "REGRESSION";
+            regressed = true;
+        } else if (worse_hi * scale < -options.tolerance) verdict = "improved";
+        cout << left << setw(28) << p.first << right << setw(14) << base.mean << setw(14) << p.second.mean
+             << setw(9) << (p.second.mean - base.mean) * scale << "%"
+             << setw(10) << "[" << setw(6) << ci.first * scale << "%, " << setw(6) << ci.second * scale << "%]"
+             << "  " << verdict << endl;
+    }
+    for (auto &p:baseline)
+        if (!current.count(p.first)) cout << left << setw(28) << p.first << right << "  missing from this run" << endl;
+    cout << (regressed ? "Performance regression beyond " : "No regression beyond ") << options.tolerance << "%"
+         << endl;
+    return regressed ? 1 : 0;
+}
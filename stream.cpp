@@ -0,0 +1,135 @@
+#ifndef OPENCL_CNN_CONV_STREAM_CPP
+#define OPENCL_CNN_CONV_STREAM_CPP
+
+#include <bits/stdc++.h>
+#include "util.cpp"
+#include "dataset.cpp"
+
+using namespace std;
+
+// Loads image "index" of a dataset into dst and returns its label.
+typedef function<int(size_t index, uint8_t *dst)> image_loader;
+
+// Decode images from the BMP list on demand.
+image_loader bmp_list_loader(const string &file_list, const string &image_dir, int N) {
+    auto files = read_image_list(file_list, N);
+    return [files, image_dir](size_t index, uint8_t *dst) {
+        load_mnist_image(image_dir + files[index], dst);
+        return mnist_label(files[index]);
+    };
+}
+
+// Copy the undecoded pixel rows of every BMP in the list, for a network with a raw input.
+// All images must be stored with the same format, "size" bytes of pixels each.
+image_loader bmp_raw_loader(const string &file_list, const string &image_dir, int N, size_t size) {
+    auto files = read_image_list(file_list, N);
+    return [files, image_dir, size](size_t index, uint8_t *dst) {
+        size_t w, h, pixel_bytes, row_stride;
+        bool bottom_up;
+        bool ok = load_bmp_pixels(image_dir + files[index], dst, size, w, h, pixel_bytes, row_stride, bottom_up);
+        assert(ok && h * row_stride == size);
+        return mnist_label(files[index]);
+    };
+}
+
+// Copy images out of a packed dataset. The dataset must outlive the loader.
+image_loader packed_loader(const packed_dataset &dataset) {
+    const packed_dataset *source = &dataset;
+    return [source](size_t index, uint8_t *dst) {
+        memcpy(dst, source->image(index), source->C * source->H * source->W);
+        return int(source->labels[index]);
+    };
+}
+
+struct image_batch {
+    size_t first = 0; // Index of the first image in the dataset.
+    size_t count = 0; // Number of images in this batch.
+    size_t image_size = 0;
+    vector<uint8_t> images; // [count, image_size]
+    vector<int> labels; // [count]
+
+    const uint8_t *image(size_t i) const { return images.data() + i * image_size; }
+};
+
+// Reads a dataset on a background thread into a fixed ring of batches, while the caller consumes
+// the batches that are already loaded. Memory stays at ring_size batches whatever the dataset size.
+class dataset_stream {
+public:
+    dataset_stream(image_loader loader_, size_t N_, size_t image_size_, size_t batch_size_ = 64, size_t ring_size_ = 4) :
+            loader(move(loader_)), N(N_), batch_size(batch_size_), ring(ring_size_) {
+        for (auto &batch:ring) {
+            batch.image_size = image_size_;
+            batch.images.resize(batch_size * image_size_);
+            batch.labels.resize(batch_size);
+        }
+        producer = thread(&dataset_stream::produce, this);
+    }
+
+    dataset_stream(const dataset_stream &) = delete;
+
+    dataset_stream &operator=(const dataset_stream &) = delete;
+
+    // Wait for the next batch in dataset order, or return nullptr after the last one.
+    // The batch stays valid until the next call, which hands its slot back to the reader.
+    const image_batch *next() {
+        unique_lock<mutex> lock(m);
+        if (holding) {
+            holding = false;
+            ++consumed;
+            cv.notify_all();
+        }
+        cv.wait(lock, [this] { return filled > consumed || finished; });
+        if (filled == consumed) return nullptr;
+        holding = true;
+        return &ring[consumed % ring.size()];
+    }
+
+    ~dataset_stream() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        producer.join();
+    }
+
+private:
+    image_loader loader;
+    size_t N, batch_size;
+    vector<image_batch> ring;
+    thread producer;
+
+    mutex m;
+    condition_variable cv;
+    size_t filled = 0, consumed = 0; // Batches loaded / handed back so far.
+    bool holding = false, finished = false, stopping = false;
+
+    void produce() {
+        for (size_t first = 0; first < N; first += batch_size) {
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [this] { return filled - consumed < ring.size() || stopping; });
+                if (stopping) return;
+            }
+            // Only this thread writes "filled", and the slot is not visible to the consumer until it is bumped.
+            auto &batch = ring[filled % ring.size()];
+            batch.first = first;
+            batch.count = min(batch_size, N - first);
+            for (size_t i = 0; i < batch.count; i++) {
+                batch.labels[i] = loader(first + i, batch.images.data() + i * batch.image_size);
+            }
+            {
+                lock_guard<mutex> lock(m);
+                ++filled;
+            }
+            cv.notify_all();
+        }
+        {
+            lock_guard<mutex> lock(m);
+            finished = true;
+        }
+        cv.notify_all();
+    }
+};
+
+#endif //OPENCL_CNN_CONV_STREAM_CPP
@@ -0,0 +1,271 @@
+// Synthetic model and dataset generator for scaling benchmarks.
+// Writes a model.txt with the topology of the MNIST model at any size:
+//   (CONV -> QUAN -> RELU) x convs, POOL   for every stage width
+//                                          (the last conv has stride 2 instead of the POOL with --downsample conv,
+//                                          every CONV is DWCONV -> QUAN -> RELU -> PWCONV with --conv separable,
+//                                          the POOL is a 2x2 max or average pool after --pool)
+//   GAP                                    with --head gap, so the first FC has C instead of C * H * W inputs
+//   FC -> QUAN -> RELU                     unless --hidden is 0
+//   FC -> QUAN
+// and optionally a packed dataset (dataset.cpp) of random images of the matching shape.
+// Weights are random, and --density prunes CONV and FC weights to zero. Bias and shift of every QUAN are calibrated
+// on the first images with the planar cpu_* functions, so activations use the int8 range without wrapping instead of
+// collapsing to zero.
+// Labels are random as well: the files are for timing and verification, not accuracy.
+//
+// Usage: cnn_synth --model FILE [--dataset FILE] [--input CxHxW] [--widths W1,W2,...] [--convs N]
+//                  [--downsample pool|conv] [--conv dense|separable] [--pool max|avg] [--head fc|gap]
+//                  [--hidden N] [--classes N] [--density F] [--images N] [--calibration N] [--seed N]
+// e.g.   cnn_synth --model big.txt --dataset big.bin --input 3x224x224 --widths 64,64,64,64 --images 256
+
+#include "func.cpp"
+#include "model.cpp"
+#include "dataset.cpp"
+
+using namespace std;
+
+struct synth_options {
+    string model, dataset;
+    size_t C = 1, H = 28, W = 28;
+    vector<size_t> widths{16, 16}; // Output channels of the convs of every stage.
+    size_t convs = 1; // Convs per stage.
+    bool strided = false; // Downsample with a stride 2 conv instead of a pool.
+    bool separable = false; // Depthwise 3x3 and pointwise conv instead of a dense 3x3 conv.
+    bool average_pool = false;
+    bool gap = false; // Global average pool in front of the fc layers.
+    size_t hidden = 128; // Hidden fc size, 0 for none.
+    size_t classes = 10;
+    double density = 1; // Fraction of nonzero CONV and FC weights, for the sparse kernels.
+    size_t images = 1000;
+    size_t calibration = 4; // Images used to calibrate the quan layers.
+    unsigned seed = 1;
+};
+
+// Planar uint8 features of the calibration images, as they go through the network.
+struct calibration_features {
+    size_t C, H, W;
+    vector<vector<uint8_t>> images;
+};
+
+// Random weights in [-7, 7], of which about 1 - density are pruned to zero.
+vector<int8_t> random_weight(size_t size, mt19937 &rng, double density = 1) {
+    uniform_int_distribution<int> dist(-7, 7);
+    uniform_real_distribution<double> keep(0, 1);
+    vector<int8_t> weight(size);
+    for (auto &w:weight) w = int8_t(dist(rng));
+    if (density < 1)
+        for (auto &w:weight) if (keep(rng) >= density) w = 0;
+    return weight;
+}
+
+// Append QUAN (and RELU) for the int32 features "acc" of shape [C, H, W] and apply them to "features".
+// Every channel gets the bias that centres its calibration range and the smallest shift that fits it into int8.
+void add_quan(vector<layer_spec> &specs, size_t C, size_t H, size_t W, const vector<vector<int32_t>> &acc,
+              bool relu, calibration_features &features) {
+    layer_spec quan;
+    quan.type = "QUAN";
+    quan.C = C, quan.H = H, quan.W = W;
+    quan.bias.resize(C);
+    quan.shift.resize(C);
+    for (size_t c = 0; c < C; c++) {
+        int64_t lo = INT32_MAX, hi = INT32_MIN;
+        for (auto &a:acc) {
+            for (size_t p = 0; p < H * W; p++) {
+                lo = min<int64_t>(lo, a[c * H * W + p]);
+                hi = max<int64_t>(hi, a[c * H * W + p]);
+            }
+        }
+        int64_t bias = (lo + hi) / 2;
+        uint8_t shift = 0;
+        while (shift < 31 && (((hi - bias) >> shift) > INT8_MAX || ((lo - bias) >> shift) < INT8_MIN)) ++shift;
+        quan.bias[c] = int32_t(bias);
+        quan.shift[c] = shift;
+    }
+    specs.push_back(quan);
+    if (relu) {
+        layer_spec r;
+        r.type = "RELU";
+        r.C = C, r.H = H, r.W = W;
+        specs.push_back(r);
+    }
+    features.C = C, features.H = H, features.W = W;
+    for (size_t i = 0; i < acc.size(); i++) {
+        vector<int8_t> q(C * H * W);
+        cpu_quan(C, H, W, quan.bias.data(), quan.shift.data(), acc[i].data(), q.data());
+        features.images[i].resize(C * H * W);
+        if (relu) cpu_relu(C, H, W, q.data(), features.images[i].data());
+        else copy(q.begin(), q.end(), features.images[i].begin());
+    }
+}
+
+vector<layer_spec> synthesize(const synth_options &options, calibration_features &features, mt19937 &rng) {
+    vector<layer_spec> specs;
+    for (size_t width:options.widths) {
+        bool downsample = features.H >= 2 && features.W >= 2;
+        for (size_t k = 0; k < options.convs; k++) {
+            size_t stride = downsample && options.strided && k + 1 == options.convs ? 2 : 1;
+            if (options.separable) {
+                layer_spec dw;
+                dw.type = "DWCONV";
+                dw.C = features.C, dw.H = features.H, dw.W = features.W, dw.stride = stride;
+                dw.weight = random_weight(dw.C * dw.K * dw.K, rng);
+                specs.push_back(dw);
+                size_t HO = conv_output_size(dw.H, dw.K, dw.stride, dw.pad, dw.dilation);
+                size_t WO = conv_output_size(dw.W, dw.K, dw.stride, dw.pad, dw.dilation);
+                vector<vector<int32_t>> acc;
+                for (auto &image:features.images) {
+                    acc.emplace_back(dw.C * HO * WO);
+                    cpu_dwconv_generic(dw.C, dw.H, dw.W, dw.K, dw.stride, dw.pad, dw.dilation, HO, WO,
+                                       dw.weight.data(), image.data(), conv_epilogue(), nullptr, acc.back().data());
+                }
+                add_quan(specs, dw.C, HO, WO, acc, true, features);
+
+                layer_spec pw;
+                pw.type = "PWCONV";
+                pw.CI = features.C, pw.CO = width, pw.H = features.H, pw.W = features.W, pw.K = 1, pw.pad = 0;
+                pw.weight = random_weight(pw.CO * pw.CI, rng);
+                specs.push_back(pw);
+                acc.clear();
+                for (auto &image:features.images) {
+                    acc.emplace_back(pw.CO * pw.H * pw.W);
+                    cpu_pwconv_generic(pw.CI, pw.CO, pw.H, pw.W, pw.weight.data(), image.data(), conv_epilogue(),
+                                       nullptr, acc.back().data());
+                }
+                add_quan(specs, pw.CO, pw.H, pw.W, acc, true, features);
+                continue;
+            }
+            layer_spec conv;
+            conv.type = "CONV";
+            conv.CI = features.C, conv.CO = width, conv.H = features.H, conv.W = features.W, conv.stride = stride;
+            conv.weight = random_weight(conv.CO * conv.CI * conv.K * conv.K, rng, options.density);
+            specs.push_back(conv);
+            size_t HO = conv_output_size(conv.H, conv.K, conv.stride, conv.pad, conv.dilation);
+            size_t WO = conv_output_size(conv.W, conv.K, conv.stride, conv.pad, conv.dilation);
+            vector<vector<int32_t>> acc;
+            for (auto &image:features.images) {
+                acc.emplace_back(conv.CO * HO * WO);
+                cpu_conv_generic(conv.CI, conv.CO, conv.H, conv.W, conv.K, conv.stride, conv.pad, conv.dilation,
+                                 HO, WO, conv.weight.data(), image.data(), acc.back().data());
+            }
+            add_quan(specs, conv.CO, HO, WO, acc, true, features);
+        }
+        if (!downsample || options.strided) continue;
+        layer_spec pool;
+        pool.type = "POOL";
+        pool.C = features.C, pool.H = features.H, pool.W = features.W;
+        pool.K = pool.stride = 2, pool.pad = 0, pool.average = options.average_pool;
+        specs.push_back(pool);
+        size_t HO = pool_output_size(pool.H, pool.K, pool.stride), WO = pool_output_size(pool.W, pool.K, pool.stride);
+        for (auto &image:features.images) {
+            vector<uint8_t> out(features.C * HO * WO);
+            cpu_pool(pool.C, pool.H, pool.W, HO, WO, pool.K, pool.stride, pool.average, image.data(), out.data());
+            image = move(out);
+        }
+        features.H = HO, features.W = WO;
+    }
+    if (options.gap && features.H * features.W > 1) {
+        layer_spec gap;
+        gap.type = "GAP";
+        gap.C = features.C, gap.H = features.H, gap.W = features.W;
+        specs.push_back(gap);
+        for (auto &image:features.images) {
+            vector<uint8_t> out(features.C);
+            cpu_gap(gap.C, gap.H, gap.W, image.data(), out.data());
+            image = move(out);
+        }
+        features.H = features.W = 1;
+    }
+    vector<size_t> fc_sizes;
+    if (options.hidden) fc_sizes.push_back(options.hidden);
+    fc_sizes.push_back(options.classes);
+    for (size_t i = 0; i < fc_sizes.size(); i++) {
+        layer_spec fc;
+        fc.type = "FC";
+        fc.CI = features.C * features.H * features.W, fc.CO = fc_sizes[i];
+        fc.weight = random_weight(fc.CI * fc.CO, rng, options.density);
+        specs.push_back(fc);
+        vector<vector<int32_t>> acc;
+        for (auto &image:features.images) {
+            acc.emplace_back(fc.CO);
+            cpu_fc(fc.CI, fc.CO, fc.weight.data(), image.data(), acc.back().data());
+        }
+        add_quan(specs, fc.CO, 1, 1, acc, i + 1 < fc_sizes.size(), features);
+    }
+    return specs;
+}
+
+int main(int argc, char **argv) {
+    synth_options options;
+    bool usage = argc % 2 == 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string key = argv[i], value = argv[i + 1];
+        if (key == "--model") options.model = value;
+        else if (key == "--dataset") options.dataset = value;
+        else if (key == "--input") {
+            if (sscanf(value.c_str(), "%zux%zux%zu", &options.C, &options.H, &options.W) != 3) usage = true;
+        } else if (key == "--widths") {
+            options.widths.clear();
+            stringstream ss(value);
+            string width;
+            while (getline(ss, width, ',')) options.widths.push_back(atoi(width.c_str()));
+        } else if (key == "--convs") options.convs = max(1, atoi(value.c_str()));
+        else if (key == "--downsample") options.strided = value == "conv";
+        else if (key == "--conv") options.separable = value == "separable";
+        else if (key == "--pool") options.average_pool = value == "avg";
+        else if (key == "--head") options.gap = value == "gap";
+        else if (key == "--hidden") options.hidden = atoi(value.c_str());
+        else if (key == "--classes") options.classes = atoi(value.c_str());
+        else if (key == "--density") options.density = atof(value.c_str());
+        else if (key == "--images") options.images = atoi(value.c_str());
+        else if (key == "--calibration") options.calibration = max(1, atoi(value.c_str()));
+        else if (key == "--seed") options.seed = atoi(value.c_str());
+        else usage = true;
+    }
+    bool widths_ok = all_of(options.widths.begin(), options.widths.end(), [](size_t w) { return w > 0; });
+    if (usage || options.model.empty() || !widths_ok || options.C * options.H * options.W == 0 ||
+        options.classes == 0 || options.density <= 0 || options.density > 1) {
+        cout << "Usage: " << argv[0] << " --model FILE [--dataset FILE] [--input CxHxW] [--widths W1,W2,...]\n"
+             << "       [--convs N] [--downsample pool|conv] [--conv dense|separable] [--pool max|avg]\n"
+             << "       [--head fc|gap] [--hidden N] [--classes N] [--density F] [--images N] [--calibration N]\n"
+             << "       [--seed N]" << endl;
+        return 1;
+    }
+
+    mt19937 rng(options.seed);
+    size_t image_size = options.C * options.H * options.W;
+    size_t N = options.dataset.empty() ? options.calibration : max(options.images, options.calibration);
+    vector<uint8_t> images(N * image_size), labels(N);
+    uniform_int_distribution<int> pixel(0, 255), label(0, int(options.classes) - 1);
+    for (auto &p:images) p = uint8_t(pixel(rng));
+    for (auto &l:labels) l = uint8_t(label(rng));
+
+    calibration_features features{options.C, options.H, options.W, {}};
+    for (size_t i = 0; i < options.calibration; i++)
+        features.images.emplace_back(images.begin() + i * image_size, images.begin() + (i + 1) * image_size);
+    auto specs = synthesize(options, features, rng);
+
+    if (!write_model_file(options.model, specs)) {
+        cout << "Cannot write " << options.model << endl;
+        return 1;
+    }
+    double macs = 0;
+    for (auto &spec:specs) {
+        if (spec.type == "CONV" || spec.type == "DWCONV" || spec.type == "PWCONV") {
+            double filters = spec.type == "DWCONV" ? spec.C : double(spec.CO) * spec.CI;
+            macs += filters * spec.K * spec.K *
+                    conv_output_size(spec.H, spec.K, spec.stride, spec.pad, spec.dilation) *
+                    conv_output_size(spec.W, spec.K, spec.stride, spec.pad, spec.dilation);
+        } else if (spec.type == "FC") macs += double(spec.CI) * spec.CO;
+    }
+    cout << "Wrote " << specs.size() << " layers, about " << uint64_t(macs) << " MACs per image, to "
+         << options.model << endl;
+    if (options.dataset.empty()) return 0;
+    if (!write_packed_dataset(options.dataset, uint32_t(options.images), uint32_t(options.C), uint32_t(options.H),
+                              uint32_t(options.W), images.data(), labels.data())) {
+        cout << "Cannot write " << options.dataset << endl;
+        return 1;
+    }
+    cout << "Wrote " << options.images << " images of " << options.C << "x" << options.H << "x" << options.W
+         << " to " << options.dataset << endl;
+    return 0;
+}
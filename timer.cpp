@@ -5,24 +5,136 @@
 #ifndef OPENCL_CNN_CONV_TIMER_CPP
 #define OPENCL_CNN_CONV_TIMER_CPP
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
 
 using namespace std::chrono;
 
-static auto op = system_clock::now();
-static auto ed = system_clock::now();
+// Instrumentation switch, on by default. When off, a timed section costs one relaxed load
+// and the OpenCL layers are no longer synchronised after every kernel.
+static std::atomic<bool> instrumentation_on(true);
 
+inline bool instrumentation_enabled() { return instrumentation_on.load(std::memory_order_relaxed); }
 
-void start_timer() {
-    op = system_clock::now();
-}
+inline void set_instrumentation(bool on) { instrumentation_on.store(on, std::memory_order_relaxed); }
 
-//return in second
-double end_timer() {
-    ed = system_clock::now();
-    auto t = (ed - op).count() * 1.0 / 1e9;
-    return t;
+// Monotonic time in nanoseconds.
+inline uint64_t now_ns() {
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
 }
 
+// Log-bucketed latency histogram in nanoseconds, in the style of HdrHistogram.
+// Every power of two is split into SUB buckets, so a percentile is within 1 / SUB (about 6%) of the true value.
+// Lock-free, so any number of threads can record into the same histogram, and histograms of
+// several layers or threads can be merged.
+struct latency_histogram {
+    static const int SUB_BITS = 4, SUB = 1 << SUB_BITS;
+    static const int MAX_EXP = 47; // Durations of 2^48 ns (3 days) and more share the last bucket.
+    static const int BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB;
+
+    std::atomic<uint64_t> count{0}, total_ns{0}, max_ns{0};
+    std::atomic<uint64_t> buckets[BUCKETS];
+
+    latency_histogram() { reset(); }
+
+    latency_histogram(const latency_histogram &) = delete;
+
+    latency_histogram &operator=(const latency_histogram &) = delete;
+
+    static int bucket(uint64_t ns) {
+        if (ns < SUB) return int(ns);
+        int e = 63 - __builtin_clzll(ns);
+        if (e > MAX_EXP) return BUCKETS - 1;
+        return (e - SUB_BITS + 1) * SUB + int((ns >> (e - SUB_BITS)) & (SUB - 1));
+    }
+
+    // Middle of the range of durations that fall into bucket i.
+    static double bucket_value(int i) {
+        if (i < SUB) return i;
+        int e = i / SUB + SUB_BITS - 1;
+        double width = double(uint64_t(1) << (e - SUB_BITS));
+        return (SUB + i % SUB) * width + (width - 1) / 2;
+    }
+
+    void record(uint64_t ns) {
+        count.fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(ns, std::memory_order_relaxed);
+        buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t old = max_ns.load(std::memory_order_relaxed);
+        while (ns > old && !max_ns.compare_exchange_weak(old, ns, std::memory_order_relaxed));
+    }
+
+    void merge(const latency_histogram &other) {
+        count.fetch_add(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        total_ns.fetch_add(other.total_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (int i = 0; i < BUCKETS; i++)
+            buckets[i].fetch_add(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t ns = other.max_ns.load(std::memory_order_relaxed), old = max_ns.load(std::memory_order_relaxed);
+        while (ns > old && !max_ns.compare_exchange_weak(old, ns, std::memory_order_relaxed));
+    }
+
+    // Total time in seconds.
+    double seconds() const { return total_ns.load(std::memory_order_relaxed) / 1e9; }
+
+    double mean_ns() const {
+        uint64_t n = count.load(std::memory_order_relaxed);
+        return n ? double(total_ns.load(std::memory_order_relaxed)) / n : 0;
+    }
+
+    // Nearest-rank percentile in nanoseconds, p in [0, 100].
+    double percentile_ns(double p) const {
+        uint64_t n = count.load(std::memory_order_relaxed);
+        if (n == 0) return 0;
+        auto rank = uint64_t(std::ceil(p / 100 * n));
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(bucket_value(i), double(max_ns.load(std::memory_order_relaxed)));
+        }
+        return double(max_ns.load(std::memory_order_relaxed));
+    }
+
+    // "count 10000, mean 82.10 us, p50 80.50 us, p99 120.50 us, p999 301.00 us, max 660.21 us"
+    std::string summary() const {
+        char s[160];
+        snprintf(s, sizeof(s), "count %llu, mean %.2f us, p50 %.2f us, p99 %.2f us, p999 %.2f us, max %.2f us",
+                 (unsigned long long) count.load(std::memory_order_relaxed), mean_ns() / 1e3,
+                 percentile_ns(50) / 1e3, percentile_ns(99) / 1e3, percentile_ns(99.9) / 1e3,
+                 max_ns.load(std::memory_order_relaxed) / 1e3);
+        return s;
+    }
+
+    void reset() {
+        count = 0;
+        total_ns = 0;
+        max_ns = 0;
+        for (auto &b:buckets) b = 0;
+    }
+};
+
+// Records the lifetime of a scope into a histogram, if instrumentation was on when it started.
+class scoped_timer {
+    latency_histogram *counter;
+    uint64_t op = 0;
+
+public:
+    explicit scoped_timer(latency_histogram &counter_) : counter(instrumentation_enabled() ? &counter_ : nullptr) {
+        if (counter) op = now_ns();
+    }
+
+    scoped_timer(const scoped_timer &) = delete;
+
+    scoped_timer &operator=(const scoped_timer &) = delete;
+
+    ~scoped_timer() {
+        if (counter) counter->record(now_ns() - op);
+    }
+};
 
 #endif //OPENCL_CNN_CONV_TIMER_CPP
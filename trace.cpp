@@ -0,0 +1,138 @@
+#ifndef OPENCL_CNN_CONV_TRACE_CPP
+#define OPENCL_CNN_CONV_TRACE_CPP
+
+#include <bits/stdc++.h>
+#include <CL/opencl.h>
+#include "timer.cpp"
+#include "util.cpp"
+
+using namespace std;
+
+// Timeline of host spans and OpenCL commands, written as Chrome trace JSON
+// (chrome://tracing or ui.perfetto.dev). Off by default; while off every hook is one relaxed load.
+//
+// Process 1 holds one track per host thread with the forward and per-layer spans.
+// Process 2 holds the device: one track per host thread with the execution (START -> END) of every
+// write, kernel and read, "idle" spans where the device waited for the host, and async
+// "queued" spans from QUEUED to START, with all four profiling timestamps as arguments.
+// Device timestamps are moved onto the host clock with the offset of the first command of the thread.
+class trace_recorder {
+public:
+    bool enabled() const { return on.load(memory_order_relaxed); }
+
+    void enable(bool on_) { on.store(on_, memory_order_relaxed); }
+
+    // A finished span on the calling thread.
+    void host_span(const string &name, const char *category, uint64_t begin_ns, uint64_t end_ns) {
+        add({name, category, 'X', begin_ns, end_ns - begin_ns, 1, thread_index(), 0, ""});
+    }
+
+    // Remember an enqueued command, recorded by flush_opencl once it has finished.
+    // host_ns is the host time just before the enqueue call.
+    void opencl_command(cl_event event, const string &name, uint64_t host_ns) {
+        clRetainEvent(event);
+        thread_state().pending.push_back({event, name, host_ns});
+    }
+
+    // Record every remembered command of this thread. They must have finished, e.g. after a blocking read.
+    void flush_opencl() {
+        auto &state = thread_state();
+        for (auto &command:state.pending) {
+            cl_ulong t[4];
+            for (int i = 0; i < 4; i++)
+                clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_QUEUED + i, sizeof(cl_ulong), &t[i], nullptr);
+            clReleaseEvent(command.event);
+            if (!state.aligned) {
+                state.offset = int64_t(command.host_ns) - int64_t(t[0]);
+                state.aligned = true;
+            }
+            uint64_t queued = t[0] + state.offset, submit = t[1] + state.offset;
+            uint64_t start = t[2] + state.offset, end = t[3] + state.offset;
+            int tid = thread_index();
+            if (state.last_end && start > state.last_end)
+                add({"idle", "device", 'X', state.last_end, start - state.last_end, 2, tid, 0, ""});
+            state.last_end = max(state.last_end, end);
+
+            string args = "{\"queued\": " + to_string(t[0]) + ", \"submit\": " + to_string(t[1]) +
+                          ", \"start\": " + to_string(t[2]) + ", \"end\": " + to_string(t[3]) +
+                          ", \"submit_delay_us\": " + to_string((submit - queued) / 1e3) + "}";
+            add({command.name, "device", 'X', start, end - start, 2, tid, 0, args});
+            uint64_t id = next_id++;
+            add({command.name, "queued", 'b', queued, 0, 2, tid, id, args});
+            add({command.name, "queued", 'e', start, 0, 2, tid, id, ""});
+        }
+        state.pending.clear();
+    }
+
+    // Write the recorded events. Returns false if the file cannot be written.
+    bool write(const string &file) {
+        lock_guard<mutex> lock(m);
+        ofstream fs(file);
+        if (!fs) return false;
+        fs << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n"
+           << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"host\"}},\n"
+           << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"opencl device\"}}";
+        fs << fixed << setprecision(3);
+        for (auto &e:events) {
+            fs << ",\n{\"name\": " << json_string(e.name) << ", \"cat\": " << json_string(e.category)
+               << ", \"ph\": \"" << e.phase << "\", \"ts\": " << e.ts_ns / 1e3 << ", \"pid\": " << e.pid
+               << ", \"tid\": " << e.tid;
+            if (e.phase == 'X') fs << ", \"dur\": " << e.dur_ns / 1e3;
+            if (e.phase == 'b' || e.phase == 'e') fs << ", \"id\": " << e.id;
+            if (!e.args.empty()) fs << ", \"args\": " << e.args;
+            fs << "}";
+        }
+        fs << "\n]}" << endl;
+        return bool(fs);
+    }
+
+private:
+    struct trace_event {
+        string name;
+        const char *category;
+        char phase; // 'X' complete span, 'b' / 'e' async begin / end
+        uint64_t ts_ns, dur_ns;
+        int pid, tid;
+        uint64_t id;
+        string args; // JSON object or empty
+    };
+
+    struct pending_command {
+        cl_event event;
+        string name;
+        uint64_t host_ns;
+    };
+
+    struct per_thread {
+        vector<pending_command> pending;
+        int64_t offset = 0; // Host minus device clock.
+        bool aligned = false;
+        uint64_t last_end = 0; // End of the previous command on the device track.
+    };
+
+    atomic<bool> on{false};
+    atomic<uint64_t> next_id{1};
+    atomic<int> threads{0};
+    mutex m;
+    vector<trace_event> events;
+
+    void add(trace_event e) {
+        lock_guard<mutex> lock(m);
+        events.push_back(move(e));
+    }
+
+    int thread_index() {
+        static thread_local int index = threads++;
+        return index;
+    }
+
+    static per_thread &thread_state() {
+        static thread_local per_thread state;
+        return state;
+    }
+};
+
+// The recorder used by cnn. Enable it, run, then write().
+static trace_recorder tracer;
+
+#endif //OPENCL_CNN_CONV_TRACE_CPP
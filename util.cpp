@@ -10,6 +10,19 @@
 
 using namespace std;
 
+// JSON string literal. Paths may contain backslashes on Windows, and layer names anything.
+string json_string(const string &s) {
+    string r = "\"";
+    for (char c:s) {
+        if (c == '"' || c == '\\') r += '\\';
+        if (uint8_t(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            r += escaped;
+        } else r += c;
+    }
+    return r + '"';
+}
 
 void load_one_image(const string &file_path, void *buffer, size_t &w, size_t &h) {
     auto image = FreeImage_Load(FreeImage_GetFileType(file_path.c_str(), 0), file_path.c_str());
@@ -25,26 +38,150 @@ void load_one_image(const string &file_path, void *buffer, size_t &w, size_t &h)
     FreeImage_Unload(image);
 }
 
-void load_mnist(int N, const string &file_list, const string &image_dir, uint8_t images[][784], int *labels) {
+// Little-endian field of a BMP header.
+inline uint32_t bmp_field(const uint8_t *p, int bytes) {
+    uint32_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) v = (v << 8u) | p[i];
+    return v;
+}
+
+// Decode an uncompressed 8, 24 or 32 bit BMP into one byte per pixel, top row first, without FreeImage.
+// "channel" is the byte of the BGRA pixel load_one_image would produce (0 = blue, 3 = alpha).
+// Rows are read in chunks through a stack buffer and written straight into dst, which holds max_size bytes.
+// Returns false for any other format, so the caller can fall back to load_one_image.
+bool load_bmp_channel(const string &file_path, uint8_t *dst, size_t max_size, size_t &w, size_t &h,
+                      int channel = 0) {
+    FILE *fp = fopen(file_path.c_str(), "rb");
+    if (!fp) return false;
+    // File header (14 bytes) + BITMAPINFOHEADER (40 bytes) + up to 256 palette entries.
+    uint8_t header[14 + 40 + 256 * 4];
+    size_t header_size = fread(header, 1, sizeof(header), fp);
+    uint32_t info_size = bmp_field(header + 14, 4);
+    if (header_size < 54 || header[0] != 'B' || header[1] != 'M' || info_size < 40 ||
+        bmp_field(header + 30, 4) != 0) { // Only BI_RGB
+        fclose(fp);
+        return false;
+    }
+    uint32_t offset = bmp_field(header + 10, 4);
+    auto width = int32_t(bmp_field(header + 18, 4)), height = int32_t(bmp_field(header + 22, 4));
+    uint32_t bpp = bmp_field(header + 28, 2);
+    bool bottom_up = height > 0;
+    w = width;
+    h = bottom_up ? height : -height;
+    if (width <= 0 || (bpp != 8 && bpp != 24 && bpp != 32) || w * h > max_size) {
+        fclose(fp);
+        return false;
+    }
+
+    // Palette for 8 bit images. FreeImage converts them through the palette with alpha 255.
+    uint8_t palette[256][4];
+    if (bpp == 8) {
+        uint32_t colors = bmp_field(header + 46, 4);
+        if (colors == 0 || colors > 256) colors = 256;
+        const uint8_t *table = header + 14 + info_size;
+        for (uint32_t i = 0; i < 256; i++) {
+            bool present = i < colors && table + i * 4 + 4 <= header + header_size;
+            for (int k = 0; k < 3; k++) palette[i][k] = present ? table[i * 4 + k] : 0;
+            palette[i][3] = 255;
+        }
+    }
+
+    size_t pixel_bytes = bpp / 8, row_bytes = w * pixel_bytes, stride = (w * bpp + 31) / 32 * 4;
+    uint8_t chunk[4096 / 12 * 12]; // A whole number of 8, 24 and 32 bit pixels.
+    bool ok = fseek(fp, offset, SEEK_SET) == 0;
+    for (size_t r = 0; ok && r < h; r++) {
+        uint8_t *out = dst + (bottom_up ? h - 1 - r : r) * w;
+        for (size_t done = 0; ok && done < row_bytes;) {
+            size_t n = min(sizeof(chunk), row_bytes - done);
+            ok = fread(chunk, 1, n, fp) == n;
+            size_t pixels = n / pixel_bytes;
+            if (bpp == 8) for (size_t i = 0; i < pixels; i++) out[i] = palette[chunk[i]][channel];
+            else if (channel < 3 || bpp == 32) for (size_t i = 0; i < pixels; i++) out[i] = chunk[i * pixel_bytes + channel];
+            else for (size_t i = 0; i < pixels; i++) out[i] = 255; // 24 bit has no alpha
+            out += pixels;
+            done += n;
+        }
+        if (stride > row_bytes) ok = ok && fseek(fp, stride - row_bytes, SEEK_CUR) == 0;
+    }
+    fclose(fp);
+    return ok;
+}
+
+// Copy the pixel array of an uncompressed 24 or 32 bit BMP into dst as stored: bottom_up rows of
+// row_stride bytes, pixel_bytes bytes per BGR(A) pixel. Nothing is decoded, see preprocess_layer.
+// Returns false for any other format or if the pixels do not fit in max_size bytes.
+bool load_bmp_pixels(const string &file_path, uint8_t *dst, size_t max_size, size_t &w, size_t &h,
+                     size_t &pixel_bytes, size_t &row_stride, bool &bottom_up) {
+    FILE *fp = fopen(file_path.c_str(), "rb");
+    if (!fp) return false;
+    uint8_t header[54] = {};
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) && header[0] == 'B' && header[1] == 'M' &&
+              bmp_field(header + 14, 4) >= 40 && bmp_field(header + 30, 4) == 0; // Only BI_RGB
+    auto width = int32_t(bmp_field(header + 18, 4)), height = int32_t(bmp_field(header + 22, 4));
+    uint32_t bpp = bmp_field(header + 28, 2);
+    bottom_up = height > 0;
+    w = width;
+    h = bottom_up ? height : -height;
+    pixel_bytes = bpp / 8;
+    row_stride = (w * bpp + 31) / 32 * 4;
+    ok = ok && width > 0 && (bpp == 24 || bpp == 32) && h * row_stride <= max_size &&
+         fseek(fp, bmp_field(header + 10, 4), SEEK_SET) == 0 && fread(dst, 1, h * row_stride, fp) == h * row_stride;
+    fclose(fp);
+    return ok;
+}
+
+// Read the first N file names of an image list.
+vector<string> read_image_list(const string &file_list, int N) {
     ifstream fs(file_list);
-    string file;
+    vector<string> files(N);
+    for (auto &file:files) fs >> file;
+    return files;
+}
+
+// The label is part of the file name, e.g. "0000.7.bmp".
+inline int mnist_label(const string &file) {
+    return file[5] - '0';
+}
+
+// Decode one 28x28 image into dst, top row first.
+void load_mnist_image(const string &file_path, uint8_t *dst) {
+    size_t image_h, image_w;
+    // Fast path: the built-in decoder already writes the top row first.
+    if (load_bmp_channel(file_path, dst, 784, image_w, image_h)) {
+        assert(image_w == 28 && image_h == 28);
+        return;
+    }
     // 图片需要翻转一下，零坐标点在左上角，这样才符合神经网络的输入的权重的输入模式
     uint8_t temp[1 * 28 * 28 * 4];
-    for (int n = 0; n < N; n++) {
-        fs >> file;
-        labels[n] = file[5] - '0';
-        file = image_dir + file;
-        size_t image_h, image_w;
-        load_one_image(file, temp, image_w, image_h);
-        assert(image_w == 28 && image_h == 28);
-        for (int i = 0; i < 28; i++) {
-            for (int j = 0; j < 28; j++) {
-                images[n][i * 28 + j] = temp[((27 - i) * 28 + j) * 4];
-            }
+    load_one_image(file_path, temp, image_w, image_h);
+    assert(image_w == 28 && image_h == 28);
+    for (int i = 0; i < 28; i++) {
+        for (int j = 0; j < 28; j++) {
+            dst[i * 28 + j] = temp[((27 - i) * 28 + j) * 4];
         }
     }
 }
 
+// Decode the N images listed in file_list in parallel.
+// load_one_image keeps no shared state, so every thread decodes its own files with its own temp buffer
+// and writes the result straight into images[n]. Labels are read from the list first, so they keep its order.
+// threads = 0 uses one thread per hardware thread.
+void load_mnist(int N, const string &file_list, const string &image_dir, uint8_t images[][784], int *labels,
+                unsigned threads = 0) {
+    auto files = read_image_list(file_list, N);
+    for (int n = 0; n < N; n++) labels[n] = mnist_label(files[n]);
+
+    atomic<int> next(0);
+    auto worker = [&]() {
+        for (int n = next++; n < N; n = next++) load_mnist_image(image_dir + files[n], images[n]);
+    };
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto &t:pool) t.join();
+}
+
 void print_one_images(uint8_t images[][784], int i) {
     static ofstream fs("../images.txt");
     for (int row = 0; row < 28; row++) {
@@ -0,0 +1,222 @@
+// Bit-exact differential verification. Runs the same images through every backend and kernel variant and
+// compares every intermediate feature with the reference: the planar cpu_* functions on the parsed model,
+// with cpu_conv_generic in place of the conv fast paths and dense int8 weights everywhere.
+// Rewritten graphs are matched to the model through layer::model_index. Features that only exist after a
+// rewrite (the int32 pool of pool_before_quan) are covered by the next layer that has a model counterpart.
+// Prints the first mismatching image, layer, channel and pixel of every variant, and exits 1 on any mismatch.
+//
+// The generated model (cnn_codegen) only exposes its logits, and it is compiled from the model.txt of the
+// source tree, so leave it out with --generated off when verifying another model.
+// --variants runs only the variants whose name contains the given text, e.g. "generated" or "optimized".
+//
+// Usage: cnn_verify [--model FILE] [--kernel FILE] [--dataset FILE] [--images N] [--generated on|off]
+//                   [--variants TEXT]
+
+#include "cnn.cpp"
+#include "dataset.cpp"
+#include "generated_model.h"
+
+using namespace std;
+
+struct verify_options {
+    string model = "../model.txt";
+    string kernel = "../kernel.cl";
+    string dataset = "../mnist.bin";
+    size_t images = 0; // 0 for the whole dataset.
+    bool generated = true;
+    string variants; // Substring of the variant names to run, empty for all.
+};
+
+struct variant {
+    string name;
+    bool opencl;
+    bool optimized; // cnn::optimize applied.
+    cpu_layout layout;
+    bool raw; // Raw BMP rows through a preprocess layer.
+    bool sparse; // Every conv and fc on the sparse kernels, whatever their density.
+    bool int8; // int8 weights everywhere, also where they fit in int4.
+    bool int4; // int4 conv weights too, where they fit, instead of INT4_CONV_WEIGHTS.
+};
+
+const vector<variant> VARIANTS = {
+        {"cpu planar",             false, false, PLANAR,  false, false, false, false},
+        {"cpu blocked",            false, false, BLOCKED, false, false, false, false},
+        {"opencl",                 true,  false, PLANAR,  false, false, false, false},
+        {"cpu planar optimized",   false, true,  PLANAR,  false, false, false, false},
+        {"cpu blocked optimized",  false, true,  BLOCKED, false, false, false, false},
+        {"opencl optimized",       true,  true,  PLANAR,  false, false, false, false},
+        {"cpu blocked raw input",  false, true,  BLOCKED, true,  false, false, false},
+        {"opencl raw input",       true,  true,  PLANAR,  true,  false, false, false},
+        {"cpu planar sparse",      false, true,  PLANAR,  false, true,  false, false},
+        {"cpu blocked sparse",     false, true,  BLOCKED, false, true,  false, false},
+        {"opencl sparse",          true,  true,  PLANAR,  false, true,  false, false},
+        {"cpu planar int8",        false, true,  PLANAR,  false, false, true,  false},
+        {"cpu blocked int8",       false, true,  BLOCKED, false, false, true,  false},
+        {"opencl int8",            true,  true,  PLANAR,  false, false, true,  false},
+        {"cpu planar int4",        false, true,  PLANAR,  false, false, false, true},
+        {"cpu blocked int4",       false, true,  BLOCKED, false, false, false, true},
+        {"opencl int4",            true,  true,  PLANAR,  false, false, false, true},
+};
+
+// 32-bit bottom-up BMP rows holding the image in byte 2 of every pixel and noise in the others.
+raw_image_format raw_format(size_t H, size_t W) { return {H, W, 4, W * 4, 2, true}; }
+
+void to_raw(const raw_image_format &format, const uint8_t *image, uint8_t *raw) {
+    for (size_t r = 0; r < format.H; r++) {
+        for (size_t i = 0; i < format.row_stride; i++) raw[r * format.row_stride + i] = uint8_t(r * 31 + i * 7);
+        for (size_t w = 0; w < format.W; w++)
+            raw[r * format.row_stride + w * format.pixel_bytes + format.channel] = image[(format.H - 1 - r) * format.W + w];
+    }
+}
+
+// Output of every layer of one forward, in layer order.
+struct captured_feature {
+    layer *source;
+    vector<int32_t> values;
+};
+
+// Forward one image and capture every layer output. Returns the predicted class.
+size_t capture(cnn &net, bool opencl, const uint8_t *input, vector<captured_feature> &features) {
+    features.clear();
+    net.set_layer_observer([&](layer *l) {
+        features.push_back({l, opencl ? l->opencl_output() : l->cpu_output()});
+    });
+    size_t rc = opencl ? net.opencl_forward(input) : net.cpu_forward(input);
+    net.set_layer_observer(nullptr);
+    return rc;
+}
+
+// First difference of "got" against "expected", described as layer, channel and pixel. Empty if equal.
+string first_mismatch(layer *l, const string &model_layer, const vector<int32_t> &expected,
+                      const vector<int32_t> &got) {
+    auto shape = l->output_shape();
+    stringstream ss;
+    ss << l->type() << " (model layer " << l->model_index << ' ' << model_layer << ")";
+    if (expected.size() != got.size()) {
+        ss << ": " << got.size() << " values, expected " << expected.size();
+        return ss.str();
+    }
+    for (size_t i = 0; i < got.size(); i++) {
+        if (got[i] == expected[i]) continue;
+        size_t plane = shape.H * shape.W;
+        ss << ": channel " << i / plane << ", pixel (" << i % plane / shape.W << ", " << i % shape.W
+           << "), expected " << expected[i] << ", got " << got[i];
+        return ss.str();
+    }
+    return "";
+}
+
+int main(int argc, char **argv) {
+    verify_options options;
+    bool usage = argc % 2 == 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string key = argv[i], value = argv[i + 1];
+        if (key == "--model") options.model = value;
+        else if (key == "--kernel") options.kernel = value;
+        else if (key == "--dataset") options.dataset = value;
+        else if (key == "--images") options.images = atoi(value.c_str());
+        else if (key == "--generated") options.generated = value != "off";
+        else if (key == "--variants") options.variants = value;
+        else usage = true;
+    }
+    if (usage) {
+        cout << "Usage: " << argv[0] << " [--model FILE] [--kernel FILE] [--dataset FILE] [--images N]"
+             << " [--generated on|off] [--variants TEXT]" << endl;
+        return 2;
+    }
+    packed_dataset dataset;
+    if (!dataset.open(options.dataset) || dataset.N == 0) {
+        cout << "Cannot open " << options.dataset << ", create it with pack_dataset" << endl;
+        return 2;
+    }
+    size_t N = options.images ? min<size_t>(options.images, dataset.N) : dataset.N;
+    cnn reference(dataset.C, dataset.H, dataset.W, 0, options.kernel, options.model);
+    reference.set_generic_conv(true);
+    reference.set_sparse_threshold(0, 0);
+    reference.set_int4_weights(false, false);
+    const size_t FEATURE = reference.feature_size();
+    // Type of every model layer, for the reports.
+    map<size_t, string> model_layers;
+    for (auto l:reference.get_layers()) model_layers[l->model_index] = l->type();
+
+    auto selected = [&](const string &name) { return name.find(options.variants) != string::npos; };
+    // The preprocess layer only produces single channel inputs.
+    vector<variant> variants;
+    for (auto &v:VARIANTS)
+        if (selected(v.name) && (!v.raw || dataset.C == 1)) variants.push_back(v);
+    vector<unique_ptr<cnn>> nets;
+    for (auto &v:variants) {
+        nets.emplace_back(new cnn(dataset.C, dataset.H, dataset.W, FEATURE, options.kernel, options.model));
+        if (v.optimized) nets.back()->optimize();
+        if (v.raw) nets.back()->set_raw_input(raw_format(dataset.H, dataset.W));
+        if (v.sparse) nets.back()->set_sparse_threshold(2, 2);
+        if (v.int8) nets.back()->set_int4_weights(false, false);
+        if (v.int4) nets.back()->set_int4_weights(true, true);
+        nets.back()->set_cpu_layout(v.layout);
+    }
+    bool generated = options.generated && selected("generated");
+    if (generated && (generated_model_input_size != dataset.C * dataset.H * dataset.W ||
+                      generated_model_output_size != FEATURE)) {
+        cout << "Generated model does not match the dataset, skipped" << endl;
+        generated = false;
+    }
+
+    size_t variant_count = variants.size() + (generated ? 1 : 0);
+    if (variant_count == 0) {
+        cout << "No variant matches " << options.variants << endl;
+        return 2;
+    }
+    vector<size_t> mismatching_images(variant_count, 0), mismatching_predictions(variant_count, 0);
+    vector<string> first_report(variant_count);
+    vector<captured_feature> expected, got;
+    vector<uint8_t> raw(raw_format(dataset.H, dataset.W).size());
+    vector<int8_t> logits(FEATURE);
+
+    for (size_t i = 0; i < N; i++) {
+        const uint8_t *image = dataset.image(i);
+        size_t expected_class = capture(reference, false, image, expected);
+        map<size_t, const vector<int32_t> *> expected_by_model;
+        for (auto &f:expected) expected_by_model[f.source->model_index] = &f.values;
+        to_raw(raw_format(dataset.H, dataset.W), image, raw.data());
+
+        for (size_t v = 0; v < variants.size(); v++) {
+            size_t predicted = capture(*nets[v], variants[v].opencl, variants[v].raw ? raw.data() : image, got);
+            if (predicted != expected_class) ++mismatching_predictions[v];
+            for (auto &f:got) {
+                auto it = expected_by_model.find(f.source->model_index);
+                if (it == expected_by_model.end()) continue;
+                string report = first_mismatch(f.source, model_layers[it->first], *it->second, f.values);
+                if (report.empty()) continue;
+                if (mismatching_images[v]++ == 0) first_report[v] = "image " + to_string(i) + ", " + report;
+                break;
+            }
+        }
+        if (generated) {
+            size_t v = variants.size();
+            if (generated_model_forward(image, logits.data()) != expected_class) ++mismatching_predictions[v];
+            auto &last = expected.back().values;
+            for (size_t k = 0; k < FEATURE; k++) {
+                if (logits[k] == last[k]) continue;
+                if (mismatching_images[v]++ == 0)
+                    first_report[v] = "image " + to_string(i) + ", logit " + to_string(k) + ", expected " +
+                                      to_string(last[k]) + ", got " + to_string(logits[k]);
+                break;
+            }
+        }
+    }
+
+    bool exact = true;
+    cout << "Reference: cpu planar with generic conv, " << N << " images" << endl;
+    for (size_t v = 0; v < variant_count; v++) {
+        string name = v < variants.size() ? variants[v].name : "generated";
+        cout << left << setw(24) << name << right;
+        if (mismatching_images[v] == 0) {
+            cout << "bit-exact" << endl;
+            continue;
+        }
+        exact = false;
+        cout << mismatching_images[v] << " images differ, " << mismatching_predictions[v]
+             << " predictions differ. First: " << first_report[v] << endl;
+    }
+    return exact ? 0 : 1;
+}